@@ -0,0 +1,299 @@
+#include "../tox_extension_messages.c"
+
+#include <toxext/toxext.h>
+#include <toxext/mock_fixtures.h>
+#include <assert.h>
+
+#define NUM_PEERS 5
+/* Nobody has this id so negotiations with it are never answered */
+#define SILENT_FRIEND 50000
+
+static uint64_t now = 0;
+static uint32_t negotiated_order[NUM_PEERS + 4];
+static size_t negotiated_count = 0;
+static size_t incompatible_count = 0;
+static size_t messages_received = 0;
+static size_t last_received_size = 0;
+
+static void test_cb(uint32_t friend_number, uint8_t const *message,
+		    size_t length, void *user_data)
+{
+	(void)friend_number;
+	(void)message;
+	(void)user_data;
+	messages_received++;
+	last_received_size = length;
+}
+
+static void test_receipt_cb(uint32_t friend_number, const uint64_t receipt_id,
+			    void *user_data)
+{
+	(void)friend_number;
+	(void)receipt_id;
+	(void)user_data;
+}
+
+static void hub_neg_cb(uint32_t friend_number, bool compatible,
+		       uint64_t max_sending_size, void *user_data)
+{
+	(void)max_sending_size;
+	(void)user_data;
+	if (compatible) {
+		negotiated_order[negotiated_count++] = friend_number;
+	} else {
+		incompatible_count++;
+	}
+}
+
+static void peer_neg_cb(uint32_t friend_number, bool compatible,
+			uint64_t max_sending_size, void *user_data)
+{
+	(void)friend_number;
+	(void)compatible;
+	(void)max_sending_size;
+	(void)user_data;
+}
+
+static uint64_t test_clock(void *clock_user_data)
+{
+	(void)clock_user_data;
+	return now;
+}
+
+static void iterate_all(struct ToxExtUser *hub, struct ToxExtUser *peers,
+			size_t num_peers)
+{
+	for (size_t round = 0; round < 2; ++round) {
+		for (size_t i = 0; i < num_peers; ++i) {
+			tox_iterate(peers[i].tox_user.tox, &peers[i].tox_user);
+		}
+		tox_iterate(hub->tox_user.tox, &hub->tox_user);
+	}
+}
+
+static void advance(struct ToxExtUser *hub, struct ToxExtUser *peers,
+		    size_t num_peers, struct ToxExtensionMessages *hub_ext,
+		    uint64_t time)
+{
+	now = time;
+	tox_extension_messages_iterate(hub_ext);
+	iterate_all(hub, peers, num_peers);
+}
+
+static void assert_progress(struct ToxExtensionMessages *extension,
+			    size_t queued, size_t in_flight, size_t negotiated,
+			    size_t failed)
+{
+	struct Tox_Extension_Messages_Negotiation_Progress progress;
+	tox_extension_messages_get_negotiation_progress(extension, &progress);
+	assert(progress.queued == queued);
+	assert(progress.in_flight == in_flight);
+	assert(progress.negotiated == negotiated);
+	assert(progress.failed == failed);
+	assert(progress.total == queued + in_flight + negotiated + failed);
+}
+
+/*
+ * Negotiating again with a friend we're negotiated with, as a retry does,
+ * keeps the message it's halfway through sending and the credit for it
+ */
+static void test_negotiating_again(struct ToxExtUser *hub,
+				   struct ToxExtUser *peers, size_t num_peers,
+				   struct ToxExtensionMessages *hub_ext,
+				   struct ToxExtensionMessages *peer_ext)
+{
+	uint32_t const peer = peers[0].tox_user.id;
+	tox_extension_messages_set_receive_window(hub_ext, 4);
+	iterate_all(hub, peers, num_peers);
+
+	static uint8_t large_message[TOXEXT_MAX_SEGMENT_SIZE * 10];
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(peers[0].toxext, hub->tox_user.id);
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_append(peer_ext, packet_list, large_message,
+				      sizeof(large_message), hub->tox_user.id,
+				      &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	toxext_send(packet_list);
+	tox_iterate(hub->tox_user.tox, &hub->tox_user);
+	assert(get_friend_data(hub_ext, peer)->message.size > 0);
+
+	messages_received = 0;
+	tox_extension_messages_negotiate(peer_ext, hub->tox_user.id);
+
+	size_t iterations = 0;
+	while (messages_received == 0) {
+		iterate_all(hub, peers, num_peers);
+		assert(++iterations < 100);
+	}
+	assert(last_received_size == sizeof(large_message));
+	assert(tox_extension_messages_get_pending_segments(
+		       peer_ext, hub->tox_user.id) == 0);
+
+	tox_extension_messages_set_receive_window(hub_ext, 0);
+	iterate_all(hub, peers, num_peers);
+}
+
+int main(void)
+{
+	struct ToxExtUser hub;
+	/* The last peer doesn't have the extension */
+	struct ToxExtUser peers[NUM_PEERS + 1];
+	size_t const num_users = NUM_PEERS + 1;
+
+	toxext_test_init_tox_ext_user(&hub);
+	for (size_t i = 0; i < num_users; ++i) {
+		toxext_test_init_tox_ext_user(&peers[i]);
+	}
+
+	struct ToxExtensionMessages *hub_ext = tox_extension_messages_register(
+		hub.toxext, test_cb, test_receipt_cb, hub_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	tox_extension_messages_set_clock(hub_ext, test_clock, NULL);
+
+	struct ToxExtensionMessages *peer_exts[NUM_PEERS];
+	for (size_t i = 0; i < NUM_PEERS; ++i) {
+		peer_exts[i] = tox_extension_messages_register(
+			peers[i].toxext, test_cb, test_receipt_cb, peer_neg_cb,
+			NULL,
+			TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	}
+
+	struct Tox_Extension_Messages_Negotiation_Pacing pacing = {
+		.negotiations_per_second = 1,
+		.burst = 2,
+		.retry_ms = 3000,
+		.max_attempts = 2,
+	};
+	tox_extension_messages_set_negotiation_pacing(hub_ext, &pacing);
+
+	uint32_t const incompatible = peers[NUM_PEERS].tox_user.id;
+	struct Tox_Extension_Messages_Negotiation_Request requests[] = {
+		{ peers[0].tox_user.id, 1 }, { peers[1].tox_user.id, 5 },
+		{ peers[2].tox_user.id, 4 }, { peers[3].tox_user.id, 3 },
+		{ peers[4].tox_user.id, 0 }, { incompatible, 2 },
+		{ SILENT_FRIEND, 2 },
+	};
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_negotiate_bulk(
+		hub_ext, requests, sizeof(requests) / sizeof(requests[0]), &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+
+	/* The burst goes to the two highest priorities straight away */
+	assert_progress(hub_ext, 5, 2, 0, 0);
+	iterate_all(&hub, peers, num_users);
+	assert(negotiated_count == 2);
+	assert(negotiated_order[0] == peers[1].tox_user.id);
+	assert(negotiated_order[1] == peers[2].tox_user.id);
+	assert_progress(hub_ext, 5, 0, 2, 0);
+
+	/* Nothing more until a token is back */
+	advance(&hub, peers, num_users, hub_ext, 500);
+	assert(negotiated_count == 2);
+
+	/* A refused send moves the lowest priority friend to the front */
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(hub.toxext, peers[4].tox_user.id);
+	uint8_t message[] = "hello";
+	tox_extension_messages_append(hub_ext, packet_list, message,
+				      sizeof(message), peers[4].tox_user.id,
+				      &err);
+	assert(err == TOX_EXTENSION_MESSAGES_INVALID_ARG);
+	toxext_send(packet_list);
+
+	advance(&hub, peers, num_users, hub_ext, 1000);
+	assert(negotiated_count == 3);
+	assert(negotiated_order[2] == peers[4].tox_user.id);
+
+	/* A friend negotiating on its own doesn't need a slot */
+	tox_extension_messages_negotiate(peer_exts[0], hub.tox_user.id);
+	iterate_all(&hub, peers, num_users);
+	assert(negotiated_count == 4);
+	assert(negotiated_order[3] == peers[0].tox_user.id);
+	assert_progress(hub_ext, 3, 0, 4, 0);
+
+	advance(&hub, peers, num_users, hub_ext, 2000);
+	assert(negotiated_count == 5);
+	assert(negotiated_order[4] == peers[3].tox_user.id);
+
+	/* Equal priorities go in request order */
+	advance(&hub, peers, num_users, hub_ext, 3000);
+	assert(incompatible_count == 1);
+	assert_progress(hub_ext, 1, 0, 5, 1);
+
+	advance(&hub, peers, num_users, hub_ext, 4000);
+	assert_progress(hub_ext, 0, 1, 5, 1);
+
+	/* The silent friend is retried once its answer is overdue */
+	advance(&hub, peers, num_users, hub_ext, 6999);
+	assert_progress(hub_ext, 0, 1, 5, 1);
+	assert(get_friend_data(hub_ext, SILENT_FRIEND)->negotiation_attempts ==
+	       1);
+	advance(&hub, peers, num_users, hub_ext, 7000);
+	assert_progress(hub_ext, 0, 1, 5, 1);
+	assert(get_friend_data(hub_ext, SILENT_FRIEND)->negotiation_attempts ==
+	       2);
+
+	/* And given up on after max_attempts */
+	advance(&hub, peers, num_users, hub_ext, 10000);
+	assert_progress(hub_ext, 0, 0, 5, 2);
+
+	/* Asking again starts over for failed friends only */
+	tox_extension_messages_negotiate_bulk(hub_ext, requests,
+					      sizeof(requests) /
+						      sizeof(requests[0]),
+					      &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	assert_progress(hub_ext, 0, 2, 5, 0);
+	assert(get_friend_data(hub_ext, SILENT_FRIEND)->negotiation_attempts ==
+	       1);
+
+	/* A negotiated friend that goes away is queued again */
+	packet_list =
+		toxext_packet_list_create(hub.toxext, peers[1].tox_user.id);
+	tox_extension_messages_neg(hub_ext->extension_handle,
+				   peers[1].tox_user.id, false, hub_ext,
+				   packet_list);
+	toxext_send(packet_list);
+	assert_progress(hub_ext, 1, 2, 4, 0);
+
+	advance(&hub, peers, num_users, hub_ext, 11000);
+	assert(negotiated_count == 6);
+	assert(negotiated_order[5] == peers[1].tox_user.id);
+	assert_progress(hub_ext, 0, 1, 5, 1);
+
+	/* So is one that loaded savedata says isn't negotiated */
+	struct FriendData *saved_friend =
+		get_friend_data(hub_ext, peers[3].tox_user.id);
+	saved_friend->peer_negotiated = false;
+	size_t savedata_size =
+		tox_extension_messages_get_savedata_size(hub_ext, false);
+	uint8_t *savedata = malloc(savedata_size);
+	tox_extension_messages_get_savedata(hub_ext, savedata, false);
+	saved_friend->peer_negotiated = true;
+
+	assert(tox_extension_messages_load_savedata(hub_ext, savedata,
+						    savedata_size) ==
+	       TOX_EXTENSION_MESSAGES_SUCCESS);
+	free(savedata);
+	assert_progress(hub_ext, 1, 1, 4, 1);
+
+	advance(&hub, peers, num_users, hub_ext, 12000);
+	assert(negotiated_count == 7);
+	assert(negotiated_order[6] == peers[3].tox_user.id);
+	assert_progress(hub_ext, 0, 1, 5, 1);
+
+	test_negotiating_again(&hub, peers, num_users, hub_ext, peer_exts[0]);
+
+	for (size_t i = 0; i < NUM_PEERS; ++i) {
+		tox_extension_messages_free(peer_exts[i]);
+	}
+	tox_extension_messages_free(hub_ext);
+
+	for (size_t i = 0; i < num_users; ++i) {
+		toxext_test_cleanup_tox_ext_user(&peers[i]);
+	}
+	toxext_test_cleanup_tox_ext_user(&hub);
+
+	return 0;
+}
@@ -0,0 +1,205 @@
+#include "../tox_extension_messages.c"
+
+#include <toxext/toxext.h>
+#include <toxext/mock_fixtures.h>
+#include <assert.h>
+
+static size_t messages_received = 0;
+static size_t last_received_length = 0;
+static size_t receipts_received = 0;
+static size_t drops = 0;
+static enum Tox_Extension_Messages_Drop_Reason last_drop_reason;
+
+static void test_cb(uint32_t friend_number, uint8_t const *message,
+		    size_t length, void *user_data)
+{
+	(void)friend_number;
+	(void)message;
+	(void)user_data;
+	messages_received++;
+	last_received_length = length;
+}
+
+static void test_receipt_cb(uint32_t friend_number, const uint64_t receipt_id,
+			    void *user_data)
+{
+	(void)friend_number;
+	(void)receipt_id;
+	(void)user_data;
+	receipts_received++;
+}
+
+static void test_neg_cb(uint32_t friend_number, bool compatible,
+			uint64_t max_sending_size, void *user_data)
+{
+	(void)friend_number;
+	(void)compatible;
+	(void)max_sending_size;
+	(void)user_data;
+}
+
+static void test_dropped_cb(uint32_t friend_number,
+			    enum Tox_Extension_Messages_Drop_Reason reason,
+			    void *user_data)
+{
+	(void)friend_number;
+	(void)user_data;
+	drops++;
+	last_drop_reason = reason;
+}
+
+static uint8_t buffer[TOXEXT_MAX_SEGMENT_SIZE * 3 + 17];
+
+static void test_crc32c(void)
+{
+	static char const check[] = "123456789";
+	uint32_t crc = crc32c_copy(CRC32C_INIT, NULL, (uint8_t const *)check,
+				   strlen(check));
+	assert((crc ^ CRC32C_INIT) == 0xe3069283);
+
+	/* Whatever implementation we dispatch to has to agree with the table */
+	uint8_t copy[sizeof(buffer)];
+	for (size_t offset = 0; offset < 9; ++offset) {
+		size_t size = sizeof(buffer) - offset;
+		uint32_t expected = crc32c_copy_portable(
+			CRC32C_INIT, NULL, buffer + offset, size);
+		memset(copy, 0, sizeof(copy));
+		uint32_t actual = crc32c_copy(CRC32C_INIT, copy + offset,
+					      buffer + offset, size);
+		assert(expected == actual);
+		assert(memcmp(copy + offset, buffer + offset, size) == 0);
+	}
+}
+
+static void send_segments(struct ToxExtUser *user_a, struct ToxExtUser *user_b,
+			  struct ToxExtensionMessages *ext_a, size_t size,
+			  size_t corrupt_segment)
+{
+	messages_received = 0;
+	receipts_received = 0;
+	drops = 0;
+
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_a->toxext, user_b->tox_user.id);
+
+	uint32_t crc = CRC32C_INIT;
+	uint8_t const *end = buffer + size;
+	uint8_t const *next_chunk = buffer;
+	size_t segment = 0;
+	do {
+		uint8_t extension_data[TOXEXT_MAX_SEGMENT_SIZE];
+		size_t size_for_chunk;
+		next_chunk = tox_extension_messages_chunk(
+			segment == 0, next_chunk, end - next_chunk,
+			ext_a->next_receipt_id, &crc, extension_data,
+			&size_for_chunk);
+
+		if (segment == corrupt_segment) {
+			extension_data[size_for_chunk - 1] ^= 0x01;
+		}
+		segment++;
+
+		toxext_segment_append(packet_list, ext_a->extension_handle,
+				      extension_data, size_for_chunk);
+	} while (end > next_chunk);
+	ext_a->next_receipt_id++;
+
+	toxext_send(packet_list);
+	tox_iterate(user_b->tox_user.tox, &user_b->tox_user);
+	tox_iterate(user_a->tox_user.tox, &user_a->tox_user);
+}
+
+void test_intact_messages(struct ToxExtUser *user_a, struct ToxExtUser *user_b,
+			  struct ToxExtensionMessages *ext_a)
+{
+	size_t const sizes[] = { 0, 5, sizeof(buffer) };
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		messages_received = 0;
+		struct ToxExtPacketList *packet_list = toxext_packet_list_create(
+			user_a->toxext, user_b->tox_user.id);
+		enum Tox_Extension_Messages_Error err;
+		tox_extension_messages_append(ext_a, packet_list, buffer,
+					      sizes[i], user_b->tox_user.id,
+					      &err);
+		assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+		toxext_send(packet_list);
+		tox_iterate(user_b->tox_user.tox, &user_b->tox_user);
+		tox_iterate(user_a->tox_user.tox, &user_a->tox_user);
+
+		assert(messages_received == 1);
+		assert(last_received_length == sizes[i]);
+	}
+}
+
+void test_corrupt_messages(struct ToxExtUser *user_a,
+			   struct ToxExtUser *user_b,
+			   struct ToxExtensionMessages *ext_a)
+{
+	/* Corrupt the start, a part and the finish of a multi segment message */
+	for (size_t corrupt_segment = 0; corrupt_segment < 4;
+	     ++corrupt_segment) {
+		send_segments(user_a, user_b, ext_a, sizeof(buffer),
+			      corrupt_segment);
+		assert(messages_received == 0);
+		assert(receipts_received == 0);
+		assert(drops == 1);
+		assert(last_drop_reason ==
+		       TOX_EXTENSION_MESSAGES_DROP_CHECKSUM_MISMATCH);
+	}
+
+	/* Single segment messages are checked as well */
+	send_segments(user_a, user_b, ext_a, 100, 0);
+	assert(messages_received == 0);
+	assert(drops == 1);
+
+	/* Nothing is left behind that would break the next message */
+	send_segments(user_a, user_b, ext_a, sizeof(buffer), -1);
+	assert(messages_received == 1);
+	assert(receipts_received == 1);
+	assert(drops == 0);
+}
+
+int main(void)
+{
+	struct ToxExtUser user_a;
+	struct ToxExtUser user_b;
+
+	for (size_t i = 0; i < sizeof(buffer); ++i) {
+		buffer[i] = i * 31;
+	}
+
+	test_crc32c();
+
+	toxext_test_init_tox_ext_user(&user_a);
+	toxext_test_init_tox_ext_user(&user_b);
+
+	struct ToxExtensionMessages *ext_a = tox_extension_messages_register(
+		user_a.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	struct ToxExtensionMessages *ext_b = tox_extension_messages_register(
+		user_b.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+
+	tox_extension_messages_enable_checksums(ext_a);
+	tox_extension_messages_enable_checksums(ext_b);
+	tox_extension_messages_set_dropped_cb(ext_b, test_dropped_cb);
+
+	tox_extension_messages_negotiate(ext_a, user_b.tox_user.id);
+
+	tox_iterate(user_b.tox_user.tox, &user_b.tox_user);
+	tox_iterate(user_a.tox_user.tox, &user_a.tox_user);
+	tox_iterate(user_b.tox_user.tox, &user_b.tox_user);
+	tox_iterate(user_a.tox_user.tox, &user_a.tox_user);
+
+	test_intact_messages(&user_a, &user_b, ext_a);
+	test_corrupt_messages(&user_a, &user_b, ext_a);
+
+	tox_extension_messages_free(ext_b);
+	tox_extension_messages_free(ext_a);
+
+	toxext_test_cleanup_tox_ext_user(&user_b);
+	toxext_test_cleanup_tox_ext_user(&user_a);
+
+	return 0;
+}
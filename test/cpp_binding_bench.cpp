@@ -0,0 +1,179 @@
+/*
+ * Compares receiving through the C API, copying every message into a
+ * std::vector, with taking messages through the C++ binding.
+ *
+ *   cpp_binding_bench [messages] [message size]
+ */
+#include "../tox_extension_messages.hpp"
+
+extern "C" {
+#include <toxext/mock_fixtures.h>
+}
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace tox_extension_messages;
+
+struct Peers {
+	ToxExtUser sender;
+	ToxExtUser receiver;
+
+	Peers()
+	{
+		toxext_test_init_tox_ext_user(&sender);
+		toxext_test_init_tox_ext_user(&receiver);
+	}
+
+	~Peers()
+	{
+		toxext_test_cleanup_tox_ext_user(&receiver);
+		toxext_test_cleanup_tox_ext_user(&sender);
+	}
+
+	void iterate()
+	{
+		tox_iterate(receiver.tox_user.tox, &receiver.tox_user);
+		tox_iterate(sender.tox_user.tox, &sender.tox_user);
+	}
+};
+
+static void c_received_cb(uint32_t friend_number, uint8_t const *message,
+			  size_t length, void *user_data)
+{
+	(void)friend_number;
+	auto *received = static_cast<std::vector<std::vector<uint8_t>> *>(
+		user_data);
+	received->emplace_back(message, message + length);
+}
+
+static void c_receipt_cb(uint32_t friend_number, uint64_t receipt_id,
+			 void *user_data)
+{
+	(void)friend_number;
+	(void)receipt_id;
+	(void)user_data;
+}
+
+static void c_neg_cb(uint32_t friend_number, bool compatible,
+		     uint64_t max_sending_size, void *user_data)
+{
+	(void)friend_number;
+	(void)compatible;
+	(void)max_sending_size;
+	(void)user_data;
+}
+
+/* Sends count messages and returns the seconds until all were received */
+template <typename Send, typename Received>
+static double run(Peers &peers, size_t count, Send send, Received received)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; ++i) {
+		send();
+		peers.iterate();
+	}
+	if (received() != count) {
+		std::fprintf(stderr, "lost messages\n");
+		std::exit(1);
+	}
+	std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+static void report(char const *name, double seconds, size_t count,
+		   size_t size)
+{
+	std::printf("%-8s %8.3f s %10.2f MiB/s\n", name, seconds,
+		    count * size / seconds / (1024 * 1024));
+}
+
+static void send_message(Peers &peers, auto &&append,
+			 std::vector<uint8_t> const &payload)
+{
+	ToxExtPacketList *packet_list = toxext_packet_list_create(
+		peers.sender.toxext, peers.receiver.tox_user.id);
+	append(packet_list, peers.receiver.tox_user.id, payload);
+	toxext_send(packet_list);
+}
+
+int main(int argc, char **argv)
+{
+	size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 2000;
+	size_t size = argc > 2 ? std::strtoull(argv[2], nullptr, 10) :
+				 64 * 1024;
+	std::vector<uint8_t> payload(size, 0x5a);
+
+	{
+		Peers peers;
+		std::vector<std::vector<uint8_t>> received;
+		ToxExtensionMessages *sender = tox_extension_messages_register(
+			peers.sender.toxext, c_received_cb, c_receipt_cb,
+			c_neg_cb, &received,
+			TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+		ToxExtensionMessages *receiver = tox_extension_messages_register(
+			peers.receiver.toxext, c_received_cb, c_receipt_cb,
+			c_neg_cb, &received,
+			TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+		tox_extension_messages_negotiate(sender,
+						 peers.receiver.tox_user.id);
+		peers.iterate();
+		peers.iterate();
+
+		double seconds = run(
+			peers, count,
+			[&] {
+				send_message(
+					peers,
+					[&](ToxExtPacketList *packet_list,
+					    uint32_t friend_id,
+					    std::vector<uint8_t> const &data) {
+						tox_extension_messages_append(
+							sender, packet_list,
+							data.data(), data.size(),
+							friend_id, nullptr);
+					},
+					payload);
+			},
+			[&] { return received.size(); });
+		report("copy", seconds, count, size);
+
+		tox_extension_messages_free(receiver);
+		tox_extension_messages_free(sender);
+	}
+
+	{
+		Peers peers;
+		std::vector<OwnedMessage> received;
+		Messages sender(peers.sender.toxext,
+				[](uint32_t, ReceivedMessage) noexcept {});
+		Messages receiver(peers.receiver.toxext,
+				  [&](uint32_t, ReceivedMessage message) noexcept {
+					  received.push_back(message.take());
+				  });
+		sender.negotiate(peers.receiver.tox_user.id);
+		peers.iterate();
+		peers.iterate();
+
+		double seconds = run(
+			peers, count,
+			[&] {
+				send_message(
+					peers,
+					[&](ToxExtPacketList *packet_list,
+					    uint32_t friend_id,
+					    std::vector<uint8_t> const &data) {
+						sender.append(packet_list,
+							      friend_id, data);
+					},
+					payload);
+			},
+			[&] { return received.size(); });
+		report("take", seconds, count, size);
+	}
+
+	return 0;
+}
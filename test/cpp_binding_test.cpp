@@ -0,0 +1,236 @@
+#include "../tox_extension_messages.hpp"
+
+extern "C" {
+#include <toxext/mock_fixtures.h>
+}
+
+#include <cassert>
+#include <coroutine>
+#include <cstring>
+#include <exception>
+#include <optional>
+#include <vector>
+
+using namespace tox_extension_messages;
+
+/* Just enough of a coroutine type to await receipts */
+struct Task {
+	struct promise_type {
+		Task get_return_object()
+		{
+			return { std::coroutine_handle<promise_type>::from_promise(
+				*this) };
+		}
+		std::suspend_never initial_suspend() noexcept
+		{
+			return {};
+		}
+		std::suspend_never final_suspend() noexcept
+		{
+			return {};
+		}
+		void return_void()
+		{
+		}
+		void unhandled_exception()
+		{
+			std::terminate();
+		}
+	};
+
+	/* Not owned, the coroutine frees itself once it finishes */
+	std::coroutine_handle<promise_type> handle;
+};
+
+static Task await_receipt(Receipt const &receipt,
+			  std::optional<ReceiptStatus> &result)
+{
+	result = co_await receipt;
+}
+
+/* Callbacks are called from C, so ones that may throw are refused */
+template <typename OnMessage>
+concept Wrappable = requires { typename Messages<OnMessage>; };
+static_assert(Wrappable<decltype([](uint32_t, ReceivedMessage) noexcept {})>);
+static_assert(!Wrappable<decltype([](uint32_t, ReceivedMessage) {})>);
+
+struct Received {
+	uint32_t friend_id;
+	uint8_t const *callback_data;
+	OwnedMessage message;
+	bool take_twice_empty;
+};
+
+static uint64_t now = 0;
+
+static uint64_t test_clock(void *clock_user_data)
+{
+	(void)clock_user_data;
+	return now;
+}
+
+static void iterate(ToxExtUser &user)
+{
+	tox_iterate(user.tox_user.tox, &user.tox_user);
+}
+
+static void send(ToxExtUser &from, ToxExtUser &to, auto &messages,
+		 std::span<uint8_t const> data)
+{
+	ToxExtPacketList *packet_list =
+		toxext_packet_list_create(from.toxext, to.tox_user.id);
+	Error err;
+	messages.append(packet_list, to.tox_user.id, data, &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	toxext_send(packet_list);
+	iterate(to);
+	iterate(from);
+}
+
+static void test_binding(ToxExtUser &user_a, ToxExtUser &user_b)
+{
+	std::vector<uint8_t> buffer(TOXEXT_MAX_SEGMENT_SIZE * 3);
+	for (size_t i = 0; i < buffer.size(); ++i) {
+		buffer[i] = i * 31;
+	}
+
+	std::vector<Received> received;
+	std::vector<uint64_t> receipts;
+	bool negotiated = false;
+
+	Messages messages_a(
+		user_a.toxext, [](uint32_t, ReceivedMessage) noexcept {},
+		[&](uint32_t, uint64_t receipt_id) noexcept {
+			receipts.push_back(receipt_id);
+		},
+		[&](uint32_t, bool compatible,
+		    uint64_t max_sending_size) noexcept {
+			negotiated = compatible && max_sending_size > 0;
+		});
+	Messages messages_b(
+		user_b.toxext,
+		[&](uint32_t friend_id, ReceivedMessage message) noexcept {
+			Received entry{ friend_id, message.data().data(),
+					message.take(), false };
+			entry.take_twice_empty = !message.take();
+			received.push_back(std::move(entry));
+		});
+
+	messages_a.negotiate(user_b.tox_user.id);
+	iterate(user_b);
+	iterate(user_a);
+	iterate(user_b);
+	iterate(user_a);
+	assert(negotiated);
+
+	/* Reassembled messages are handed over without a copy */
+	send(user_a, user_b, messages_a, buffer);
+	assert(received.size() == 1);
+	assert(received[0].friend_id == user_a.tox_user.id);
+	assert(received[0].message.size() == buffer.size());
+	assert(received[0].message.data() == received[0].callback_data);
+	assert(std::memcmp(received[0].message.data(), buffer.data(),
+			   buffer.size()) == 0);
+	assert(received[0].message);
+	assert(received[0].take_twice_empty);
+	assert(receipts.size() == 1);
+
+	/* Single segment messages point into the packet so they are copied */
+	send(user_a, user_b, messages_a, std::span(buffer).first(5));
+	assert(received.size() == 2);
+	assert(received[1].message.size() == 5);
+	assert(received[1].message.data() != received[1].callback_data);
+	assert(std::memcmp(received[1].message.data(), buffer.data(), 5) == 0);
+
+	/* Moving keeps the buffer */
+	OwnedMessage moved = std::move(received[0].message);
+	assert(moved.data() == received[0].callback_data);
+	assert(received[0].message.data() == nullptr);
+	assert(received[0].message.size() == 0);
+
+	/* Receipts can be awaited */
+	std::optional<ReceiptStatus> delivered;
+	ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_a.toxext, user_b.tox_user.id);
+	Receipt receipt = messages_a.append_tracked(
+		packet_list, user_b.tox_user.id, buffer, 1000);
+	assert(receipt);
+	toxext_send(packet_list);
+	await_receipt(receipt, delivered);
+	assert(!delivered);
+	iterate(user_b);
+	iterate(user_a);
+	assert(delivered == TOX_EXTENSION_MESSAGES_RECEIPT_DELIVERED);
+
+	/* A completed receipt doesn't suspend */
+	std::optional<ReceiptStatus> already_delivered;
+	await_receipt(receipt, already_delivered);
+	assert(already_delivered == TOX_EXTENSION_MESSAGES_RECEIPT_DELIVERED);
+
+	/* And time out if our friend never confirms them */
+	tox_extension_messages_set_clock(messages_a.get(), test_clock, nullptr);
+	std::optional<ReceiptStatus> timed_out;
+	packet_list =
+		toxext_packet_list_create(user_a.toxext, user_b.tox_user.id);
+	Receipt timing_out = messages_a.append_tracked(
+		packet_list, user_b.tox_user.id, buffer, 100);
+	await_receipt(timing_out, timed_out);
+	toxext_send(packet_list);
+	now += 50;
+	messages_a.iterate();
+	assert(!timed_out);
+	now += 100;
+	messages_a.iterate();
+	assert(timed_out == TOX_EXTENSION_MESSAGES_RECEIPT_TIMED_OUT);
+
+	/* A coroutine destroyed while suspended is not resumed afterwards */
+	std::optional<ReceiptStatus> abandoned_result;
+	packet_list =
+		toxext_packet_list_create(user_a.toxext, user_b.tox_user.id);
+	Receipt abandoned = messages_a.append_tracked(
+		packet_list, user_b.tox_user.id, buffer, 100);
+	toxext_send(packet_list);
+	await_receipt(abandoned, abandoned_result).handle.destroy();
+	iterate(user_b);
+	iterate(user_a);
+	assert(!abandoned_result);
+
+	/* Receipts move along with their state */
+	std::optional<ReceiptStatus> moved_result;
+	packet_list =
+		toxext_packet_list_create(user_a.toxext, user_b.tox_user.id);
+	Receipt moved_receipt = messages_a.append_tracked(
+		packet_list, user_b.tox_user.id, buffer, 100);
+	toxext_send(packet_list);
+	Receipt moved_to = std::move(moved_receipt);
+	assert(!moved_receipt);
+	await_receipt(moved_to, moved_result);
+	iterate(user_b);
+	iterate(user_a);
+	assert(moved_result == TOX_EXTENSION_MESSAGES_RECEIPT_DELIVERED);
+
+	/* Failed appends don't produce a receipt */
+	Error err;
+	Receipt failed = messages_a.append_tracked(
+		nullptr, user_b.tox_user.id + 1000, buffer, 100, &err);
+	assert(!failed);
+	assert(err != TOX_EXTENSION_MESSAGES_SUCCESS);
+
+	iterate(user_b);
+	iterate(user_a);
+}
+
+int main()
+{
+	ToxExtUser user_a;
+	ToxExtUser user_b;
+	toxext_test_init_tox_ext_user(&user_a);
+	toxext_test_init_tox_ext_user(&user_b);
+
+	test_binding(user_a, user_b);
+
+	toxext_test_cleanup_tox_ext_user(&user_b);
+	toxext_test_cleanup_tox_ext_user(&user_a);
+
+	return 0;
+}
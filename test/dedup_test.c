@@ -0,0 +1,315 @@
+#include "../tox_extension_messages.c"
+
+#include <toxext/toxext.h>
+#include <toxext/mock_fixtures.h>
+#include <assert.h>
+
+#define BUFFER_SIZE (TOXEXT_MAX_SEGMENT_SIZE * 3)
+
+static uint8_t *last_received_buffer = NULL;
+static size_t last_received_buffer_size = 0;
+static size_t messages_received = 0;
+static size_t receipts_received = 0;
+static size_t received_sizes[8];
+
+static void test_cb(uint32_t friend_number, uint8_t const *message,
+		    size_t length, void *user_data)
+{
+	(void)friend_number;
+	(void)user_data;
+
+	free(last_received_buffer);
+	last_received_buffer = malloc(length);
+	last_received_buffer_size = length;
+	memcpy(last_received_buffer, message, length);
+	if (messages_received < sizeof(received_sizes) / sizeof(received_sizes[0])) {
+		received_sizes[messages_received] = length;
+	}
+	messages_received++;
+}
+
+static void test_receipt_cb(uint32_t friend_number, const uint64_t receipt_id,
+			    void *user_data)
+{
+	(void)friend_number;
+	(void)receipt_id;
+	(void)user_data;
+	receipts_received++;
+}
+
+static void test_neg_cb(uint32_t friend_number, bool compatible,
+			uint64_t max_sending_size, void *user_data)
+{
+	(void)friend_number;
+	(void)compatible;
+	(void)max_sending_size;
+	(void)user_data;
+}
+
+static uint8_t buffers[3][BUFFER_SIZE];
+
+static void test_sha256(void)
+{
+	struct {
+		char const *input;
+		uint8_t expected[DIGEST_SIZE];
+	} const vectors[] = {
+		{ "",
+		  { 0xe3, 0xb0, 0xc4, 0x42, 0x98, 0xfc, 0x1c, 0x14,
+		    0x9a, 0xfb, 0xf4, 0xc8, 0x99, 0x6f, 0xb9, 0x24,
+		    0x27, 0xae, 0x41, 0xe4, 0x64, 0x9b, 0x93, 0x4c,
+		    0xa4, 0x95, 0x99, 0x1b, 0x78, 0x52, 0xb8, 0x55 } },
+		{ "abc",
+		  { 0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+		    0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+		    0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+		    0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad } },
+		{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+		  { 0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8,
+		    0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+		    0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67,
+		    0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1 } },
+	};
+
+	for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i) {
+		uint8_t digest[DIGEST_SIZE];
+		sha256((uint8_t const *)vectors[i].input,
+		       strlen(vectors[i].input), digest);
+		assert(memcmp(digest, vectors[i].expected, DIGEST_SIZE) == 0);
+	}
+}
+
+static void test_min_message_size(struct ToxExtensionMessages *extension)
+{
+	tox_extension_messages_enable_dedup(extension, 0, 0);
+	assert(extension->dedup_min_message_size ==
+	       TOX_EXTENSION_MESSAGES_DEFAULT_DEDUP_MIN_MESSAGE_SIZE);
+
+	/* A single segment is never worth an offer */
+	tox_extension_messages_enable_dedup(extension, 0, 1);
+	assert(extension->dedup_min_message_size == DEDUP_SINGLE_SEGMENT_SIZE);
+}
+
+/*
+ * Returns whether the message was delivered straight from the offer, i.e.
+ * without another round trip for the body
+ */
+static bool send_buffer(struct ToxExtUser *user_a, struct ToxExtUser *user_b,
+			struct ToxExtensionMessages *ext_a, uint8_t const *buffer,
+			size_t size)
+{
+	messages_received = 0;
+	receipts_received = 0;
+
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_a->toxext, user_b->tox_user.id);
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_append(ext_a, packet_list, buffer, size,
+				      user_b->tox_user.id, &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	toxext_send(packet_list);
+
+	tox_iterate(user_b->tox_user.tox, &user_b->tox_user);
+	bool from_cache = messages_received == 1;
+
+	tox_iterate(user_a->tox_user.tox, &user_a->tox_user);
+	tox_iterate(user_b->tox_user.tox, &user_b->tox_user);
+	tox_iterate(user_a->tox_user.tox, &user_a->tox_user);
+
+	assert(messages_received == 1);
+	assert(receipts_received == 1);
+	assert(last_received_buffer_size == size);
+	assert(memcmp(last_received_buffer, buffer, size) == 0);
+
+	struct FriendData *friend_data =
+		get_friend_data(ext_a, user_b->tox_user.id);
+	assert(!friend_data->has_pending_offer);
+
+	return from_cache;
+}
+
+/* Messages appended after an offer must not overtake it */
+static void test_order_behind_offer(struct ToxExtUser *user_a,
+				    struct ToxExtUser *user_b,
+				    struct ToxExtensionMessages *ext_a,
+				    uint8_t const *buffer)
+{
+	messages_received = 0;
+	receipts_received = 0;
+
+	static uint8_t const small_buffer[] = "after the offer";
+	size_t const sizes[] = { BUFFER_SIZE, sizeof(small_buffer), BUFFER_SIZE,
+				 sizeof(small_buffer) };
+	uint8_t const *datas[] = { buffer, small_buffer, buffer, small_buffer };
+
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_a->toxext, user_b->tox_user.id);
+	for (size_t i = 0; i < 4; ++i) {
+		enum Tox_Extension_Messages_Error err;
+		tox_extension_messages_append(ext_a, packet_list, datas[i],
+					      sizes[i], user_b->tox_user.id,
+					      &err);
+		assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	}
+	toxext_send(packet_list);
+
+	struct FriendData *friend_data =
+		get_friend_data(ext_a, user_b->tox_user.id);
+	assert(friend_data->has_pending_offer);
+	assert(friend_data->held_messages.size == 3);
+
+	for (size_t i = 0; i < 8; ++i) {
+		tox_iterate(user_b->tox_user.tox, &user_b->tox_user);
+		tox_iterate(user_a->tox_user.tox, &user_a->tox_user);
+	}
+
+	assert(messages_received == 4);
+	assert(receipts_received == 4);
+	for (size_t i = 0; i < 4; ++i) {
+		assert(received_sizes[i] == sizes[i]);
+	}
+	assert(!friend_data->has_pending_offer);
+	assert(friend_data->held_messages.size == 0);
+}
+
+/* Offering one body to several friends at once shares the copy and digest */
+static void test_shared_offer(struct ToxExtUser *user_a,
+			      struct ToxExtUser *user_b,
+			      struct ToxExtUser *user_c,
+			      struct ToxExtensionMessages *ext_a,
+			      uint8_t const *buffer)
+{
+	messages_received = 0;
+	receipts_received = 0;
+
+	struct ToxExtUser *receivers[] = { user_b, user_c };
+	for (size_t i = 0; i < 2; ++i) {
+		struct ToxExtPacketList *packet_list = toxext_packet_list_create(
+			user_a->toxext, receivers[i]->tox_user.id);
+		enum Tox_Extension_Messages_Error err;
+		tox_extension_messages_append(ext_a, packet_list, buffer,
+					      BUFFER_SIZE,
+					      receivers[i]->tox_user.id, &err);
+		assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+		toxext_send(packet_list);
+	}
+
+	assert(ext_a->offered_contents);
+	assert(ext_a->offered_contents->refs == 2);
+	assert(!ext_a->offered_contents->next);
+
+	for (size_t i = 0; i < 4; ++i) {
+		tox_iterate(user_b->tox_user.tox, &user_b->tox_user);
+		tox_iterate(user_c->tox_user.tox, &user_c->tox_user);
+		tox_iterate(user_a->tox_user.tox, &user_a->tox_user);
+	}
+
+	assert(messages_received == 2);
+	assert(receipts_received == 2);
+	assert(!ext_a->offered_contents);
+}
+
+int main(void)
+{
+	struct ToxExtUser user_a;
+	struct ToxExtUser user_b;
+	struct ToxExtUser user_c;
+
+	test_sha256();
+
+	for (size_t i = 0; i < 3; ++i) {
+		for (size_t j = 0; j < BUFFER_SIZE; ++j) {
+			buffers[i][j] = i * 7 + j;
+		}
+	}
+
+	toxext_test_init_tox_ext_user(&user_a);
+	toxext_test_init_tox_ext_user(&user_b);
+	toxext_test_init_tox_ext_user(&user_c);
+
+	struct ToxExtensionMessages *ext_a = tox_extension_messages_register(
+		user_a.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	struct ToxExtensionMessages *ext_b = tox_extension_messages_register(
+		user_b.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	struct ToxExtensionMessages *ext_c = tox_extension_messages_register(
+		user_c.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+
+	test_min_message_size(ext_a);
+	tox_extension_messages_enable_dedup(ext_a, 0, BUFFER_SIZE);
+	tox_extension_messages_enable_dedup(ext_c, BUFFER_SIZE * 2 + 1,
+					    BUFFER_SIZE);
+	/* Room for two buffers */
+	tox_extension_messages_enable_dedup(ext_b, BUFFER_SIZE * 2 + 1,
+					    BUFFER_SIZE);
+	/* Offers are paid for with credit like any other segment */
+	tox_extension_messages_set_receive_window(ext_b, 8);
+
+	tox_extension_messages_negotiate(ext_a, user_b.tox_user.id);
+	tox_extension_messages_negotiate(ext_c, user_b.tox_user.id);
+	tox_extension_messages_negotiate(ext_a, user_c.tox_user.id);
+
+	for (size_t i = 0; i < 2; ++i) {
+		tox_iterate(user_b.tox_user.tox, &user_b.tox_user);
+		tox_iterate(user_c.tox_user.tox, &user_c.tox_user);
+		tox_iterate(user_a.tox_user.tox, &user_a.tox_user);
+	}
+
+	/* Small messages are never offered */
+	static char const small_buffer[] = "asdf";
+	assert(send_buffer(&user_a, &user_b, ext_a,
+			   (uint8_t const *)small_buffer,
+			   sizeof(small_buffer)));
+	assert(ext_b->content_cache.entry_count == 0);
+
+	/* Nor are those below the minimum */
+	assert(send_buffer(&user_a, &user_b, ext_a, buffers[0],
+			   BUFFER_SIZE - 1));
+	assert(ext_b->content_cache.entry_count == 0);
+
+	assert(!send_buffer(&user_a, &user_b, ext_a, buffers[0], BUFFER_SIZE));
+	assert(ext_b->content_cache.entry_count == 1);
+	assert(send_buffer(&user_a, &user_b, ext_a, buffers[0], BUFFER_SIZE));
+
+	assert(!send_buffer(&user_a, &user_b, ext_a, buffers[1], BUFFER_SIZE));
+	/* Touch 0 so 1 is the least recently used */
+	assert(send_buffer(&user_a, &user_b, ext_a, buffers[0], BUFFER_SIZE));
+	assert(!send_buffer(&user_a, &user_b, ext_a, buffers[2], BUFFER_SIZE));
+	assert(ext_b->content_cache.entry_count == 2);
+
+	assert(send_buffer(&user_a, &user_b, ext_a, buffers[0], BUFFER_SIZE));
+	assert(send_buffer(&user_a, &user_b, ext_a, buffers[2], BUFFER_SIZE));
+	assert(!send_buffer(&user_a, &user_b, ext_a, buffers[1], BUFFER_SIZE));
+
+	/* Once with the body requested and once straight from the cache */
+	static uint8_t uncached[BUFFER_SIZE];
+	memset(uncached, 0x5a, sizeof(uncached));
+	test_order_behind_offer(&user_a, &user_b, ext_a, uncached);
+	test_order_behind_offer(&user_a, &user_b, ext_a, buffers[1]);
+
+	/* b has 1 from a, but c has to send it before b trusts it */
+	assert(send_buffer(&user_a, &user_b, ext_a, buffers[1], BUFFER_SIZE));
+	assert(!send_buffer(&user_c, &user_b, ext_c, buffers[1], BUFFER_SIZE));
+	assert(send_buffer(&user_c, &user_b, ext_c, buffers[1], BUFFER_SIZE));
+
+	test_shared_offer(&user_a, &user_b, &user_c, ext_a, buffers[2]);
+
+	/* a has no room to cache anything so always asks for the body */
+	assert(!send_buffer(&user_b, &user_a, ext_b, buffers[0], BUFFER_SIZE));
+	assert(!send_buffer(&user_b, &user_a, ext_b, buffers[0], BUFFER_SIZE));
+	assert(ext_a->content_cache.entry_count == 0);
+
+	free(last_received_buffer);
+
+	tox_extension_messages_free(ext_c);
+	tox_extension_messages_free(ext_b);
+	tox_extension_messages_free(ext_a);
+
+	toxext_test_cleanup_tox_ext_user(&user_c);
+	toxext_test_cleanup_tox_ext_user(&user_b);
+	toxext_test_cleanup_tox_ext_user(&user_a);
+
+	return 0;
+}
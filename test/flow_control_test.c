@@ -0,0 +1,284 @@
+#include "../tox_extension_messages.c"
+
+#include <toxext/toxext.h>
+#include <toxext/mock_fixtures.h>
+#include <assert.h>
+
+static const uint32_t b_receive_window = 4;
+
+static uint8_t *last_received_buffer = NULL;
+static size_t last_received_buffer_size = 0;
+static size_t messages_received = 0;
+
+static void test_cb(uint32_t friend_number, uint8_t const *message,
+		    size_t length, void *user_data)
+{
+	(void)friend_number;
+	(void)user_data;
+
+	free(last_received_buffer);
+	last_received_buffer = malloc(length);
+	last_received_buffer_size = length;
+	memcpy(last_received_buffer, message, length);
+	messages_received++;
+}
+
+static void test_receipt_cb(uint32_t friend_number, const uint64_t receipt_id,
+			    void *user_data)
+{
+	(void)friend_number;
+	(void)receipt_id;
+	(void)user_data;
+}
+
+static void test_neg_cb(uint32_t friend_number, bool compatible,
+			uint64_t max_sending_size, void *user_data)
+{
+	(void)friend_number;
+	(void)compatible;
+	(void)max_sending_size;
+	(void)user_data;
+}
+
+static uint8_t large_buffer[TOXEXT_MAX_SEGMENT_SIZE * 10];
+
+static void iterate(struct ToxExtUser *user_a, struct ToxExtUser *user_b)
+{
+	tox_iterate(user_b->tox_user.tox, &user_b->tox_user);
+	tox_iterate(user_a->tox_user.tox, &user_a->tox_user);
+}
+
+void test_sender_waits_for_credit(struct ToxExtUser *user_a,
+				  struct ToxExtUser *user_b,
+				  struct ToxExtensionMessages *ext_a)
+{
+	for (size_t i = 0; i < sizeof(large_buffer); ++i) {
+		large_buffer[i] = i;
+	}
+
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_a->toxext, user_b->tox_user.id);
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_append(ext_a, packet_list, large_buffer,
+				      sizeof(large_buffer), user_b->tox_user.id,
+				      &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+
+	/* Only the first window worth of segments is allowed out */
+	size_t pending = tox_extension_messages_get_pending_segments(
+		ext_a, user_b->tox_user.id);
+	assert(pending > 0);
+	toxext_send(packet_list);
+
+	size_t iterations = 0;
+	while (messages_received == 0) {
+		iterate(user_a, user_b);
+		size_t new_pending = tox_extension_messages_get_pending_segments(
+			ext_a, user_b->tox_user.id);
+		assert(new_pending <= pending);
+		pending = new_pending;
+		assert(++iterations < 100);
+	}
+
+	assert(pending == 0);
+	assert(last_received_buffer_size == sizeof(large_buffer));
+	assert(memcmp(last_received_buffer, large_buffer,
+		      sizeof(large_buffer)) == 0);
+}
+
+void test_queue_limit(struct ToxExtUser *user_a, struct ToxExtUser *user_b,
+		      struct ToxExtensionMessages *ext_a)
+{
+	messages_received = 0;
+	tox_extension_messages_set_max_pending_segments(ext_a, 1);
+
+	/* An empty queue takes a message however large it is */
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_a->toxext, user_b->tox_user.id);
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_append(ext_a, packet_list, large_buffer,
+				      sizeof(large_buffer), user_b->tox_user.id,
+				      &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	assert(tox_extension_messages_get_pending_segments(
+		       ext_a, user_b->tox_user.id) > 1);
+
+	/* But not another until it has drained */
+	uint8_t const small_message[] = "later";
+	uint64_t receipt_id = tox_extension_messages_append(
+		ext_a, packet_list, small_message, sizeof(small_message),
+		user_b->tox_user.id, &err);
+	assert(err == TOX_EXTENSION_MESSAGES_WOULD_BLOCK);
+	assert(receipt_id == (uint64_t)-1);
+	toxext_send(packet_list);
+
+	size_t iterations = 0;
+	while (messages_received == 0) {
+		iterate(user_a, user_b);
+		assert(++iterations < 100);
+	}
+	assert(tox_extension_messages_get_pending_segments(
+		       ext_a, user_b->tox_user.id) == 0);
+
+	packet_list =
+		toxext_packet_list_create(user_a->toxext, user_b->tox_user.id);
+	tox_extension_messages_append(ext_a, packet_list, small_message,
+				      sizeof(small_message),
+				      user_b->tox_user.id, &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	toxext_send(packet_list);
+	iterate(user_a, user_b);
+	assert(messages_received == 2);
+
+	tox_extension_messages_set_max_pending_segments(ext_a, 0);
+}
+
+void test_unlimited_sender(struct ToxExtUser *user_a,
+			   struct ToxExtUser *user_b,
+			   struct ToxExtensionMessages *ext_b)
+{
+	messages_received = 0;
+
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_b->toxext, user_a->tox_user.id);
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_append(ext_b, packet_list, large_buffer,
+				      sizeof(large_buffer), user_a->tox_user.id,
+				      &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	assert(tox_extension_messages_get_pending_segments(
+		       ext_b, user_a->tox_user.id) == 0);
+	toxext_send(packet_list);
+
+	tox_iterate(user_a->tox_user.tox, &user_a->tox_user);
+
+	assert(messages_received == 1);
+	assert(last_received_buffer_size == sizeof(large_buffer));
+}
+
+static void send_large_buffer(struct ToxExtUser *user_a,
+			      struct ToxExtUser *user_b,
+			      struct ToxExtensionMessages *ext_a)
+{
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_a->toxext, user_b->tox_user.id);
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_append(ext_a, packet_list, large_buffer,
+				      sizeof(large_buffer), user_b->tox_user.id,
+				      &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	toxext_send(packet_list);
+}
+
+static void wait_for_message(struct ToxExtUser *user_a,
+			     struct ToxExtUser *user_b,
+			     struct ToxExtensionMessages *ext_a)
+{
+	size_t iterations = 0;
+	while (messages_received == 0) {
+		iterate(user_a, user_b);
+		assert(++iterations < 100);
+	}
+
+	assert(tox_extension_messages_get_pending_segments(
+		       ext_a, user_b->tox_user.id) == 0);
+	assert(last_received_buffer_size == sizeof(large_buffer));
+	assert(memcmp(last_received_buffer, large_buffer,
+		      sizeof(large_buffer)) == 0);
+}
+
+void test_window_change(struct ToxExtUser *user_a, struct ToxExtUser *user_b,
+			struct ToxExtensionMessages *ext_a,
+			struct ToxExtensionMessages *ext_b)
+{
+	/*
+	 * Credit for segments already in flight has to keep coming back while
+	 * our friend still sends by the old window
+	 */
+	uint32_t const windows[] = { 100, 0, b_receive_window, 1 };
+
+	for (size_t i = 0; i < sizeof(windows) / sizeof(windows[0]); ++i) {
+		messages_received = 0;
+		send_large_buffer(user_a, user_b, ext_a);
+		iterate(user_a, user_b);
+
+		tox_extension_messages_set_receive_window(ext_b, windows[i]);
+		wait_for_message(user_a, user_b, ext_a);
+
+		/* And the next message only ever sees the new one */
+		messages_received = 0;
+		send_large_buffer(user_a, user_b, ext_a);
+		wait_for_message(user_a, user_b, ext_a);
+	}
+
+	tox_extension_messages_set_receive_window(ext_b, b_receive_window);
+	iterate(user_a, user_b);
+}
+
+void test_malformed_segments(struct ToxExtUser *user_a,
+			     struct ToxExtUser *user_b,
+			     struct ToxExtensionMessages *ext_a)
+{
+	struct FriendData *friend_data =
+		get_friend_data(ext_a, user_b->tox_user.id);
+	int64_t send_credit = friend_data->send_credit;
+
+	/* Truncated starts, paid for as any other segment would be */
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_a->toxext, user_b->tox_user.id);
+	uint8_t const truncated_start[] = { MESSAGE_START, 0 };
+	for (uint32_t i = 0; i < b_receive_window; ++i) {
+		toxext_segment_append(packet_list, ext_a->extension_handle,
+				      truncated_start, sizeof(truncated_start));
+		friend_data->send_credit--;
+	}
+	toxext_send(packet_list);
+	iterate(user_a, user_b);
+
+	assert(friend_data->send_credit == send_credit);
+
+	messages_received = 0;
+	send_large_buffer(user_a, user_b, ext_a);
+	wait_for_message(user_a, user_b, ext_a);
+}
+
+int main(void)
+{
+	struct ToxExtUser user_a;
+	struct ToxExtUser user_b;
+
+	toxext_test_init_tox_ext_user(&user_a);
+	toxext_test_init_tox_ext_user(&user_b);
+
+	struct ToxExtensionMessages *ext_a = tox_extension_messages_register(
+		user_a.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	struct ToxExtensionMessages *ext_b = tox_extension_messages_register(
+		user_b.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+
+	tox_extension_messages_set_receive_window(ext_b, b_receive_window);
+
+	tox_extension_messages_negotiate(ext_a, user_b.tox_user.id);
+
+	iterate(&user_a, &user_b);
+	iterate(&user_a, &user_b);
+
+	test_sender_waits_for_credit(&user_a, &user_b, ext_a);
+	test_queue_limit(&user_a, &user_b, ext_a);
+	test_window_change(&user_a, &user_b, ext_a, ext_b);
+	test_malformed_segments(&user_a, &user_b, ext_a);
+
+	/* a never limited its window so b can send as fast as it likes */
+	test_unlimited_sender(&user_a, &user_b, ext_b);
+
+	free(last_received_buffer);
+
+	tox_extension_messages_free(ext_b);
+	tox_extension_messages_free(ext_a);
+
+	toxext_test_cleanup_tox_ext_user(&user_b);
+	toxext_test_cleanup_tox_ext_user(&user_a);
+
+	return 0;
+}
@@ -0,0 +1,682 @@
+/*
+ * Load generator for the messages extension. One hub exchanges messages with
+ * many simulated friends over the toxext mock so we can see how the extension
+ * behaves with production sized friend lists, e.g.
+ *
+ *   load_simulator --friends 5000 --messages 100000 --window 32
+ */
+
+#include <assert.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#define malloc_usable_size malloc_size
+#else
+#include <malloc.h>
+#endif
+
+struct AllocationStats {
+	size_t allocations;
+	size_t live_bytes;
+	size_t peak_live_bytes;
+};
+
+static struct AllocationStats allocation_stats;
+
+static void count_allocation(void *ptr)
+{
+	allocation_stats.allocations++;
+	allocation_stats.live_bytes += malloc_usable_size(ptr);
+	if (allocation_stats.live_bytes > allocation_stats.peak_live_bytes) {
+		allocation_stats.peak_live_bytes = allocation_stats.live_bytes;
+	}
+}
+
+static void count_free(void *ptr)
+{
+	allocation_stats.live_bytes -= malloc_usable_size(ptr);
+}
+
+/* Only counts what the extension allocates, not the toxext mock */
+#define TOX_EXTENSION_MESSAGES_ON_ALLOC(ptr) count_allocation(ptr)
+#define TOX_EXTENSION_MESSAGES_ON_FREE(ptr) count_free(ptr)
+
+#include "../tox_extension_messages.c"
+
+#include <toxext/toxext.h>
+#include <toxext/toxext_util.h>
+#include <toxext/mock_fixtures.h>
+
+enum SizeDistribution {
+	SIZE_DISTRIBUTION_FIXED,
+	SIZE_DISTRIBUTION_UNIFORM,
+	SIZE_DISTRIBUTION_BIMODAL,
+};
+
+struct Options {
+	size_t friends;
+	size_t messages;
+	enum SizeDistribution distribution;
+	size_t min_size;
+	size_t max_size;
+	double large_fraction;
+	size_t concurrency;
+	double disconnect_rate;
+	uint32_t window;
+	uint64_t seed;
+};
+
+/* A message the hub should receive next from a friend */
+struct ExpectedMessage {
+	uint64_t send_time;
+	uint64_t sequence;
+	size_t size;
+};
+
+struct SimulatedFriend {
+	struct ToxExtUser user;
+	struct ToxExtensionMessages *ext;
+	/* Messages the hub hasn't received yet, oldest first */
+	struct ExpectedMessage *expected;
+	size_t expected_begin;
+	size_t expected_size;
+	size_t expected_capacity;
+	size_t messages_in_flight;
+};
+
+struct Simulation {
+	struct Options options;
+	struct ToxExtUser hub;
+	struct ToxExtensionMessages *hub_ext;
+	struct SimulatedFriend *friends;
+	uint64_t rng_state;
+	uint8_t *payload;
+
+	size_t messages_sent;
+	size_t messages_received;
+	size_t messages_disconnected;
+	size_t messages_dropped;
+	/* Wrong size or content, or not the message we expected next */
+	size_t messages_corrupted;
+	uint64_t next_sequence;
+	uint64_t bytes_received;
+	uint64_t *latencies;
+	size_t latencies_size;
+};
+
+static uint64_t get_time_ns(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static uint64_t next_random(struct Simulation *sim)
+{
+	/* xorshift64*, reproducible across platforms for a given seed */
+	sim->rng_state ^= sim->rng_state >> 12;
+	sim->rng_state ^= sim->rng_state << 25;
+	sim->rng_state ^= sim->rng_state >> 27;
+	return sim->rng_state * UINT64_C(2685821657736338717);
+}
+
+static double next_random_unit(struct Simulation *sim)
+{
+	return (next_random(sim) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static size_t next_message_size(struct Simulation *sim)
+{
+	struct Options const *options = &sim->options;
+	size_t range = options->max_size - options->min_size + 1;
+
+	switch (options->distribution) {
+	case SIZE_DISTRIBUTION_FIXED:
+		return options->max_size;
+	case SIZE_DISTRIBUTION_UNIFORM:
+		return options->min_size + next_random(sim) % range;
+	case SIZE_DISTRIBUTION_BIMODAL:
+		/* Mostly chat sized messages with the occasional file */
+		if (next_random_unit(sim) < options->large_fraction) {
+			return options->max_size;
+		}
+		return options->min_size +
+		       next_random(sim) % (range < 256 ? range : 256);
+	}
+
+	return options->min_size;
+}
+
+static struct SimulatedFriend *find_friend(struct Simulation *sim,
+					   uint32_t friend_id)
+{
+	/* Friends are created back to back so the ids are contiguous */
+	uint32_t first_id = sim->friends[0].user.tox_user.id;
+	assert(friend_id - first_id < sim->options.friends);
+	return &sim->friends[friend_id - first_id];
+}
+
+static void push_expected(struct SimulatedFriend *simulated_friend,
+			  struct ExpectedMessage expected)
+{
+	if (simulated_friend->expected_size ==
+	    simulated_friend->expected_capacity) {
+		size_t new_capacity = simulated_friend->expected_capacity ?
+					      simulated_friend->expected_capacity *
+						      2 :
+					      4;
+		struct ExpectedMessage *new_expected =
+			malloc(new_capacity * sizeof(struct ExpectedMessage));
+		assert(new_expected);
+		for (size_t i = 0; i < simulated_friend->expected_size; ++i) {
+			new_expected[i] =
+				simulated_friend->expected
+					[(simulated_friend->expected_begin + i) %
+					 simulated_friend->expected_capacity];
+		}
+		free(simulated_friend->expected);
+		simulated_friend->expected = new_expected;
+		simulated_friend->expected_begin = 0;
+		simulated_friend->expected_capacity = new_capacity;
+	}
+
+	simulated_friend->expected
+		[(simulated_friend->expected_begin +
+		  simulated_friend->expected_size++) %
+		 simulated_friend->expected_capacity] = expected;
+}
+
+static bool pop_expected(struct SimulatedFriend *simulated_friend,
+			 struct ExpectedMessage *expected)
+{
+	if (simulated_friend->expected_size == 0) {
+		return false;
+	}
+
+	*expected =
+		simulated_friend->expected[simulated_friend->expected_begin];
+	simulated_friend->expected_begin =
+		(simulated_friend->expected_begin + 1) %
+		simulated_friend->expected_capacity;
+	simulated_friend->expected_size--;
+	return true;
+}
+
+static uint8_t payload_byte(uint64_t sequence, size_t index)
+{
+	return (uint8_t)(sequence * 131 + index * 7 + (index >> 8));
+}
+
+/*
+ * Every message starts with its sequence number and continues with a pattern
+ * derived from it, so a message spliced together from the remains of an
+ * earlier one is caught
+ */
+static void fill_payload(uint8_t *payload, size_t size, uint64_t sequence)
+{
+	uint8_t header[8];
+	toxext_write_to_buf(sequence, header, 8);
+	size_t header_size = size < 8 ? size : 8;
+	memcpy(payload, header, header_size);
+
+	for (size_t i = header_size; i < size; ++i) {
+		payload[i] = payload_byte(sequence, i);
+	}
+}
+
+static bool payload_matches(uint8_t const *payload, size_t size,
+			    uint64_t sequence)
+{
+	uint8_t header[8];
+	toxext_write_to_buf(sequence, header, 8);
+	size_t header_size = size < 8 ? size : 8;
+
+	if (memcmp(payload, header, header_size) != 0) {
+		return false;
+	}
+
+	for (size_t i = header_size; i < size; ++i) {
+		if (payload[i] != payload_byte(sequence, i)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void hub_received_cb(uint32_t friend_number, uint8_t const *message,
+			    size_t length, void *user_data)
+{
+	struct Simulation *sim = user_data;
+	struct SimulatedFriend *simulated_friend =
+		find_friend(sim, friend_number);
+
+	struct ExpectedMessage expected;
+	if (!pop_expected(simulated_friend, &expected)) {
+		sim->messages_corrupted++;
+		return;
+	}
+
+	if (length != expected.size ||
+	    !payload_matches(message, length, expected.sequence)) {
+		sim->messages_corrupted++;
+	}
+
+	sim->latencies[sim->latencies_size++] =
+		get_time_ns() - expected.send_time;
+	sim->messages_received++;
+	sim->bytes_received += length;
+}
+
+static void hub_dropped_cb(uint32_t friend_number,
+			   enum Tox_Extension_Messages_Drop_Reason reason,
+			   void *user_data)
+{
+	(void)friend_number;
+	(void)reason;
+	struct Simulation *sim = user_data;
+	sim->messages_dropped++;
+}
+
+static void friend_receipt_cb(uint32_t friend_number, const uint64_t receipt_id,
+			      void *user_data)
+{
+	(void)friend_number;
+	(void)receipt_id;
+	struct SimulatedFriend *simulated_friend = user_data;
+	simulated_friend->messages_in_flight--;
+}
+
+static void ignore_received_cb(uint32_t friend_number, uint8_t const *message,
+			       size_t length, void *user_data)
+{
+	(void)friend_number;
+	(void)message;
+	(void)length;
+	(void)user_data;
+}
+
+static void ignore_receipt_cb(uint32_t friend_number, const uint64_t receipt_id,
+			      void *user_data)
+{
+	(void)friend_number;
+	(void)receipt_id;
+	(void)user_data;
+}
+
+static void ignore_neg_cb(uint32_t friend_number, bool compatible,
+			  uint64_t max_sending_size, void *user_data)
+{
+	(void)friend_number;
+	(void)compatible;
+	(void)max_sending_size;
+	(void)user_data;
+}
+
+static void iterate_all(struct Simulation *sim)
+{
+	tox_iterate(sim->hub.tox_user.tox, &sim->hub.tox_user);
+	for (size_t i = 0; i < sim->options.friends; ++i) {
+		tox_iterate(sim->friends[i].user.tox_user.tox,
+			    &sim->friends[i].user.tox_user);
+	}
+}
+
+/*
+ * Sends the first half of a message and then drops the connection, as if the
+ * friend went offline half way through
+ */
+static void send_disconnecting(struct Simulation *sim,
+			       struct SimulatedFriend *simulated_friend,
+			       size_t size)
+{
+	uint32_t hub_id = sim->hub.tox_user.id;
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(simulated_friend->user.toxext, hub_id);
+
+	/* The hub must never deliver any of this */
+	fill_payload(sim->payload, size, sim->next_sequence++);
+
+	uint8_t const *end = sim->payload + size;
+	uint8_t const *next_chunk = sim->payload;
+	bool first_chunk = true;
+	while (next_chunk < sim->payload + size / 2) {
+		uint8_t extension_data[TOXEXT_MAX_SEGMENT_SIZE];
+		size_t size_for_chunk;
+		next_chunk = tox_extension_messages_chunk(
+			first_chunk, next_chunk, end - next_chunk,
+			simulated_friend->ext->next_receipt_id, NULL,
+			extension_data, &size_for_chunk);
+		first_chunk = false;
+
+		toxext_segment_append(packet_list,
+				      simulated_friend->ext->extension_handle,
+				      extension_data, size_for_chunk);
+	}
+	simulated_friend->ext->next_receipt_id++;
+	toxext_send(packet_list);
+
+	/*
+	 * Whatever made it across arrives before the connection goes away, and
+	 * both ends see it go before negotiating again
+	 */
+	tox_iterate(sim->hub.tox_user.tox, &sim->hub.tox_user);
+
+	uint32_t friend_id = simulated_friend->user.tox_user.id;
+	struct ToxExtPacketList *hub_packet_list =
+		toxext_packet_list_create(sim->hub.toxext, friend_id);
+	tox_extension_messages_neg(sim->hub_ext->extension_handle, friend_id,
+				   false, sim->hub_ext, hub_packet_list);
+	toxext_send(hub_packet_list);
+	struct ToxExtPacketList *friend_packet_list =
+		toxext_packet_list_create(simulated_friend->user.toxext, hub_id);
+	tox_extension_messages_neg(simulated_friend->ext->extension_handle,
+				   hub_id, false, simulated_friend->ext,
+				   friend_packet_list);
+	toxext_send(friend_packet_list);
+
+	tox_extension_messages_negotiate(simulated_friend->ext, hub_id);
+	sim->messages_disconnected++;
+}
+
+/* Friends that were disconnected can't send until they negotiated again */
+static bool is_negotiated(struct Simulation *sim,
+			  struct SimulatedFriend *simulated_friend)
+{
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_get_max_sending_size(
+		simulated_friend->ext, sim->hub.tox_user.id, &err);
+	return err == TOX_EXTENSION_MESSAGES_SUCCESS;
+}
+
+static void send_message(struct Simulation *sim,
+			 struct SimulatedFriend *simulated_friend)
+{
+	size_t size = next_message_size(sim);
+	uint32_t hub_id = sim->hub.tox_user.id;
+
+	if (size > TOXEXT_MAX_SEGMENT_SIZE * 2 &&
+	    next_random_unit(sim) < sim->options.disconnect_rate) {
+		send_disconnecting(sim, simulated_friend, size);
+		return;
+	}
+
+	struct ExpectedMessage expected = {
+		.send_time = get_time_ns(),
+		.sequence = sim->next_sequence++,
+		.size = size,
+	};
+	fill_payload(sim->payload, size, expected.sequence);
+	push_expected(simulated_friend, expected);
+
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(simulated_friend->user.toxext, hub_id);
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_append(simulated_friend->ext, packet_list,
+				      sim->payload, size, hub_id, &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	toxext_send(packet_list);
+
+	simulated_friend->messages_in_flight++;
+	sim->messages_sent++;
+}
+
+static int compare_u64(void const *a, void const *b)
+{
+	uint64_t lhs = *(uint64_t const *)a;
+	uint64_t rhs = *(uint64_t const *)b;
+	return (lhs > rhs) - (lhs < rhs);
+}
+
+static double percentile_ms(uint64_t *sorted, size_t size, double percentile)
+{
+	if (size == 0) {
+		return 0;
+	}
+
+	size_t index = (size_t)(percentile * (size - 1));
+	return sorted[index] / 1e6;
+}
+
+static void setup(struct Simulation *sim)
+{
+	struct Options const *options = &sim->options;
+
+	sim->payload = malloc(options->max_size);
+	assert(sim->payload);
+
+	sim->latencies = malloc(options->messages * sizeof(uint64_t));
+	assert(sim->latencies);
+
+	toxext_test_init_tox_ext_user(&sim->hub);
+	sim->hub_ext = tox_extension_messages_register(
+		sim->hub.toxext, hub_received_cb, ignore_receipt_cb,
+		ignore_neg_cb, sim,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	tox_extension_messages_set_receive_window(sim->hub_ext,
+						  options->window);
+	tox_extension_messages_set_dropped_cb(sim->hub_ext, hub_dropped_cb);
+
+	sim->friends = calloc(options->friends, sizeof(struct SimulatedFriend));
+	assert(sim->friends);
+
+	for (size_t i = 0; i < options->friends; ++i) {
+		struct SimulatedFriend *simulated_friend = &sim->friends[i];
+		toxext_test_init_tox_ext_user(&simulated_friend->user);
+		simulated_friend->ext = tox_extension_messages_register(
+			simulated_friend->user.toxext, ignore_received_cb,
+			friend_receipt_cb, ignore_neg_cb, simulated_friend,
+			TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+		assert(simulated_friend->ext);
+		assert(i == 0 || simulated_friend->user.tox_user.id ==
+					 sim->friends[i - 1].user.tox_user.id + 1);
+
+		tox_extension_messages_negotiate(simulated_friend->ext,
+						 sim->hub.tox_user.id);
+	}
+
+	/* Negotiation takes two round trips */
+	for (size_t i = 0; i < 4; ++i) {
+		iterate_all(sim);
+	}
+}
+
+static void cleanup(struct Simulation *sim)
+{
+	for (size_t i = 0; i < sim->options.friends; ++i) {
+		tox_extension_messages_free(sim->friends[i].ext);
+		toxext_test_cleanup_tox_ext_user(&sim->friends[i].user);
+		free(sim->friends[i].expected);
+	}
+	tox_extension_messages_free(sim->hub_ext);
+	toxext_test_cleanup_tox_ext_user(&sim->hub);
+
+	free(sim->friends);
+	free(sim->latencies);
+	free(sim->payload);
+}
+
+static void run(struct Simulation *sim)
+{
+	struct Options const *options = &sim->options;
+	size_t messages_started = 0;
+	size_t rounds = 0;
+
+	uint64_t start = get_time_ns();
+
+	while (sim->messages_received < sim->messages_sent ||
+	       messages_started < options->messages) {
+		/* Keep a bounded number of random friends sending at once */
+		for (size_t i = 0; i < options->concurrency &&
+				   messages_started < options->messages;
+		     ++i) {
+			struct SimulatedFriend *simulated_friend =
+				&sim->friends[next_random(sim) % options->friends];
+			if (simulated_friend->messages_in_flight > 0 ||
+			    !is_negotiated(sim, simulated_friend)) {
+				continue;
+			}
+			send_message(sim, simulated_friend);
+			messages_started++;
+		}
+
+		iterate_all(sim);
+		rounds++;
+	}
+
+	uint64_t elapsed = get_time_ns() - start;
+
+	qsort(sim->latencies, sim->latencies_size, sizeof(uint64_t),
+	      compare_u64);
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	double elapsed_s = elapsed / 1e9;
+	printf("friends:               %zu\n", options->friends);
+	printf("messages delivered:    %zu\n", sim->messages_received);
+	printf("messages disconnected: %zu\n", sim->messages_disconnected);
+	printf("messages dropped:      %zu\n", sim->messages_dropped);
+	printf("messages corrupted:    %zu\n", sim->messages_corrupted);
+	printf("rounds:                %zu\n", rounds);
+	printf("elapsed:               %.3f s\n", elapsed_s);
+	printf("throughput:            %.2f MiB/s, %.0f messages/s\n",
+	       sim->bytes_received / elapsed_s / (1024 * 1024),
+	       sim->messages_received / elapsed_s);
+	printf("latency p50:           %.3f ms\n",
+	       percentile_ms(sim->latencies, sim->latencies_size, 0.5));
+	printf("latency p99:           %.3f ms\n",
+	       percentile_ms(sim->latencies, sim->latencies_size, 0.99));
+	printf("peak rss:              %.1f MiB\n", usage.ru_maxrss / 1024.0);
+	printf("extension allocations: %zu\n", allocation_stats.allocations);
+	printf("extension peak heap:   %.1f MiB\n",
+	       allocation_stats.peak_live_bytes / (1024.0 * 1024.0));
+}
+
+static void usage(char const *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  --friends N          simulated friends (default 1000)\n"
+		"  --messages N         messages to send (default 20000)\n"
+		"  --distribution D     fixed, uniform or bimodal (default bimodal)\n"
+		"  --min-size N         smallest message (default 16)\n"
+		"  --max-size N         largest message (default 1048576)\n"
+		"  --large-fraction F   share of max size messages for bimodal (default 0.01)\n"
+		"  --concurrency N      friends starting a message per round (default 64)\n"
+		"  --disconnect-rate F  share of large messages cut off half way (default 0.01)\n"
+		"  --window N           hub receive window in segments, 0 for none (default 0)\n"
+		"  --seed N             random seed (default 1)\n",
+		name);
+}
+
+static bool parse_options(int argc, char **argv, struct Options *options)
+{
+	static struct option const long_options[] = {
+		{ "friends", required_argument, NULL, 'f' },
+		{ "messages", required_argument, NULL, 'm' },
+		{ "distribution", required_argument, NULL, 'd' },
+		{ "min-size", required_argument, NULL, 'n' },
+		{ "max-size", required_argument, NULL, 'x' },
+		{ "large-fraction", required_argument, NULL, 'l' },
+		{ "concurrency", required_argument, NULL, 'c' },
+		{ "disconnect-rate", required_argument, NULL, 'r' },
+		{ "window", required_argument, NULL, 'w' },
+		{ "seed", required_argument, NULL, 's' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'f':
+			options->friends = strtoull(optarg, NULL, 10);
+			break;
+		case 'm':
+			options->messages = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			if (strcmp(optarg, "fixed") == 0) {
+				options->distribution = SIZE_DISTRIBUTION_FIXED;
+			} else if (strcmp(optarg, "uniform") == 0) {
+				options->distribution = SIZE_DISTRIBUTION_UNIFORM;
+			} else if (strcmp(optarg, "bimodal") == 0) {
+				options->distribution = SIZE_DISTRIBUTION_BIMODAL;
+			} else {
+				return false;
+			}
+			break;
+		case 'n':
+			options->min_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'x':
+			options->max_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'l':
+			options->large_fraction = strtod(optarg, NULL);
+			break;
+		case 'c':
+			options->concurrency = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			options->disconnect_rate = strtod(optarg, NULL);
+			break;
+		case 'w':
+			options->window = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			options->seed = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			return false;
+		}
+	}
+
+	return optind == argc && options->friends > 0 &&
+	       options->min_size <= options->max_size && options->max_size > 0 &&
+	       options->max_size <=
+		       TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE;
+}
+
+int main(int argc, char **argv)
+{
+	struct Simulation sim;
+	memset(&sim, 0, sizeof(sim));
+
+	sim.options = (struct Options){
+		.friends = 1000,
+		.messages = 20000,
+		.distribution = SIZE_DISTRIBUTION_BIMODAL,
+		.min_size = 16,
+		.max_size = 1024 * 1024,
+		.large_fraction = 0.01,
+		.concurrency = 64,
+		.disconnect_rate = 0.01,
+		.window = 0,
+		.seed = 1,
+	};
+
+	if (!parse_options(argc, argv, &sim.options)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	sim.rng_state = sim.options.seed ? sim.options.seed : 1;
+
+	setup(&sim);
+	run(&sim);
+	cleanup(&sim);
+
+	if (sim.messages_corrupted > 0) {
+		fprintf(stderr, "the hub received corrupted messages\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -50,7 +50,7 @@ uint64_t test_tox_extension_messages_append_no_size_check(
 		size_t size_for_chunk;
 		next_chunk = tox_extension_messages_chunk(
 			first_chunk, next_chunk, end - next_chunk, receipt_id,
-			extension_data, &size_for_chunk);
+			NULL, extension_data, &size_for_chunk);
 		first_chunk = false;
 
 		toxext_segment_append(packet_list, extension->extension_handle,
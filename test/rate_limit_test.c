@@ -0,0 +1,482 @@
+#include "../tox_extension_messages.c"
+
+#include <toxext/toxext.h>
+#include <toxext/mock_fixtures.h>
+#include <assert.h>
+
+static size_t messages_received = 0;
+static size_t receipts_received = 0;
+static size_t drops[TOX_EXTENSION_MESSAGES_DROP_RATE_LIMITED_STARTS + 1];
+static uint64_t now = 0;
+
+static void test_cb(uint32_t friend_number, uint8_t const *message,
+		    size_t length, void *user_data)
+{
+	(void)friend_number;
+	(void)message;
+	(void)length;
+	(void)user_data;
+	messages_received++;
+}
+
+static void test_receipt_cb(uint32_t friend_number, const uint64_t receipt_id,
+			    void *user_data)
+{
+	(void)friend_number;
+	(void)receipt_id;
+	(void)user_data;
+	receipts_received++;
+}
+
+static void test_neg_cb(uint32_t friend_number, bool compatible,
+			uint64_t max_sending_size, void *user_data)
+{
+	(void)friend_number;
+	(void)compatible;
+	(void)max_sending_size;
+	(void)user_data;
+}
+
+static void test_dropped_cb(uint32_t friend_number,
+			    enum Tox_Extension_Messages_Drop_Reason reason,
+			    void *user_data)
+{
+	(void)friend_number;
+	(void)user_data;
+	drops[reason]++;
+}
+
+static uint64_t test_clock(void *clock_user_data)
+{
+	(void)clock_user_data;
+	return now;
+}
+
+static uint8_t buffer[TOXEXT_MAX_SEGMENT_SIZE * 3];
+
+static void reset_counters(void)
+{
+	messages_received = 0;
+	receipts_received = 0;
+	memset(drops, 0, sizeof(drops));
+}
+
+static void iterate(struct ToxExtUser *user_a, struct ToxExtUser *user_b)
+{
+	tox_iterate(user_b->tox_user.tox, &user_b->tox_user);
+	tox_iterate(user_a->tox_user.tox, &user_a->tox_user);
+}
+
+static void send_message(struct ToxExtUser *user_a, struct ToxExtUser *user_b,
+			 struct ToxExtensionMessages *ext_a, size_t size)
+{
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_a->toxext, user_b->tox_user.id);
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_append(ext_a, packet_list, buffer, size,
+				      user_b->tox_user.id, &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	toxext_send(packet_list);
+	iterate(user_a, user_b);
+}
+
+/* A start claiming a huge message, the attack we want to make cheap */
+static void send_start(struct ToxExtUser *user_a, struct ToxExtUser *user_b,
+		       struct ToxExtensionMessages *ext_a)
+{
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_a->toxext, user_b->tox_user.id);
+	uint8_t extension_data[TOXEXT_MAX_SEGMENT_SIZE];
+	size_t size_for_chunk;
+	tox_extension_messages_chunk(
+		true, buffer,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE, 0,
+		NULL, extension_data, &size_for_chunk);
+	toxext_segment_append(packet_list, ext_a->extension_handle,
+			      extension_data, size_for_chunk);
+	toxext_send(packet_list);
+	iterate(user_a, user_b);
+}
+
+static void test_start_limit(struct ToxExtUser *user_a,
+			     struct ToxExtUser *user_b,
+			     struct ToxExtensionMessages *ext_a,
+			     struct ToxExtensionMessages *ext_b)
+{
+	struct Tox_Extension_Messages_Rate_Limits limits = {
+		.starts_per_interval = 2,
+		.start_interval_ms = 1000,
+	};
+	tox_extension_messages_set_rate_limits(ext_b, &limits);
+	reset_counters();
+
+	struct FriendData *friend_data =
+		get_friend_data(ext_b, user_a->tox_user.id);
+
+	for (size_t i = 0; i < 10; ++i) {
+		send_start(user_a, user_b, ext_a);
+	}
+	assert(drops[TOX_EXTENSION_MESSAGES_DROP_RATE_LIMITED_STARTS] == 8);
+	/* Nothing is held on to for starts we dropped */
+	assert(friend_data->message.message == NULL);
+
+	/* One start refills every 500ms */
+	now += 500;
+	send_start(user_a, user_b, ext_a);
+	assert(drops[TOX_EXTENSION_MESSAGES_DROP_RATE_LIMITED_STARTS] == 8);
+	send_start(user_a, user_b, ext_a);
+	assert(drops[TOX_EXTENSION_MESSAGES_DROP_RATE_LIMITED_STARTS] == 9);
+
+	/*
+	 * Single segment messages don't start anything. The first one is taken
+	 * as the end of the message whose start we dropped
+	 */
+	for (size_t i = 0; i < 10; ++i) {
+		send_message(user_a, user_b, ext_a, 10);
+	}
+	assert(messages_received == 9);
+	assert(drops[TOX_EXTENSION_MESSAGES_DROP_RATE_LIMITED_STARTS] == 9);
+
+	now += 1000;
+	tox_extension_messages_set_rate_limits(ext_b, NULL);
+}
+
+static void test_segment_limit(struct ToxExtUser *user_a,
+			       struct ToxExtUser *user_b,
+			       struct ToxExtensionMessages *ext_a,
+			       struct ToxExtensionMessages *ext_b)
+{
+	struct Tox_Extension_Messages_Rate_Limits limits = {
+		.segments_per_second = 4,
+	};
+	tox_extension_messages_set_rate_limits(ext_b, &limits);
+	reset_counters();
+
+	send_message(user_a, user_b, ext_a, sizeof(buffer));
+	assert(messages_received == 1);
+
+	/* The first message used up the burst, so all 4 segments go */
+	send_message(user_a, user_b, ext_a, sizeof(buffer));
+	assert(messages_received == 1);
+	assert(drops[TOX_EXTENSION_MESSAGES_DROP_RATE_LIMITED_SEGMENTS] == 4);
+
+	/* Half a message is dropped along with its start */
+	now += 500;
+	send_message(user_a, user_b, ext_a, sizeof(buffer));
+	assert(messages_received == 1);
+	assert(drops[TOX_EXTENSION_MESSAGES_DROP_RATE_LIMITED_SEGMENTS] == 6);
+	assert(drops[TOX_EXTENSION_MESSAGES_DROP_MALFORMED] == 0);
+
+	now += 1000;
+	send_message(user_a, user_b, ext_a, sizeof(buffer));
+	assert(messages_received == 2);
+
+	/* Receipts for our own messages are never limited */
+	for (size_t i = 0; i < 10; ++i) {
+		send_message(user_b, user_a, ext_b, 10);
+	}
+	assert(receipts_received == 10 + 2);
+	reset_counters();
+
+	/* Trusted friends can be exempted */
+	struct Tox_Extension_Messages_Rate_Limits unlimited = { 0 };
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_set_friend_rate_limits(
+		ext_b, user_a->tox_user.id, &unlimited, &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	for (size_t i = 0; i < 5; ++i) {
+		send_message(user_a, user_b, ext_a, sizeof(buffer));
+	}
+	assert(messages_received == 5);
+
+	tox_extension_messages_clear_friend_rate_limits(ext_b,
+							user_a->tox_user.id);
+	send_message(user_a, user_b, ext_a, sizeof(buffer));
+	send_message(user_a, user_b, ext_a, sizeof(buffer));
+	assert(messages_received == 6);
+
+	now += 1000;
+	tox_extension_messages_set_rate_limits(ext_b, NULL);
+}
+
+static void test_byte_limit(struct ToxExtUser *user_a,
+			    struct ToxExtUser *user_b,
+			    struct ToxExtensionMessages *ext_a,
+			    struct ToxExtensionMessages *ext_b)
+{
+	struct Tox_Extension_Messages_Rate_Limits limits = {
+		.bytes_per_second = sizeof(buffer),
+		.byte_burst = sizeof(buffer) * 2,
+	};
+	tox_extension_messages_set_rate_limits(ext_b, &limits);
+	reset_counters();
+
+	/* Headers count too, so only the first message fits in the burst */
+	send_message(user_a, user_b, ext_a, sizeof(buffer));
+	send_message(user_a, user_b, ext_a, sizeof(buffer));
+	assert(messages_received == 1);
+	assert(drops[TOX_EXTENSION_MESSAGES_DROP_RATE_LIMITED_BYTES] > 0);
+
+	now += 2000;
+	send_message(user_a, user_b, ext_a, sizeof(buffer));
+	assert(messages_received == 2);
+
+	now += 2000;
+	tox_extension_messages_set_rate_limits(ext_b, NULL);
+}
+
+/* A burst this large would wrap around if it were scaled naively */
+static void test_huge_byte_burst(struct ToxExtUser *user_a,
+				 struct ToxExtUser *user_b,
+				 struct ToxExtensionMessages *ext_a,
+				 struct ToxExtensionMessages *ext_b)
+{
+	struct Tox_Extension_Messages_Rate_Limits limits = {
+		.bytes_per_second = 1,
+		.byte_burst = UINT64_MAX / 1000 + 1,
+	};
+	tox_extension_messages_set_rate_limits(ext_b, &limits);
+	reset_counters();
+
+	send_message(user_a, user_b, ext_a, sizeof(buffer));
+	assert(messages_received == 1);
+	assert(drops[TOX_EXTENSION_MESSAGES_DROP_RATE_LIMITED_BYTES] == 0);
+
+	tox_extension_messages_set_rate_limits(ext_b, NULL);
+}
+
+/* Bursts smaller than a segment still let full segments through, slowly */
+static void test_tiny_byte_burst(struct ToxExtUser *user_a,
+				 struct ToxExtUser *user_b,
+				 struct ToxExtensionMessages *ext_a,
+				 struct ToxExtensionMessages *ext_b)
+{
+	uint64_t const byte_bursts[] = { 0, 10 };
+
+	for (size_t i = 0; i < sizeof(byte_bursts) / sizeof(byte_bursts[0]);
+	     ++i) {
+		struct Tox_Extension_Messages_Rate_Limits limits = {
+			.bytes_per_second = 100,
+			.byte_burst = byte_bursts[i],
+		};
+		tox_extension_messages_set_rate_limits(ext_b, &limits);
+		reset_counters();
+
+		/* The largest message that fits in one full segment */
+		send_message(user_a, user_b, ext_a,
+			     DEDUP_SINGLE_SEGMENT_SIZE - 1);
+		assert(messages_received == 1);
+
+		send_message(user_a, user_b, ext_a,
+			     DEDUP_SINGLE_SEGMENT_SIZE - 1);
+		assert(messages_received == 1);
+		assert(drops[TOX_EXTENSION_MESSAGES_DROP_RATE_LIMITED_BYTES] ==
+		       1);
+
+		now += TOXEXT_MAX_SEGMENT_SIZE * 1000 / 100;
+		send_message(user_a, user_b, ext_a,
+			     DEDUP_SINGLE_SEGMENT_SIZE - 1);
+		assert(messages_received == 2);
+
+		now += TOXEXT_MAX_SEGMENT_SIZE * 1000 / 100;
+	}
+
+	tox_extension_messages_set_rate_limits(ext_b, NULL);
+}
+
+/* Friends we know nothing about get a slot once a segment is let through */
+static void test_unknown_friend(struct ToxExtUser *user_b,
+				struct ToxExtensionMessages *ext_b)
+{
+	uint32_t const unknown_friend = 4242;
+	struct Tox_Extension_Messages_Rate_Limits limits = {
+		.bytes_per_second = 100,
+	};
+	tox_extension_messages_set_rate_limits(ext_b, &limits);
+	reset_counters();
+
+	uint8_t segment[TOXEXT_MAX_SEGMENT_SIZE];
+	size_t segment_size;
+	tox_extension_messages_chunk(true, buffer, 10, 0, NULL, segment,
+				     &segment_size);
+
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_b->toxext, unknown_friend);
+	assert(!get_friend_data(ext_b, unknown_friend));
+	tox_extension_messages_recv(ext_b->extension_handle, unknown_friend,
+				    segment, segment_size, ext_b, packet_list);
+	assert(messages_received == 1);
+
+	/* And has already paid for its segment out of a full burst */
+	struct FriendData *friend_data = get_friend_data(ext_b, unknown_friend);
+	assert(friend_data);
+	assert(friend_data->rate_limiter.bytes.scaled_tokens ==
+	       (TOXEXT_MAX_SEGMENT_SIZE - segment_size) * 1000);
+	toxext_send(packet_list);
+
+	tox_extension_messages_set_rate_limits(ext_b, NULL);
+}
+
+static void test_credit_survives_drops(struct ToxExtUser *user_a,
+				       struct ToxExtUser *user_b,
+				       struct ToxExtensionMessages *ext_a,
+				       struct ToxExtensionMessages *ext_b)
+{
+	struct Tox_Extension_Messages_Rate_Limits limits = {
+		.segments_per_second = 1,
+	};
+	tox_extension_messages_set_rate_limits(ext_b, &limits);
+	reset_counters();
+
+	for (size_t i = 0; i < 5; ++i) {
+		send_message(user_a, user_b, ext_a, sizeof(buffer));
+		iterate(user_a, user_b);
+		iterate(user_a, user_b);
+	}
+	assert(messages_received == 0);
+	assert(tox_extension_messages_get_pending_segments(
+		       ext_a, user_b->tox_user.id) == 0);
+
+	tox_extension_messages_set_rate_limits(ext_b, NULL);
+	send_message(user_a, user_b, ext_a, sizeof(buffer));
+	iterate(user_a, user_b);
+	iterate(user_a, user_b);
+	assert(messages_received == 1);
+}
+
+/*
+ * Requests answer our own offers, which hold back everything after them, so
+ * limits on the offering side must not drop them
+ */
+static void test_requests_not_limited(struct ToxExtUser *user_a,
+				      struct ToxExtUser *user_b,
+				      struct ToxExtensionMessages *ext_a)
+{
+	struct Tox_Extension_Messages_Rate_Limits limits = {
+		.segments_per_second = 1,
+		.segment_burst = 1,
+	};
+	tox_extension_messages_set_rate_limits(ext_a, &limits);
+	reset_counters();
+
+	static uint8_t const small_buffer[] = "before the offers";
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_a->toxext, user_b->tox_user.id);
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_append(ext_a, packet_list, small_buffer,
+				      sizeof(small_buffer), user_b->tox_user.id,
+				      &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	/* Two different bodies so b has to ask for both */
+	tox_extension_messages_append(ext_a, packet_list, buffer,
+				      sizeof(buffer), user_b->tox_user.id,
+				      &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	tox_extension_messages_append(ext_a, packet_list, buffer + 1,
+				      sizeof(buffer) - 1, user_b->tox_user.id,
+				      &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	toxext_send(packet_list);
+
+	for (size_t i = 0; i < 8; ++i) {
+		iterate(user_a, user_b);
+	}
+
+	assert(messages_received == 3);
+	assert(tox_extension_messages_get_pending_segments(
+		       ext_a, user_b->tox_user.id) == 0);
+
+	tox_extension_messages_set_rate_limits(ext_a, NULL);
+}
+
+int main(void)
+{
+	struct ToxExtUser user_a;
+	struct ToxExtUser user_b;
+
+	for (size_t i = 0; i < sizeof(buffer); ++i) {
+		buffer[i] = i * 31;
+	}
+
+	toxext_test_init_tox_ext_user(&user_a);
+	toxext_test_init_tox_ext_user(&user_b);
+
+	struct ToxExtensionMessages *ext_a = tox_extension_messages_register(
+		user_a.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	struct ToxExtensionMessages *ext_b = tox_extension_messages_register(
+		user_b.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	tox_extension_messages_set_clock(ext_b, test_clock, NULL);
+	tox_extension_messages_set_dropped_cb(ext_b, test_dropped_cb);
+
+	tox_extension_messages_negotiate(ext_a, user_b.tox_user.id);
+	iterate(&user_a, &user_b);
+	iterate(&user_a, &user_b);
+
+	test_start_limit(&user_a, &user_b, ext_a, ext_b);
+	test_segment_limit(&user_a, &user_b, ext_a, ext_b);
+	test_byte_limit(&user_a, &user_b, ext_a, ext_b);
+	test_huge_byte_burst(&user_a, &user_b, ext_a, ext_b);
+	test_tiny_byte_burst(&user_a, &user_b, ext_a, ext_b);
+	test_unknown_friend(&user_b, ext_b);
+
+	tox_extension_messages_free(ext_b);
+	tox_extension_messages_free(ext_a);
+
+	toxext_test_cleanup_tox_ext_user(&user_b);
+	toxext_test_cleanup_tox_ext_user(&user_a);
+
+	/* Again with flow control */
+	toxext_test_init_tox_ext_user(&user_a);
+	toxext_test_init_tox_ext_user(&user_b);
+
+	ext_a = tox_extension_messages_register(
+		user_a.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	ext_b = tox_extension_messages_register(
+		user_b.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	tox_extension_messages_set_clock(ext_b, test_clock, NULL);
+	tox_extension_messages_set_receive_window(ext_b, 2);
+
+	tox_extension_messages_negotiate(ext_a, user_b.tox_user.id);
+	iterate(&user_a, &user_b);
+	iterate(&user_a, &user_b);
+
+	test_credit_survives_drops(&user_a, &user_b, ext_a, ext_b);
+
+	tox_extension_messages_free(ext_b);
+	tox_extension_messages_free(ext_a);
+
+	toxext_test_cleanup_tox_ext_user(&user_b);
+	toxext_test_cleanup_tox_ext_user(&user_a);
+
+	/* Again with dedup, limiting the offering side */
+	toxext_test_init_tox_ext_user(&user_a);
+	toxext_test_init_tox_ext_user(&user_b);
+
+	ext_a = tox_extension_messages_register(
+		user_a.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	ext_b = tox_extension_messages_register(
+		user_b.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	tox_extension_messages_set_clock(ext_a, test_clock, NULL);
+	tox_extension_messages_enable_dedup(ext_a, 0, sizeof(buffer));
+	tox_extension_messages_enable_dedup(ext_b, sizeof(buffer) * 2, 0);
+
+	tox_extension_messages_negotiate(ext_a, user_b.tox_user.id);
+	iterate(&user_a, &user_b);
+	iterate(&user_a, &user_b);
+
+	test_requests_not_limited(&user_a, &user_b, ext_a);
+
+	tox_extension_messages_free(ext_b);
+	tox_extension_messages_free(ext_a);
+
+	toxext_test_cleanup_tox_ext_user(&user_b);
+	toxext_test_cleanup_tox_ext_user(&user_a);
+
+	return 0;
+}
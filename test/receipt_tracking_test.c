@@ -0,0 +1,231 @@
+#include "../tox_extension_messages.c"
+
+#include <toxext/toxext.h>
+#include <toxext/mock_fixtures.h>
+#include <assert.h>
+
+static uint64_t current_time = 1000;
+
+static size_t completions = 0;
+static uint64_t last_completed_receipt_id = 0;
+static enum Tox_Extension_Messages_Receipt_Status last_status;
+static void *last_context = NULL;
+
+static void test_cb(uint32_t friend_number, uint8_t const *message,
+		    size_t length, void *user_data)
+{
+	(void)friend_number;
+	(void)message;
+	(void)length;
+	(void)user_data;
+}
+
+static void test_receipt_cb(uint32_t friend_number, const uint64_t receipt_id,
+			    void *user_data)
+{
+	(void)friend_number;
+	(void)receipt_id;
+	(void)user_data;
+}
+
+static void test_neg_cb(uint32_t friend_number, bool compatible,
+			uint64_t max_sending_size, void *user_data)
+{
+	(void)friend_number;
+	(void)compatible;
+	(void)max_sending_size;
+	(void)user_data;
+}
+
+static void test_completion_cb(uint32_t friend_number, uint64_t receipt_id,
+			       enum Tox_Extension_Messages_Receipt_Status status,
+			       void *context, void *user_data)
+{
+	(void)friend_number;
+	(void)user_data;
+	completions++;
+	last_completed_receipt_id = receipt_id;
+	last_status = status;
+	last_context = context;
+}
+
+static uint64_t test_clock(void *user_data)
+{
+	(void)user_data;
+	return current_time;
+}
+
+/* A second clock on a timeline of its own */
+static uint64_t other_time = 5;
+
+static uint64_t other_clock(void *user_data)
+{
+	(void)user_data;
+	return other_time;
+}
+
+static uint64_t send_tracked(struct ToxExtUser *user_a,
+			     struct ToxExtUser *user_b,
+			     struct ToxExtensionMessages *ext_a,
+			     uint64_t timeout, void *context)
+{
+	static char const buffer[] = "asdf";
+	enum Tox_Extension_Messages_Error err;
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_a->toxext, user_b->tox_user.id);
+	uint64_t receipt_id = tox_extension_messages_append_tracked(
+		ext_a, packet_list, (uint8_t const *)buffer, sizeof(buffer),
+		user_b->tox_user.id, timeout, context, &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	toxext_send(packet_list);
+	return receipt_id;
+}
+
+static void advance_time(struct ToxExtensionMessages *ext, uint64_t ms)
+{
+	current_time += ms;
+	tox_extension_messages_iterate(ext);
+}
+
+void test_delivered(struct ToxExtUser *user_a, struct ToxExtUser *user_b,
+		    struct ToxExtensionMessages *ext_a)
+{
+	int context;
+	completions = 0;
+	uint64_t receipt_id = send_tracked(user_a, user_b, ext_a, 100, &context);
+
+	tox_iterate(user_b->tox_user.tox, &user_b->tox_user);
+	tox_iterate(user_a->tox_user.tox, &user_a->tox_user);
+
+	assert(completions == 1);
+	assert(last_completed_receipt_id == receipt_id);
+	assert(last_status == TOX_EXTENSION_MESSAGES_RECEIPT_DELIVERED);
+	assert(last_context == &context);
+
+	/* Delivered receipts must not fire again */
+	advance_time(ext_a, 1000);
+	assert(completions == 1);
+}
+
+void test_timed_out(struct ToxExtUser *user_a, struct ToxExtUser *user_b,
+		    struct ToxExtensionMessages *ext_a, uint64_t timeout)
+{
+	int context;
+	completions = 0;
+	uint64_t receipt_id =
+		send_tracked(user_a, user_b, ext_a, timeout, &context);
+
+	/* Step up to just before the deadline in uneven increments */
+	uint64_t elapsed = 0;
+	uint64_t step = 1;
+	while (elapsed + step < timeout) {
+		advance_time(ext_a, step);
+		elapsed += step;
+		assert(completions == 0);
+		step = step * 3 + 1;
+	}
+	advance_time(ext_a, timeout - 1 - elapsed);
+	assert(completions == 0);
+
+	advance_time(ext_a, 1);
+	assert(completions == 1);
+	assert(last_completed_receipt_id == receipt_id);
+	assert(last_status == TOX_EXTENSION_MESSAGES_RECEIPT_TIMED_OUT);
+	assert(last_context == &context);
+
+	/* A late receipt is ignored by the tracker */
+	tox_iterate(user_b->tox_user.tox, &user_b->tox_user);
+	tox_iterate(user_a->tox_user.tox, &user_a->tox_user);
+	assert(completions == 1);
+}
+
+void test_many_pending(struct ToxExtUser *user_a, struct ToxExtUser *user_b,
+		       struct ToxExtensionMessages *ext_a)
+{
+	completions = 0;
+	for (size_t i = 0; i < 1000; ++i) {
+		send_tracked(user_a, user_b, ext_a, 10 + i * 7, NULL);
+	}
+
+	advance_time(ext_a, 10 + 499 * 7);
+	assert(completions == 500);
+
+	/* Whatever is left gets delivered */
+	tox_iterate(user_b->tox_user.tox, &user_b->tox_user);
+	tox_iterate(user_a->tox_user.tox, &user_a->tox_user);
+	assert(completions == 1000);
+	assert(last_status == TOX_EXTENSION_MESSAGES_RECEIPT_DELIVERED);
+}
+
+/* Switching clocks keeps the time a receipt had left */
+void test_clock_switch(struct ToxExtUser *user_a, struct ToxExtUser *user_b,
+		       struct ToxExtensionMessages *ext_a)
+{
+	completions = 0;
+	send_tracked(user_a, user_b, ext_a, 1000, NULL);
+	advance_time(ext_a, 400);
+
+	/* Far behind the old clock */
+	tox_extension_messages_set_clock(ext_a, other_clock, NULL);
+	other_time += 300;
+	tox_extension_messages_iterate(ext_a);
+	assert(completions == 0);
+
+	/* And far ahead of it */
+	current_time += 1000000;
+	tox_extension_messages_set_clock(ext_a, test_clock, NULL);
+	advance_time(ext_a, 299);
+	assert(completions == 0);
+	advance_time(ext_a, 1);
+	assert(completions == 1);
+	assert(last_status == TOX_EXTENSION_MESSAGES_RECEIPT_TIMED_OUT);
+}
+
+int main(void)
+{
+	struct ToxExtUser user_a;
+	struct ToxExtUser user_b;
+
+	toxext_test_init_tox_ext_user(&user_a);
+	toxext_test_init_tox_ext_user(&user_b);
+
+	struct ToxExtensionMessages *ext_a = tox_extension_messages_register(
+		user_a.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	struct ToxExtensionMessages *ext_b = tox_extension_messages_register(
+		user_b.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+
+	tox_extension_messages_set_clock(ext_a, test_clock, NULL);
+	tox_extension_messages_enable_receipt_tracking(ext_a,
+						       test_completion_cb);
+
+	tox_extension_messages_negotiate(ext_a, user_b.tox_user.id);
+
+	tox_iterate(user_b.tox_user.tox, &user_b.tox_user);
+	tox_iterate(user_a.tox_user.tox, &user_a.tox_user);
+	tox_iterate(user_b.tox_user.tox, &user_b.tox_user);
+	tox_iterate(user_a.tox_user.tox, &user_a.tox_user);
+
+	test_delivered(&user_a, &user_b, ext_a);
+
+	/* Exercise every level of the timer wheel */
+	test_timed_out(&user_a, &user_b, ext_a, 50);
+	test_timed_out(&user_a, &user_b, ext_a, 1000);
+	test_timed_out(&user_a, &user_b, ext_a, 200000);
+	test_timed_out(&user_a, &user_b, ext_a, 50000000);
+
+	test_many_pending(&user_a, &user_b, ext_a);
+	test_clock_switch(&user_a, &user_b, ext_a);
+
+	/* Leave one pending to make sure free cleans it up */
+	send_tracked(&user_a, &user_b, ext_a, 100, NULL);
+
+	tox_extension_messages_free(ext_b);
+	tox_extension_messages_free(ext_a);
+
+	toxext_test_cleanup_tox_ext_user(&user_b);
+	toxext_test_cleanup_tox_ext_user(&user_a);
+
+	return 0;
+}
@@ -0,0 +1,315 @@
+#include "../tox_extension_messages.c"
+
+#include <toxext/toxext.h>
+#include <toxext/mock_fixtures.h>
+#include <assert.h>
+
+static size_t messages_received = 0;
+static size_t drops = 0;
+static uint64_t negotiated_max_sending_size = 0;
+/* When set the received callback configures friends it hasn't seen yet */
+static struct ToxExtensionMessages *configuring_ext = NULL;
+static uint32_t next_unknown_friend = 10000;
+
+/*
+ * Adds enough friends from inside the callback that the friend list has to
+ * grow while the message is being delivered
+ */
+static void configure_unknown_friends(struct ToxExtensionMessages *ext)
+{
+	struct Tox_Extension_Messages_Rate_Limits limits = {
+		.segments_per_second = 100,
+	};
+
+	for (size_t i = 0; i < 64; ++i) {
+		tox_extension_messages_set_friend_max_receiving_size(
+			ext, next_unknown_friend++, 1024, NULL);
+		tox_extension_messages_set_friend_rate_limits(
+			ext, next_unknown_friend++, &limits, NULL);
+
+		struct Tox_Extension_Messages_Negotiation_Request request = {
+			next_unknown_friend++, 0
+		};
+		tox_extension_messages_negotiate_bulk(ext, &request, 1, NULL);
+	}
+}
+
+static void test_cb(uint32_t friend_number, uint8_t const *message,
+		    size_t length, void *user_data)
+{
+	(void)friend_number;
+	(void)message;
+	(void)length;
+	(void)user_data;
+	messages_received++;
+
+	if (configuring_ext) {
+		configure_unknown_friends(configuring_ext);
+	}
+}
+
+static void test_receipt_cb(uint32_t friend_number, const uint64_t receipt_id,
+			    void *user_data)
+{
+	(void)friend_number;
+	(void)receipt_id;
+	(void)user_data;
+}
+
+static void test_neg_cb(uint32_t friend_number, bool compatible,
+			uint64_t max_sending_size, void *user_data)
+{
+	(void)friend_number;
+	(void)user_data;
+	assert(compatible);
+	negotiated_max_sending_size = max_sending_size;
+}
+
+static void test_dropped_cb(uint32_t friend_number,
+			    enum Tox_Extension_Messages_Drop_Reason reason,
+			    void *user_data)
+{
+	(void)friend_number;
+	(void)user_data;
+	assert(reason == TOX_EXTENSION_MESSAGES_DROP_TOO_LARGE);
+	drops++;
+}
+
+static uint8_t buffer[TOXEXT_MAX_SEGMENT_SIZE * 3];
+
+static void iterate(struct ToxExtUser *user_a, struct ToxExtUser *user_b)
+{
+	tox_iterate(user_b->tox_user.tox, &user_b->tox_user);
+	tox_iterate(user_a->tox_user.tox, &user_a->tox_user);
+}
+
+static uint64_t get_max_sending_size(struct ToxExtensionMessages *ext,
+				     uint32_t friend_id)
+{
+	enum Tox_Extension_Messages_Error err;
+	uint64_t max_sending_size =
+		tox_extension_messages_get_max_sending_size(ext, friend_id,
+							    &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	return max_sending_size;
+}
+
+static enum Tox_Extension_Messages_Error
+send_message(struct ToxExtUser *user_a, struct ToxExtUser *user_b,
+	     struct ToxExtensionMessages *ext_a, size_t size)
+{
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_a->toxext, user_b->tox_user.id);
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_append(ext_a, packet_list, buffer, size,
+				      user_b->tox_user.id, &err);
+	toxext_send(packet_list);
+	iterate(user_a, user_b);
+	return err;
+}
+
+static void test_friend_limit(struct ToxExtUser *user_a,
+			      struct ToxExtUser *user_b,
+			      struct ToxExtensionMessages *ext_a,
+			      struct ToxExtensionMessages *ext_b)
+{
+	uint32_t friend_a = user_a->tox_user.id;
+	uint32_t friend_b = user_b->tox_user.id;
+
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_set_friend_max_receiving_size(ext_b, friend_a,
+							     100, &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	assert(tox_extension_messages_get_friend_max_receiving_size(
+		       ext_b, friend_a) == 100);
+
+	/* A picks the new limit up without reconnecting */
+	iterate(user_a, user_b);
+	assert(get_max_sending_size(ext_a, friend_b) == 100);
+	assert(negotiated_max_sending_size == 100);
+
+	assert(send_message(user_a, user_b, ext_a, 101) ==
+	       TOX_EXTENSION_MESSAGES_INVALID_ARG);
+	messages_received = 0;
+	assert(send_message(user_a, user_b, ext_a, 100) ==
+	       TOX_EXTENSION_MESSAGES_SUCCESS);
+	assert(messages_received == 1);
+
+	/* The instance wide limit doesn't touch friends with their own */
+	tox_extension_messages_set_max_receiving_size(ext_b, 1000);
+	iterate(user_a, user_b);
+	assert(get_max_sending_size(ext_a, friend_b) == 100);
+
+	tox_extension_messages_clear_friend_max_receiving_size(ext_b,
+							       friend_a);
+	iterate(user_a, user_b);
+	assert(get_max_sending_size(ext_a, friend_b) == 1000);
+	assert(tox_extension_messages_get_max_receiving_size(ext_b) == 1000);
+
+	tox_extension_messages_set_max_receiving_size(
+		ext_b, TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	iterate(user_a, user_b);
+	assert(get_max_sending_size(ext_a, friend_b) ==
+	       TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+}
+
+static void test_lowered_limit_drops_message_in_progress(
+	struct ToxExtUser *user_a, struct ToxExtUser *user_b,
+	struct ToxExtensionMessages *ext_a, struct ToxExtensionMessages *ext_b)
+{
+	uint32_t friend_a = user_a->tox_user.id;
+
+	/* Send everything but the finish */
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_a->toxext, user_b->tox_user.id);
+	uint8_t const *end = buffer + sizeof(buffer);
+	uint8_t const *next_chunk = buffer;
+	uint8_t extension_data[TOXEXT_MAX_SEGMENT_SIZE];
+	size_t size_for_chunk;
+	bool first_chunk = true;
+	while (true) {
+		next_chunk = tox_extension_messages_chunk(
+			first_chunk, next_chunk, end - next_chunk,
+			ext_a->next_receipt_id, NULL, extension_data,
+			&size_for_chunk);
+		first_chunk = false;
+		if (next_chunk == end) {
+			break;
+		}
+		toxext_segment_append(packet_list, ext_a->extension_handle,
+				      extension_data, size_for_chunk);
+	}
+	toxext_send(packet_list);
+	iterate(user_a, user_b);
+
+	struct FriendData *friend_data = get_friend_data(ext_b, friend_a);
+	assert(friend_data->message.capacity == sizeof(buffer));
+
+	drops = 0;
+	messages_received = 0;
+	tox_extension_messages_set_friend_max_receiving_size(
+		ext_b, friend_a, sizeof(buffer) - 1, NULL);
+	assert(drops == 1);
+	assert(friend_data->message.message == NULL);
+
+	/* The rest of the message is ignored without reporting it again */
+	packet_list =
+		toxext_packet_list_create(user_a->toxext, user_b->tox_user.id);
+	toxext_segment_append(packet_list, ext_a->extension_handle,
+			      extension_data, size_for_chunk);
+	toxext_send(packet_list);
+	iterate(user_a, user_b);
+	assert(drops == 1);
+	assert(messages_received == 0);
+
+	assert(send_message(user_a, user_b, ext_a, sizeof(buffer) - 1) ==
+	       TOX_EXTENSION_MESSAGES_SUCCESS);
+	assert(messages_received == 1);
+}
+
+static void test_limit_before_negotiation(struct ToxExtUser *user_b,
+					  struct ToxExtensionMessages *ext_b)
+{
+	struct ToxExtUser user_c;
+	toxext_test_init_tox_ext_user(&user_c);
+	struct ToxExtensionMessages *ext_c = tox_extension_messages_register(
+		user_c.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+
+	tox_extension_messages_set_friend_max_receiving_size(
+		ext_b, user_c.tox_user.id, 64 * 1024, NULL);
+
+	/* The limit gives c a slot, but we still don't know what it accepts */
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_get_max_sending_size(ext_b, user_c.tox_user.id,
+						    &err);
+	assert(err == TOX_EXTENSION_MESSAGES_INVALID_ARG);
+
+	tox_extension_messages_negotiate(ext_c, user_b->tox_user.id);
+	iterate(&user_c, user_b);
+	iterate(&user_c, user_b);
+	assert(get_max_sending_size(ext_c, user_b->tox_user.id) == 64 * 1024);
+
+	/* Limits survive a restart */
+	size_t savedata_size =
+		tox_extension_messages_get_savedata_size(ext_b, false);
+	uint8_t *savedata = malloc(savedata_size);
+	tox_extension_messages_get_savedata(ext_b, savedata, false);
+
+	struct ToxExtUser user_d;
+	toxext_test_init_tox_ext_user(&user_d);
+	struct ToxExtensionMessages *ext_d = tox_extension_messages_register(
+		user_d.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	assert(tox_extension_messages_load_savedata(ext_d, savedata,
+						    savedata_size) ==
+	       TOX_EXTENSION_MESSAGES_SUCCESS);
+	assert(tox_extension_messages_get_friend_max_receiving_size(
+		       ext_d, user_c.tox_user.id) == 64 * 1024);
+	free(savedata);
+
+	tox_extension_messages_free(ext_d);
+	toxext_test_cleanup_tox_ext_user(&user_d);
+	tox_extension_messages_free(ext_c);
+	toxext_test_cleanup_tox_ext_user(&user_c);
+}
+
+static void test_setters_from_callback(struct ToxExtUser *user_a,
+				       struct ToxExtUser *user_b,
+				       struct ToxExtensionMessages *ext_a,
+				       struct ToxExtensionMessages *ext_b)
+{
+	messages_received = 0;
+	configuring_ext = ext_b;
+
+	/* Single and multi segment messages finish through different paths */
+	assert(send_message(user_a, user_b, ext_a, 100) ==
+	       TOX_EXTENSION_MESSAGES_SUCCESS);
+	assert(send_message(user_a, user_b, ext_a, sizeof(buffer) - 1) ==
+	       TOX_EXTENSION_MESSAGES_SUCCESS);
+	assert(messages_received == 2);
+
+	configuring_ext = NULL;
+
+	/* The friend we were receiving from is still intact */
+	assert(send_message(user_a, user_b, ext_a, sizeof(buffer) - 1) ==
+	       TOX_EXTENSION_MESSAGES_SUCCESS);
+	assert(messages_received == 3);
+	assert(tox_extension_messages_get_friend_max_receiving_size(
+		       ext_b, 10000) == 1024);
+}
+
+int main(void)
+{
+	struct ToxExtUser user_a;
+	struct ToxExtUser user_b;
+
+	toxext_test_init_tox_ext_user(&user_a);
+	toxext_test_init_tox_ext_user(&user_b);
+
+	struct ToxExtensionMessages *ext_a = tox_extension_messages_register(
+		user_a.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	struct ToxExtensionMessages *ext_b = tox_extension_messages_register(
+		user_b.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	tox_extension_messages_set_dropped_cb(ext_b, test_dropped_cb);
+
+	tox_extension_messages_negotiate(ext_a, user_b.tox_user.id);
+	iterate(&user_a, &user_b);
+	iterate(&user_a, &user_b);
+
+	test_friend_limit(&user_a, &user_b, ext_a, ext_b);
+	test_lowered_limit_drops_message_in_progress(&user_a, &user_b, ext_a,
+						     ext_b);
+	test_limit_before_negotiation(&user_b, ext_b);
+	test_setters_from_callback(&user_a, &user_b, ext_a, ext_b);
+
+	tox_extension_messages_free(ext_b);
+	tox_extension_messages_free(ext_a);
+
+	toxext_test_cleanup_tox_ext_user(&user_b);
+	toxext_test_cleanup_tox_ext_user(&user_a);
+
+	return 0;
+}
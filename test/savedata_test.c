@@ -0,0 +1,307 @@
+#include "../tox_extension_messages.c"
+
+#include <toxext/toxext.h>
+#include <toxext/mock_fixtures.h>
+#include <assert.h>
+
+static uint8_t *last_received_buffer = NULL;
+static size_t last_received_buffer_size = 0;
+static size_t messages_received = 0;
+
+static void test_cb(uint32_t friend_number, uint8_t const *message,
+		    size_t length, void *user_data)
+{
+	(void)friend_number;
+	(void)user_data;
+
+	free(last_received_buffer);
+	last_received_buffer = malloc(length);
+	last_received_buffer_size = length;
+	memcpy(last_received_buffer, message, length);
+	messages_received++;
+}
+
+static void test_receipt_cb(uint32_t friend_number, const uint64_t receipt_id,
+			    void *user_data)
+{
+	(void)friend_number;
+	(void)receipt_id;
+	(void)user_data;
+}
+
+static void test_neg_cb(uint32_t friend_number, bool compatible,
+			uint64_t max_sending_size, void *user_data)
+{
+	(void)friend_number;
+	(void)compatible;
+	(void)max_sending_size;
+	(void)user_data;
+}
+
+static uint8_t large_buffer[TOXEXT_MAX_SEGMENT_SIZE * 3];
+
+static struct ToxExtensionMessages *register_extension(struct ToxExtUser *user)
+{
+	return tox_extension_messages_register(
+		user->toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+}
+
+static uint8_t *save(struct ToxExtensionMessages *ext, bool include_incoming,
+		     size_t *size)
+{
+	*size = tox_extension_messages_get_savedata_size(ext,
+							 include_incoming);
+	uint8_t *savedata = malloc(*size);
+	tox_extension_messages_get_savedata(ext, savedata, include_incoming);
+	return savedata;
+}
+
+void test_restored_sender(struct ToxExtUser *user_b,
+			  struct ToxExtensionMessages *ext_a)
+{
+	struct ToxExtUser user_c;
+	toxext_test_init_tox_ext_user(&user_c);
+	struct ToxExtensionMessages *ext_c = register_extension(&user_c);
+
+	size_t size;
+	uint8_t *savedata = save(ext_a, false, &size);
+	assert(tox_extension_messages_load_savedata(ext_c, savedata, size) ==
+	       TOX_EXTENSION_MESSAGES_SUCCESS);
+	free(savedata);
+
+	enum Tox_Extension_Messages_Error err;
+	uint64_t max_sending_size = tox_extension_messages_get_max_sending_size(
+		ext_c, user_b->tox_user.id, &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	assert(max_sending_size ==
+	       TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+
+	/* Send straight away without negotiating */
+	messages_received = 0;
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_c.toxext, user_b->tox_user.id);
+	uint64_t receipt_id = tox_extension_messages_append(
+		ext_c, packet_list, large_buffer, sizeof(large_buffer),
+		user_b->tox_user.id, &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	assert(receipt_id == ext_a->next_receipt_id);
+	toxext_send(packet_list);
+
+	tox_iterate(user_b->tox_user.tox, &user_b->tox_user);
+	assert(messages_received == 1);
+	assert(last_received_buffer_size == sizeof(large_buffer));
+
+	tox_extension_messages_free(ext_c);
+	toxext_test_cleanup_tox_ext_user(&user_c);
+}
+
+void test_restored_partial_message(struct ToxExtUser *user_a,
+				   struct ToxExtensionMessages *ext_a,
+				   struct ToxExtensionMessages *ext_b)
+{
+	struct ToxExtUser user_d;
+	toxext_test_init_tox_ext_user(&user_d);
+	struct ToxExtensionMessages *ext_d = register_extension(&user_d);
+
+	/* Chunk by hand so only the first segment is delivered before saving */
+	uint8_t segments[4][TOXEXT_MAX_SEGMENT_SIZE];
+	size_t segment_sizes[4];
+	size_t segment_count = 0;
+	uint8_t const *end = large_buffer + sizeof(large_buffer);
+	uint8_t const *next_chunk = large_buffer;
+	do {
+		assert(segment_count < 4);
+		next_chunk = tox_extension_messages_chunk(
+			segment_count == 0, next_chunk, end - next_chunk,
+			ext_a->next_receipt_id++, NULL,
+			segments[segment_count], &segment_sizes[segment_count]);
+		segment_count++;
+	} while (end > next_chunk);
+	assert(segment_count > 1);
+
+	struct FriendData *b_friend_data =
+		get_friend_data(ext_b, user_a->tox_user.id);
+	struct MessagesPacket parsed_packet;
+	assert(parse_messages_packet(segments[0], segment_sizes[0],
+				     &parsed_packet));
+	tox_extension_messages_handle_message_start(ext_b, &parsed_packet,
+						    b_friend_data);
+	assert(b_friend_data->message.size > 0);
+
+	size_t size;
+	uint8_t *savedata = save(ext_b, true, &size);
+	assert(tox_extension_messages_load_savedata(ext_d, savedata, size) ==
+	       TOX_EXTENSION_MESSAGES_SUCCESS);
+
+	/* Truncated savedata is rejected */
+	assert(tox_extension_messages_load_savedata(ext_d, savedata,
+						    size - 1) ==
+	       TOX_EXTENSION_MESSAGES_INVALID_ARG);
+	assert(tox_extension_messages_load_savedata(ext_d, savedata, size) ==
+	       TOX_EXTENSION_MESSAGES_SUCCESS);
+	free(savedata);
+
+	/* The rest of the message is sent to the restored instance */
+	messages_received = 0;
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_a->toxext, user_d.tox_user.id);
+	for (size_t i = 1; i < segment_count; ++i) {
+		toxext_segment_append(packet_list, ext_a->extension_handle,
+				      segments[i], segment_sizes[i]);
+	}
+	toxext_send(packet_list);
+
+	tox_iterate(user_d.tox_user.tox, &user_d.tox_user);
+	assert(messages_received == 1);
+	assert(last_received_buffer_size == sizeof(large_buffer));
+	assert(memcmp(last_received_buffer, large_buffer,
+		      sizeof(large_buffer)) == 0);
+
+	tox_extension_messages_free(ext_d);
+	toxext_test_cleanup_tox_ext_user(&user_d);
+}
+
+/* Writes a friend the way savedata versions 1 and 2 did */
+static uint8_t *write_old_friend(uint8_t *it, uint32_t version,
+				 uint32_t friend_id, uint64_t max_sending_size,
+				 uint32_t send_window, uint8_t features,
+				 uint64_t incoming_capacity,
+				 uint8_t const *incoming, uint64_t incoming_size)
+{
+	toxext_write_to_buf(friend_id, it, 4);
+	it += 4;
+	toxext_write_to_buf(max_sending_size, it, 8);
+	it += 8;
+	*it++ = send_window > 0;
+	toxext_write_to_buf(send_window, it, 4);
+	it += 4;
+	if (version >= 2) {
+		*it++ = features;
+	}
+	toxext_write_to_buf(incoming_capacity, it, 8);
+	it += 8;
+	toxext_write_to_buf(incoming_size, it, 8);
+	it += 8;
+	memcpy(it, incoming, incoming_size);
+	return it + incoming_size;
+}
+
+void test_older_versions(void)
+{
+	uint8_t const incoming[] = { 1, 2, 3 };
+
+	for (uint32_t version = 1; version < SAVEDATA_VERSION; ++version) {
+		uint8_t savedata[SAVEDATA_HEADER_SIZE +
+				 2 * SAVEDATA_FRIEND_SIZE_V2 + sizeof(incoming)];
+		uint8_t *it = savedata;
+		toxext_write_to_buf(SAVEDATA_MAGIC, it, 4);
+		toxext_write_to_buf(version, it + 4, 4);
+		toxext_write_to_buf(42, it + 8, 8);
+		toxext_write_to_buf(2, it + 16, 4);
+		it += SAVEDATA_HEADER_SIZE;
+		it = write_old_friend(it, version, 7, 1000, 16, 1, 10, incoming,
+				      sizeof(incoming));
+		/* Never negotiated */
+		it = write_old_friend(it, version, 8, 0, 0, 0, 0, incoming, 0);
+		size_t size = it - savedata;
+
+		struct ToxExtUser user;
+		toxext_test_init_tox_ext_user(&user);
+		struct ToxExtensionMessages *ext = register_extension(&user);
+
+		assert(tox_extension_messages_load_savedata(ext, savedata,
+							    size - 1) ==
+		       TOX_EXTENSION_MESSAGES_INVALID_ARG);
+		/* The friend before the truncated one isn't loaded either */
+		assert(ext->friend_datas_size == 0);
+		assert(tox_extension_messages_load_savedata(ext, savedata,
+							    size) ==
+		       TOX_EXTENSION_MESSAGES_SUCCESS);
+		assert(ext->next_receipt_id == 42);
+
+		struct FriendData *friend_data = get_friend_data(ext, 7);
+		assert(friend_data->peer_negotiated);
+		assert(friend_data->max_sending_size == 1000);
+		assert(friend_data->peer_supports_credit);
+		assert(friend_data->send_window == 16);
+		assert(friend_data->send_credit == 16);
+		assert(friend_data->peer_features == (version >= 2 ? 1 : 0));
+		assert(!friend_data->has_max_receiving_size);
+		assert(friend_data->message.capacity == 10);
+		assert(friend_data->message.size == sizeof(incoming));
+		assert(memcmp(friend_data->message.message, incoming,
+			      sizeof(incoming)) == 0);
+
+		assert(!get_friend_data(ext, 8)->peer_negotiated);
+
+		tox_extension_messages_free(ext);
+		toxext_test_cleanup_tox_ext_user(&user);
+	}
+
+	/* Newer versions are refused */
+	struct ToxExtUser user;
+	toxext_test_init_tox_ext_user(&user);
+	struct ToxExtensionMessages *ext = register_extension(&user);
+	uint8_t newer[SAVEDATA_HEADER_SIZE] = { 0 };
+	toxext_write_to_buf(SAVEDATA_MAGIC, newer, 4);
+	toxext_write_to_buf(SAVEDATA_VERSION + 1, newer + 4, 4);
+	assert(tox_extension_messages_load_savedata(ext, newer,
+						    sizeof(newer)) ==
+	       TOX_EXTENSION_MESSAGES_NOT_SUPPORTED);
+	tox_extension_messages_free(ext);
+	toxext_test_cleanup_tox_ext_user(&user);
+}
+
+int main(void)
+{
+	struct ToxExtUser user_a;
+	struct ToxExtUser user_b;
+
+	for (size_t i = 0; i < sizeof(large_buffer); ++i) {
+		large_buffer[i] = i;
+	}
+
+	toxext_test_init_tox_ext_user(&user_a);
+	toxext_test_init_tox_ext_user(&user_b);
+
+	struct ToxExtensionMessages *ext_a = register_extension(&user_a);
+	struct ToxExtensionMessages *ext_b = register_extension(&user_b);
+
+	tox_extension_messages_negotiate(ext_a, user_b.tox_user.id);
+
+	tox_iterate(user_b.tox_user.tox, &user_b.tox_user);
+	tox_iterate(user_a.tox_user.tox, &user_a.tox_user);
+	tox_iterate(user_b.tox_user.tox, &user_b.tox_user);
+	tox_iterate(user_a.tox_user.tox, &user_a.tox_user);
+
+	/* Burn a few receipt ids so the counter is worth saving */
+	for (size_t i = 0; i < 3; ++i) {
+		struct ToxExtPacketList *packet_list = toxext_packet_list_create(
+			user_a.toxext, user_b.tox_user.id);
+		tox_extension_messages_append(ext_a, packet_list, large_buffer,
+					      1, user_b.tox_user.id, NULL);
+		toxext_send(packet_list);
+		tox_iterate(user_b.tox_user.tox, &user_b.tox_user);
+		tox_iterate(user_a.tox_user.tox, &user_a.tox_user);
+	}
+
+	test_restored_sender(&user_b, ext_a);
+	test_restored_partial_message(&user_a, ext_a, ext_b);
+	test_older_versions();
+
+	uint8_t garbage[SAVEDATA_HEADER_SIZE] = { 0 };
+	assert(tox_extension_messages_load_savedata(ext_a, garbage,
+						    sizeof(garbage)) ==
+	       TOX_EXTENSION_MESSAGES_INVALID_ARG);
+
+	free(last_received_buffer);
+
+	tox_extension_messages_free(ext_b);
+	tox_extension_messages_free(ext_a);
+
+	toxext_test_cleanup_tox_ext_user(&user_b);
+	toxext_test_cleanup_tox_ext_user(&user_a);
+
+	return 0;
+}
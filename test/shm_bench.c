@@ -0,0 +1,223 @@
+/*
+ * Compares handling messages in the received callback with handing them to
+ * a consumer process through the shared memory ring. Both runs only count as
+ * done once the sender has every receipt, so the shm run includes the round
+ * trip through the consumer.
+ *
+ *   shm_bench [messages] [message size]
+ */
+#define _GNU_SOURCE
+
+#include "../tox_extension_messages.c"
+#include "../tox_extension_messages_shm.c"
+
+#include <toxext/toxext.h>
+#include <toxext/mock_fixtures.h>
+
+#include <stdio.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/* Give up if the consumer stops releasing messages */
+#define SHM_BENCH_TIMEOUT_S 30
+
+struct BenchState {
+	struct ToxExtensionMessagesShmProducer *producer;
+	size_t receipts;
+	uint64_t checksum;
+};
+
+static uint64_t checksum(uint8_t const *data, size_t size)
+{
+	uint64_t sum = 0;
+	for (size_t i = 0; i < size; ++i) {
+		sum = sum * 31 + data[i];
+	}
+	return sum;
+}
+
+static double get_time(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void received_cb(uint32_t friend_number, uint8_t const *message,
+			size_t length, void *user_data)
+{
+	struct BenchState *state = user_data;
+
+	if (state->producer &&
+	    tox_extension_messages_shm_producer_deliver(
+		    state->producer, friend_number, message, length)) {
+		return;
+	}
+
+	state->checksum += checksum(message, length);
+}
+
+static void receipt_cb(uint32_t friend_number, uint64_t receipt_id,
+		       void *user_data)
+{
+	(void)friend_number;
+	(void)receipt_id;
+	struct BenchState *state = user_data;
+	state->receipts++;
+}
+
+static void neg_cb(uint32_t friend_number, bool compatible,
+		   uint64_t max_sending_size, void *user_data)
+{
+	(void)friend_number;
+	(void)compatible;
+	(void)max_sending_size;
+	(void)user_data;
+}
+
+static void iterate(struct ToxExtUser *sender, struct ToxExtUser *receiver)
+{
+	tox_iterate(receiver->tox_user.tox, &receiver->tox_user);
+	tox_iterate(sender->tox_user.tox, &sender->tox_user);
+}
+
+/* Reads count messages and exits with whether their checksum was expected */
+static void run_consumer(struct Tox_Extension_Messages_Shm_Fds const *fds,
+			 size_t count, uint64_t expected)
+{
+	struct ToxExtensionMessagesShmConsumer *consumer =
+		tox_extension_messages_shm_consumer_open(fds);
+
+	if (!consumer) {
+		_exit(1);
+	}
+
+	uint64_t sum = 0;
+	size_t read = 0;
+	while (read < count &&
+	       tox_extension_messages_shm_consumer_wait(
+		       consumer, SHM_BENCH_TIMEOUT_S * 1000)) {
+		struct Tox_Extension_Messages_Shm_Message message;
+		while (tox_extension_messages_shm_consumer_next(consumer,
+								&message)) {
+			sum += checksum(message.data, message.size);
+			tox_extension_messages_shm_consumer_release(consumer,
+								    &message);
+			read++;
+		}
+	}
+
+	tox_extension_messages_shm_consumer_close(consumer);
+	_exit(read == count && sum == expected ? 0 : 1);
+}
+
+/* Returns the seconds until every receipt arrived or a negative on failure */
+static double run(size_t count, size_t size, bool use_shm)
+{
+	struct ToxExtUser sender;
+	struct ToxExtUser receiver;
+	toxext_test_init_tox_ext_user(&sender);
+	toxext_test_init_tox_ext_user(&receiver);
+
+	struct BenchState sender_state = { 0 };
+	struct BenchState receiver_state = { 0 };
+
+	struct ToxExtensionMessages *sender_ext = tox_extension_messages_register(
+		sender.toxext, received_cb, receipt_cb, neg_cb, &sender_state,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	struct ToxExtensionMessages *receiver_ext =
+		tox_extension_messages_register(
+			receiver.toxext, received_cb, receipt_cb, neg_cb,
+			&receiver_state,
+			TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+
+	tox_extension_messages_negotiate(sender_ext, receiver.tox_user.id);
+	iterate(&sender, &receiver);
+	iterate(&sender, &receiver);
+
+	uint8_t *message = malloc(size);
+	for (size_t i = 0; i < size; ++i) {
+		message[i] = i;
+	}
+	uint64_t expected = checksum(message, size) * count;
+
+	pid_t consumer = -1;
+	if (use_shm) {
+		receiver_state.producer = tox_extension_messages_shm_producer_create(
+			receiver_ext, TOX_EXTENSION_MESSAGES_SHM_DEFAULT_SIZE);
+
+		struct Tox_Extension_Messages_Shm_Fds fds;
+		tox_extension_messages_shm_producer_get_fds(
+			receiver_state.producer, &fds);
+
+		consumer = fork();
+		if (consumer == 0) {
+			run_consumer(&fds, count, expected);
+		}
+	}
+
+	double start = get_time();
+
+	for (size_t i = 0; i < count; ++i) {
+		struct ToxExtPacketList *packet_list = toxext_packet_list_create(
+			sender.toxext, receiver.tox_user.id);
+		tox_extension_messages_append(sender_ext, packet_list, message,
+					      size, receiver.tox_user.id, NULL);
+		toxext_send(packet_list);
+		iterate(&sender, &receiver);
+		if (use_shm) {
+			tox_extension_messages_shm_producer_poll(
+				receiver_state.producer);
+		}
+	}
+
+	while (sender_state.receipts < count &&
+	       get_time() - start < SHM_BENCH_TIMEOUT_S) {
+		if (use_shm) {
+			tox_extension_messages_shm_producer_poll(
+				receiver_state.producer);
+		}
+		iterate(&sender, &receiver);
+	}
+
+	double elapsed = get_time() - start;
+	bool ok = sender_state.receipts == count;
+
+	if (use_shm) {
+		int status;
+		waitpid(consumer, &status, 0);
+		ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		tox_extension_messages_shm_producer_free(receiver_state.producer);
+	} else {
+		ok = ok && receiver_state.checksum == expected;
+	}
+
+	free(message);
+	tox_extension_messages_free(receiver_ext);
+	tox_extension_messages_free(sender_ext);
+	toxext_test_cleanup_tox_ext_user(&receiver);
+	toxext_test_cleanup_tox_ext_user(&sender);
+
+	return ok ? elapsed : -1;
+}
+
+int main(int argc, char **argv)
+{
+	size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000;
+	size_t size = argc > 2 ? strtoul(argv[2], NULL, 10) : 4096;
+
+	double callback = run(count, size, false);
+	double shm = run(count, size, true);
+
+	if (callback < 0 || shm < 0) {
+		fprintf(stderr, "messages or receipts went missing\n");
+		return 1;
+	}
+
+	printf("%zu messages of %zu bytes\n", count, size);
+	printf("callback: %.3fs (%.1f MB/s)\n", callback,
+	       count * size / callback / 1e6);
+	printf("shm:      %.3fs (%.1f MB/s)\n", shm, count * size / shm / 1e6);
+
+	return 0;
+}
@@ -0,0 +1,304 @@
+/* memfd_create needs this before the first libc header */
+#define _GNU_SOURCE
+
+#include "../tox_extension_messages.c"
+#include "../tox_extension_messages_shm.c"
+
+#include <toxext/toxext.h>
+#include <toxext/mock_fixtures.h>
+#include <assert.h>
+
+static struct ToxExtensionMessagesShmProducer *producer;
+static size_t receipts_received = 0;
+static size_t handled_in_process = 0;
+static uint8_t buffer[TOXEXT_MAX_SEGMENT_SIZE * 4];
+
+static void test_cb(uint32_t friend_number, uint8_t const *message,
+		    size_t length, void *user_data)
+{
+	(void)user_data;
+	if (!tox_extension_messages_shm_producer_deliver(
+		    producer, friend_number, message, length)) {
+		handled_in_process++;
+	}
+}
+
+static void test_receipt_cb(uint32_t friend_number, const uint64_t receipt_id,
+			    void *user_data)
+{
+	(void)friend_number;
+	(void)receipt_id;
+	(void)user_data;
+	receipts_received++;
+}
+
+static void test_neg_cb(uint32_t friend_number, bool compatible,
+			uint64_t max_sending_size, void *user_data)
+{
+	(void)friend_number;
+	(void)compatible;
+	(void)max_sending_size;
+	(void)user_data;
+}
+
+static void fill(uint8_t *data, size_t size, uint8_t seed)
+{
+	for (size_t i = 0; i < size; ++i) {
+		data[i] = seed + i * 7;
+	}
+}
+
+static bool matches(uint8_t const *data, size_t size, uint8_t seed)
+{
+	for (size_t i = 0; i < size; ++i) {
+		if (data[i] != (uint8_t)(seed + i * 7)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void iterate(struct ToxExtUser *user_a, struct ToxExtUser *user_b)
+{
+	tox_iterate(user_b->tox_user.tox, &user_b->tox_user);
+	tox_iterate(user_a->tox_user.tox, &user_a->tox_user);
+}
+
+static void send_message(struct ToxExtUser *user_a, struct ToxExtUser *user_b,
+			 struct ToxExtensionMessages *ext_a, size_t size,
+			 uint8_t seed)
+{
+	fill(buffer, size, seed);
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(user_a->toxext, user_b->tox_user.id);
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_append(ext_a, packet_list, buffer, size,
+				      user_b->tox_user.id, &err);
+	assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+	toxext_send(packet_list);
+	iterate(user_a, user_b);
+}
+
+/* Sends receipts for released messages and lets them reach a */
+static void poll_producer(struct ToxExtUser *user_a, struct ToxExtUser *user_b)
+{
+	tox_extension_messages_shm_producer_poll(producer);
+	iterate(user_a, user_b);
+}
+
+static void test_receipts_wait_for_release(struct ToxExtUser *user_a,
+					   struct ToxExtUser *user_b,
+					   struct ToxExtensionMessages *ext_a,
+					   struct ToxExtensionMessagesShmConsumer *consumer)
+{
+	receipts_received = 0;
+
+	for (uint8_t i = 0; i < 3; ++i) {
+		send_message(user_a, user_b, ext_a, 100, i);
+	}
+	poll_producer(user_a, user_b);
+	assert(receipts_received == 0);
+	assert(tox_extension_messages_shm_producer_get_pending(producer) == 3);
+
+	struct Tox_Extension_Messages_Shm_Message messages[3];
+	for (uint8_t i = 0; i < 3; ++i) {
+		assert(tox_extension_messages_shm_consumer_next(consumer,
+								&messages[i]));
+		assert(messages[i].friend_id == user_a->tox_user.id);
+		assert(messages[i].size == 100);
+		assert(matches(messages[i].data, messages[i].size, i));
+	}
+	struct Tox_Extension_Messages_Shm_Message extra;
+	assert(!tox_extension_messages_shm_consumer_next(consumer, &extra));
+
+	tox_extension_messages_shm_consumer_release(consumer, &messages[0]);
+	poll_producer(user_a, user_b);
+	assert(receipts_received == 1);
+
+	/* Releasing a message releases everything before it */
+	tox_extension_messages_shm_consumer_release(consumer, &messages[2]);
+	poll_producer(user_a, user_b);
+	assert(receipts_received == 3);
+	assert(tox_extension_messages_shm_producer_get_pending(producer) == 0);
+}
+
+static void test_wrap_and_queue(struct ToxExtUser *user_a,
+				struct ToxExtUser *user_b,
+				struct ToxExtensionMessages *ext_a,
+				struct ToxExtensionMessagesShmConsumer *consumer)
+{
+	receipts_received = 0;
+
+	/* Sizes that don't divide the ring, some of them multi segment */
+	size_t const sizes[] = { 1000, 2000, 100, 1500, 1300, 2024, 10, 1800 };
+	size_t const count = sizeof(sizes) / sizeof(sizes[0]);
+
+	for (size_t i = 0; i < count; ++i) {
+		send_message(user_a, user_b, ext_a, sizes[i], i);
+	}
+	assert(tox_extension_messages_shm_producer_get_pending(producer) ==
+	       count);
+
+	/* The ring only holds a few of them, the rest wait for space */
+	int ack_fd = producer->fds.ack_fd;
+	struct pollfd ack_poll = { .fd = ack_fd, .events = POLLIN };
+	assert(atomic_load(&producer->control->producer_waiting));
+
+	size_t read = 0;
+	while (read < count) {
+		struct Tox_Extension_Messages_Shm_Message message;
+		assert(tox_extension_messages_shm_consumer_next(consumer,
+								&message));
+		assert(message.size == sizes[read]);
+		assert(matches(message.data, message.size, read));
+		read++;
+
+		bool waiting = atomic_load(&producer->control->producer_waiting);
+		tox_extension_messages_shm_consumer_release(consumer, &message);
+		if (waiting) {
+			assert(poll(&ack_poll, 1, 0) == 1);
+		}
+		poll_producer(user_a, user_b);
+		assert(receipts_received == read);
+	}
+
+	assert(!atomic_load(&producer->control->producer_waiting));
+	assert(tox_extension_messages_shm_producer_get_pending(producer) == 0);
+}
+
+static void test_too_large(struct ToxExtUser *user_a, struct ToxExtUser *user_b,
+			   struct ToxExtensionMessages *ext_a)
+{
+	receipts_received = 0;
+	handled_in_process = 0;
+
+	send_message(user_a, user_b, ext_a, sizeof(buffer), 0);
+	assert(handled_in_process == 1);
+	assert(tox_extension_messages_shm_producer_get_pending(producer) == 0);
+	/* Not deferred, so the receipt is already on its way */
+	iterate(user_a, user_b);
+	assert(receipts_received == 1);
+}
+
+static void test_doorbell(struct ToxExtUser *user_a, struct ToxExtUser *user_b,
+			  struct ToxExtensionMessages *ext_a,
+			  struct ToxExtensionMessagesShmConsumer *consumer)
+{
+	assert(!tox_extension_messages_shm_consumer_wait(consumer, 0));
+
+	send_message(user_a, user_b, ext_a, 10, 0);
+	assert(tox_extension_messages_shm_consumer_wait(consumer, 0));
+
+	struct Tox_Extension_Messages_Shm_Message message;
+	assert(tox_extension_messages_shm_consumer_next(consumer, &message));
+	tox_extension_messages_shm_consumer_release(consumer, &message);
+	poll_producer(user_a, user_b);
+}
+
+static void test_defer_outside_callback(struct ToxExtensionMessages *ext)
+{
+	enum Tox_Extension_Messages_Error err;
+	tox_extension_messages_defer_receipt(ext, &err);
+	assert(err == TOX_EXTENSION_MESSAGES_INVALID_ARG);
+}
+
+static void test_open_rejects_non_ring(void)
+{
+	int memory_fd = memfd_create("not_a_ring", MFD_CLOEXEC);
+	assert(ftruncate(memory_fd, mapping_size(SHM_MIN_SIZE)) == 0);
+
+	struct Tox_Extension_Messages_Shm_Fds fds = {
+		.memory_fd = memory_fd,
+		.data_fd = eventfd(0, EFD_CLOEXEC),
+		.ack_fd = eventfd(0, EFD_CLOEXEC),
+	};
+	assert(!tox_extension_messages_shm_consumer_open(&fds));
+	close_fds(&fds);
+}
+
+static void test_rejects_oversized_record(struct ToxExtensionMessages *ext)
+{
+	struct ToxExtensionMessagesShmProducer *broken_producer =
+		tox_extension_messages_shm_producer_create(ext, 0);
+	struct Tox_Extension_Messages_Shm_Fds fds;
+	tox_extension_messages_shm_producer_get_fds(broken_producer, &fds);
+	struct ToxExtensionMessagesShmConsumer *consumer =
+		tox_extension_messages_shm_consumer_open(&fds);
+	assert(consumer);
+
+	/* Claims more than was published */
+	struct ShmRecord record = { .size = 64 };
+	memcpy(broken_producer->ring, &record, sizeof(record));
+	atomic_store(&broken_producer->control->head, record_size(16));
+
+	struct Tox_Extension_Messages_Shm_Message message;
+	assert(!tox_extension_messages_shm_consumer_next(consumer, &message));
+
+	/* And stays broken even once the rest shows up */
+	atomic_store(&broken_producer->control->head, record_size(64));
+	assert(!tox_extension_messages_shm_consumer_next(consumer, &message));
+	tox_extension_messages_shm_consumer_close(consumer);
+
+	/* Sizes past the end of the ring are refused too */
+	consumer = tox_extension_messages_shm_consumer_open(&fds);
+	record.size = UINT64_MAX;
+	memcpy(broken_producer->ring + record_size(64), &record,
+	       sizeof(record));
+	atomic_store(&broken_producer->control->head,
+		     record_size(64) + broken_producer->capacity);
+	assert(tox_extension_messages_shm_consumer_next(consumer, &message));
+	assert(message.size == 64);
+	assert(!tox_extension_messages_shm_consumer_next(consumer, &message));
+
+	tox_extension_messages_shm_consumer_close(consumer);
+	tox_extension_messages_shm_producer_free(broken_producer);
+}
+
+int main(void)
+{
+	struct ToxExtUser user_a;
+	struct ToxExtUser user_b;
+
+	toxext_test_init_tox_ext_user(&user_a);
+	toxext_test_init_tox_ext_user(&user_b);
+
+	struct ToxExtensionMessages *ext_a = tox_extension_messages_register(
+		user_a.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	struct ToxExtensionMessages *ext_b = tox_extension_messages_register(
+		user_b.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+
+	tox_extension_messages_negotiate(ext_a, user_b.tox_user.id);
+	iterate(&user_a, &user_b);
+	iterate(&user_a, &user_b);
+
+	test_defer_outside_callback(ext_b);
+	test_open_rejects_non_ring();
+	test_rejects_oversized_record(ext_b);
+
+	producer = tox_extension_messages_shm_producer_create(ext_b, 0);
+	assert(producer);
+
+	struct Tox_Extension_Messages_Shm_Fds fds;
+	tox_extension_messages_shm_producer_get_fds(producer, &fds);
+	struct ToxExtensionMessagesShmConsumer *consumer =
+		tox_extension_messages_shm_consumer_open(&fds);
+	assert(consumer);
+
+	test_receipts_wait_for_release(&user_a, &user_b, ext_a, consumer);
+	test_wrap_and_queue(&user_a, &user_b, ext_a, consumer);
+	test_too_large(&user_a, &user_b, ext_a);
+	test_doorbell(&user_a, &user_b, ext_a, consumer);
+
+	tox_extension_messages_shm_consumer_close(consumer);
+	tox_extension_messages_shm_producer_free(producer);
+
+	tox_extension_messages_free(ext_b);
+	tox_extension_messages_free(ext_a);
+
+	toxext_test_cleanup_tox_ext_user(&user_b);
+	toxext_test_cleanup_tox_ext_user(&user_a);
+
+	return 0;
+}
@@ -0,0 +1,449 @@
+/*
+ * Replays a trace written by tox_extension_messages_trace.h through fresh
+ * extension instances on the toxext mock, e.g.
+ *
+ *   trace_replay --window 32 --repeat 10 production.txmt
+ *
+ * Inbound segments are fed to one instance, outbound segments to a second
+ * instance playing the other side. Every recorded friend is stood in for by a
+ * sink that both instances negotiate with and that discards everything, so
+ * the replay only sees recorded traffic but each friend keeps its own state.
+ */
+#include "../tox_extension_messages.c"
+#include "../tox_extension_messages_trace.h"
+
+#include <toxext/toxext.h>
+#include <toxext/mock_fixtures.h>
+
+#include <assert.h>
+#include <getopt.h>
+#include <stdio.h>
+
+struct Options {
+	bool paced;
+	uint32_t window;
+	size_t dedup_cache_size;
+	size_t dedup_min_message_size;
+	bool checksums;
+	size_t repeat;
+	char const *path;
+};
+
+struct Record {
+	uint64_t timestamp;
+	uint32_t friend_id;
+	enum Tox_Extension_Messages_Trace_Direction direction;
+	uint16_t size;
+	uint8_t const *data;
+};
+
+struct Trace {
+	uint8_t *file_data;
+	struct Record *records;
+	size_t records_size;
+};
+
+/* Stands in for a recorded friend */
+struct Peer {
+	uint32_t recorded_id;
+	struct ToxExtUser sink;
+	struct ToxExtExtension *sink_ext;
+};
+
+struct ReplayStats {
+	size_t inbound_segments;
+	size_t outbound_segments;
+	uint64_t bytes;
+	size_t messages;
+	uint64_t recv_ns;
+};
+
+static uint64_t get_time_ns(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static bool load_trace(char const *path, struct Trace *trace)
+{
+	FILE *file = fopen(path, "rb");
+
+	if (!file) {
+		return false;
+	}
+
+	fseek(file, 0, SEEK_END);
+	long file_size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	/* Read everything up front so disk access doesn't show up in timings */
+	trace->file_data = malloc(file_size > 0 ? file_size : 1);
+	bool read = trace->file_data && file_size >= 0 &&
+		    fread(trace->file_data, 1, file_size, file) ==
+			    (size_t)file_size;
+	fclose(file);
+
+	if (!read || file_size < TOX_EXTENSION_MESSAGES_TRACE_HEADER_SIZE ||
+	    memcmp(trace->file_data, TOX_EXTENSION_MESSAGES_TRACE_MAGIC, 4) !=
+		    0 ||
+	    toxext_read_from_buf(uint32_t, trace->file_data + 4, 4) !=
+		    TOX_EXTENSION_MESSAGES_TRACE_VERSION) {
+		return false;
+	}
+
+	size_t capacity = 0;
+	trace->records = NULL;
+	trace->records_size = 0;
+
+	uint8_t const *it =
+		trace->file_data + TOX_EXTENSION_MESSAGES_TRACE_HEADER_SIZE;
+	uint8_t const *end = trace->file_data + file_size;
+	while (end - it >= TOX_EXTENSION_MESSAGES_TRACE_RECORD_HEADER_SIZE) {
+		struct Record record;
+		record.timestamp = toxext_read_from_buf(uint64_t, it, 8);
+		record.friend_id = toxext_read_from_buf(uint32_t, it + 8, 4);
+		record.direction = it[12];
+		record.size = toxext_read_from_buf(uint16_t, it + 13, 2);
+		record.data = it + TOX_EXTENSION_MESSAGES_TRACE_RECORD_HEADER_SIZE;
+
+		/* A trace cut short by a crash can end half way through a record */
+		if (end - record.data < record.size) {
+			break;
+		}
+		it = record.data + record.size;
+
+		if (trace->records_size == capacity) {
+			capacity = capacity ? capacity * 2 : 1024;
+			struct Record *new_records = realloc(
+				trace->records, capacity * sizeof(struct Record));
+			if (!new_records) {
+				return false;
+			}
+			trace->records = new_records;
+		}
+		trace->records[trace->records_size++] = record;
+	}
+
+	return true;
+}
+
+static void replay_received_cb(uint32_t friend_number, uint8_t const *message,
+			       size_t length, void *user_data)
+{
+	(void)friend_number;
+	(void)message;
+	(void)length;
+	struct ReplayStats *stats = user_data;
+	stats->messages++;
+}
+
+static void replay_receipt_cb(uint32_t friend_number, const uint64_t receipt_id,
+			      void *user_data)
+{
+	(void)friend_number;
+	(void)receipt_id;
+	(void)user_data;
+}
+
+static void replay_neg_cb(uint32_t friend_number, bool compatible,
+			  uint64_t max_sending_size, void *user_data)
+{
+	(void)friend_number;
+	(void)compatible;
+	(void)max_sending_size;
+	(void)user_data;
+}
+
+static void sink_recv(struct ToxExtExtension *extension, uint32_t friend_id,
+		      void const *data, size_t size, void *userdata,
+		      struct ToxExtPacketList *response_packet_list)
+{
+	(void)extension;
+	(void)friend_id;
+	(void)data;
+	(void)size;
+	(void)userdata;
+	(void)response_packet_list;
+}
+
+static void sink_neg(struct ToxExtExtension *extension, uint32_t friend_id,
+		     bool compatible, void *userdata,
+		     struct ToxExtPacketList *response_packet_list)
+{
+	(void)extension;
+	(void)friend_id;
+	(void)compatible;
+	(void)userdata;
+	(void)response_packet_list;
+}
+
+static struct ToxExtensionMessages *
+register_replay_extension(struct ToxExtUser *user, struct Options const *options,
+			  struct ReplayStats *stats)
+{
+	struct ToxExtensionMessages *extension = tox_extension_messages_register(
+		user->toxext, replay_received_cb, replay_receipt_cb,
+		replay_neg_cb, stats,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	assert(extension);
+
+	tox_extension_messages_set_receive_window(extension, options->window);
+	if (options->dedup_cache_size) {
+		tox_extension_messages_enable_dedup(
+			extension, options->dedup_cache_size,
+			options->dedup_min_message_size);
+	}
+	if (options->checksums) {
+		tox_extension_messages_enable_checksums(extension);
+	}
+
+	return extension;
+}
+
+static struct Peer *find_peer(struct Peer *peers, size_t peers_size,
+			      uint32_t recorded_id)
+{
+	for (size_t i = 0; i < peers_size; ++i) {
+		if (peers[i].recorded_id == recorded_id) {
+			return &peers[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* One peer per friend id in the trace */
+static struct Peer *create_peers(struct Trace const *trace, size_t *peers_size)
+{
+	/* Sized up front, the mock holds on to the users' addresses */
+	struct Peer *peers = calloc(trace->records_size ? trace->records_size : 1,
+				    sizeof(struct Peer));
+	assert(peers);
+	*peers_size = 0;
+
+	for (size_t i = 0; i < trace->records_size; ++i) {
+		uint32_t friend_id = trace->records[i].friend_id;
+		if (find_peer(peers, *peers_size, friend_id)) {
+			continue;
+		}
+
+		struct Peer *peer = &peers[(*peers_size)++];
+		peer->recorded_id = friend_id;
+		toxext_test_init_tox_ext_user(&peer->sink);
+		peer->sink_ext = toxext_register(peer->sink.toxext, uuid, NULL,
+						 sink_recv, sink_neg);
+		assert(peer->sink_ext);
+	}
+
+	return peers;
+}
+
+static void iterate_users(struct ToxExtUser *local, struct ToxExtUser *remote,
+			  struct Peer *peers, size_t peers_size)
+{
+	tox_iterate(local->tox_user.tox, &local->tox_user);
+	tox_iterate(remote->tox_user.tox, &remote->tox_user);
+	for (size_t i = 0; i < peers_size; ++i) {
+		tox_iterate(peers[i].sink.tox_user.tox, &peers[i].sink.tox_user);
+	}
+}
+
+static void replay(struct Trace const *trace, struct Options const *options,
+		   struct ReplayStats *stats)
+{
+	struct ToxExtUser local;
+	struct ToxExtUser remote;
+
+	toxext_test_init_tox_ext_user(&local);
+	toxext_test_init_tox_ext_user(&remote);
+
+	struct ToxExtensionMessages *local_ext =
+		register_replay_extension(&local, options, stats);
+	struct ToxExtensionMessages *remote_ext =
+		register_replay_extension(&remote, options, stats);
+
+	size_t peers_size;
+	struct Peer *peers = create_peers(trace, &peers_size);
+
+	for (size_t i = 0; i < peers_size; ++i) {
+		uint32_t sink_id = peers[i].sink.tox_user.id;
+		tox_extension_messages_negotiate(local_ext, sink_id);
+		tox_extension_messages_negotiate(remote_ext, sink_id);
+	}
+	for (size_t i = 0; i < 4; ++i) {
+		iterate_users(&local, &remote, peers, peers_size);
+	}
+
+	uint64_t start = get_time_ns();
+	uint64_t first_timestamp =
+		trace->records_size ? trace->records[0].timestamp : 0;
+
+	for (size_t i = 0; i < trace->records_size; ++i) {
+		struct Record const *record = &trace->records[i];
+
+		if (options->paced) {
+			uint64_t due = start + (record->timestamp - first_timestamp);
+			uint64_t now = get_time_ns();
+			if (due > now) {
+				struct timespec wait = {
+					(due - now) / 1000000000,
+					(due - now) % 1000000000,
+				};
+				nanosleep(&wait, NULL);
+			}
+		}
+
+		bool inbound =
+			record->direction == TOX_EXTENSION_MESSAGES_TRACE_INBOUND;
+		struct ToxExtUser *user = inbound ? &local : &remote;
+		struct ToxExtensionMessages *extension =
+			inbound ? local_ext : remote_ext;
+		/* The instances only know the friend by its sink's id */
+		struct ToxExtUser *sink =
+			&find_peer(peers, peers_size, record->friend_id)->sink;
+
+		struct ToxExtPacketList *response_packet_list =
+			toxext_packet_list_create(user->toxext,
+						  sink->tox_user.id);
+
+		uint64_t recv_start = get_time_ns();
+		tox_extension_messages_recv(extension->extension_handle,
+					    sink->tox_user.id, record->data,
+					    record->size, extension,
+					    response_packet_list);
+		stats->recv_ns += get_time_ns() - recv_start;
+
+		toxext_send(response_packet_list);
+		tox_iterate(sink->tox_user.tox, &sink->tox_user);
+
+		if (inbound) {
+			stats->inbound_segments++;
+		} else {
+			stats->outbound_segments++;
+		}
+		stats->bytes += record->size;
+	}
+
+	tox_extension_messages_free(remote_ext);
+	tox_extension_messages_free(local_ext);
+
+	for (size_t i = 0; i < peers_size; ++i) {
+		toxext_test_cleanup_tox_ext_user(&peers[i].sink);
+	}
+	free(peers);
+	toxext_test_cleanup_tox_ext_user(&remote);
+	toxext_test_cleanup_tox_ext_user(&local);
+}
+
+static void usage(char const *name)
+{
+	fprintf(stderr,
+		"usage: %s [options] TRACE\n"
+		"  --paced         replay at the recorded pace instead of as fast as possible\n"
+		"  --window N      receive window in segments (default 0)\n"
+		"  --dedup BYTES   enable deduplication with a cache of BYTES\n"
+		"  --dedup-min BYTES\n"
+		"                  offer messages of at least BYTES (default 8 segments)\n"
+		"  --checksums     enable checksums\n"
+		"  --repeat N      replay N times with fresh instances (default 1)\n",
+		name);
+}
+
+static bool parse_options(int argc, char **argv, struct Options *options)
+{
+	static struct option const long_options[] = {
+		{ "paced", no_argument, NULL, 'p' },
+		{ "window", required_argument, NULL, 'w' },
+		{ "dedup", required_argument, NULL, 'd' },
+		{ "dedup-min", required_argument, NULL, 'm' },
+		{ "checksums", no_argument, NULL, 'c' },
+		{ "repeat", required_argument, NULL, 'r' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'p':
+			options->paced = true;
+			break;
+		case 'w':
+			options->window = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			options->dedup_cache_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'm':
+			options->dedup_min_message_size =
+				strtoull(optarg, NULL, 10);
+			break;
+		case 'c':
+			options->checksums = true;
+			break;
+		case 'r':
+			options->repeat = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			return false;
+		}
+	}
+
+	if (optind != argc - 1) {
+		return false;
+	}
+
+	options->path = argv[optind];
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	struct Options options = {
+		.paced = false,
+		.window = 0,
+		.dedup_cache_size = 0,
+		.dedup_min_message_size = 0,
+		.checksums = false,
+		.repeat = 1,
+		.path = NULL,
+	};
+
+	if (!parse_options(argc, argv, &options)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	struct Trace trace;
+	if (!load_trace(options.path, &trace)) {
+		fprintf(stderr, "%s: not a valid trace\n", options.path);
+		return 1;
+	}
+
+	struct ReplayStats stats;
+	memset(&stats, 0, sizeof(stats));
+
+	uint64_t start = get_time_ns();
+	for (size_t i = 0; i < options.repeat; ++i) {
+		replay(&trace, &options, &stats);
+	}
+	double elapsed_s = (get_time_ns() - start) / 1e9;
+	double recv_s = stats.recv_ns / 1e9;
+
+	printf("inbound segments:  %zu\n", stats.inbound_segments);
+	printf("outbound segments: %zu\n", stats.outbound_segments);
+	printf("messages:          %zu\n", stats.messages);
+	printf("elapsed:           %.3f s\n", elapsed_s);
+	printf("time in recv:      %.3f s\n", recv_s);
+	if (recv_s > 0) {
+		printf("recv throughput:   %.2f MiB/s, %.0f segments/s\n",
+		       stats.bytes / recv_s / (1024 * 1024),
+		       (stats.inbound_segments + stats.outbound_segments) /
+			       recv_s);
+	}
+
+	free(trace.records);
+	free(trace.file_data);
+
+	return 0;
+}
@@ -0,0 +1,247 @@
+#include "../tox_extension_messages.c"
+#include "../tox_extension_messages_trace.c"
+
+#include <toxext/toxext.h>
+#include <toxext/mock_fixtures.h>
+#include <assert.h>
+
+/* Left behind for the trace_replay smoke test */
+static char const trace_path[] = "trace_test.txmt";
+
+struct Segment {
+	enum Tox_Extension_Messages_Trace_Direction direction;
+	size_t size;
+	uint8_t data[TOXEXT_MAX_SEGMENT_SIZE];
+};
+
+static struct Segment segments_b[64];
+static size_t segments_b_size = 0;
+
+static void test_cb(uint32_t friend_number, uint8_t const *message,
+		    size_t length, void *user_data)
+{
+	(void)friend_number;
+	(void)message;
+	(void)length;
+	(void)user_data;
+}
+
+static void test_receipt_cb(uint32_t friend_number, const uint64_t receipt_id,
+			    void *user_data)
+{
+	(void)friend_number;
+	(void)receipt_id;
+	(void)user_data;
+}
+
+static void test_neg_cb(uint32_t friend_number, bool compatible,
+			uint64_t max_sending_size, void *user_data)
+{
+	(void)friend_number;
+	(void)compatible;
+	(void)max_sending_size;
+	(void)user_data;
+}
+
+static void test_trace_cb(uint32_t friend_id,
+			  enum Tox_Extension_Messages_Trace_Direction direction,
+			  uint8_t const *data, size_t size,
+			  void *trace_user_data)
+{
+	(void)friend_id;
+	(void)trace_user_data;
+	assert(segments_b_size < sizeof(segments_b) / sizeof(segments_b[0]));
+	struct Segment *segment = &segments_b[segments_b_size++];
+	segment->direction = direction;
+	segment->size = size;
+	memcpy(segment->data, data, size);
+}
+
+static uint8_t buffer[TOXEXT_MAX_SEGMENT_SIZE * 3];
+
+/*
+ * Everything A sent has to match what B received and the other way round.
+ * Both sides send at the same time so only each direction is ordered
+ */
+static struct Segment *next_segment_b(size_t *index,
+				      enum Tox_Extension_Messages_Trace_Direction
+					      direction)
+{
+	while (*index < segments_b_size &&
+	       segments_b[*index].direction != direction) {
+		(*index)++;
+	}
+
+	assert(*index < segments_b_size);
+	return &segments_b[(*index)++];
+}
+
+static void verify_trace(uint32_t friend_b)
+{
+	FILE *file = fopen(trace_path, "rb");
+	assert(file);
+
+	uint8_t header[TOX_EXTENSION_MESSAGES_TRACE_HEADER_SIZE];
+	assert(fread(header, 1, sizeof(header), file) == sizeof(header));
+	assert(memcmp(header, TOX_EXTENSION_MESSAGES_TRACE_MAGIC, 4) == 0);
+	assert(toxext_read_from_buf(uint32_t, header + 4, 4) ==
+	       TOX_EXTENSION_MESSAGES_TRACE_VERSION);
+
+	size_t records = 0;
+	size_t inbound_index = 0;
+	size_t outbound_index = 0;
+	uint64_t last_timestamp = 0;
+	uint8_t record_header[TOX_EXTENSION_MESSAGES_TRACE_RECORD_HEADER_SIZE];
+	while (fread(record_header, 1, sizeof(record_header), file) ==
+	       sizeof(record_header)) {
+		uint64_t timestamp =
+			toxext_read_from_buf(uint64_t, record_header, 8);
+		uint32_t friend_id =
+			toxext_read_from_buf(uint32_t, record_header + 8, 4);
+		uint8_t direction = record_header[12];
+		uint16_t size =
+			toxext_read_from_buf(uint16_t, record_header + 13, 2);
+
+		uint8_t data[TOXEXT_MAX_SEGMENT_SIZE];
+		assert(size <= sizeof(data));
+		assert(fread(data, 1, size, file) == size);
+
+		assert(timestamp >= last_timestamp);
+		last_timestamp = timestamp;
+		assert(friend_id == friend_b);
+
+		struct Segment *segment =
+			direction == TOX_EXTENSION_MESSAGES_TRACE_OUTBOUND ?
+				next_segment_b(
+					&inbound_index,
+					TOX_EXTENSION_MESSAGES_TRACE_INBOUND) :
+				next_segment_b(
+					&outbound_index,
+					TOX_EXTENSION_MESSAGES_TRACE_OUTBOUND);
+		records++;
+		assert(size == segment->size);
+		assert(memcmp(data, segment->data, size) == 0);
+	}
+
+	assert(records == segments_b_size);
+	fclose(file);
+}
+
+static void test_oversized_segments_are_dropped(void)
+{
+	struct ToxExtensionMessagesTrace *trace =
+		tox_extension_messages_trace_start("trace_test_drops.txmt", 0);
+	assert(trace);
+
+	tox_extension_messages_trace_record(
+		0, TOX_EXTENSION_MESSAGES_TRACE_INBOUND, buffer, 16, trace);
+	tox_extension_messages_trace_record(
+		0, TOX_EXTENSION_MESSAGES_TRACE_INBOUND, buffer,
+		TOXEXT_MAX_SEGMENT_SIZE, trace);
+	assert(tox_extension_messages_trace_get_dropped(trace) == 1);
+
+	tox_extension_messages_trace_stop(trace);
+	remove("trace_test_drops.txmt");
+}
+
+#ifdef __linux__
+static void test_write_errors_are_counted(void)
+{
+	struct ToxExtensionMessagesTrace *trace =
+		tox_extension_messages_trace_start("/dev/full", 0);
+	assert(trace);
+
+	tox_extension_messages_trace_record(
+		0, TOX_EXTENSION_MESSAGES_TRACE_INBOUND, buffer, 16, trace);
+
+	/* The writer thread finds out on its own time */
+	struct timespec wait = { 0, 1000 * 1000 };
+	size_t waited_ms = 0;
+	while (tox_extension_messages_trace_get_write_errors(trace) == 0 &&
+	       waited_ms++ < 1000) {
+		nanosleep(&wait, NULL);
+	}
+	assert(tox_extension_messages_trace_get_write_errors(trace) > 0);
+	assert(tox_extension_messages_trace_get_dropped(trace) == 0);
+
+	tox_extension_messages_trace_stop(trace);
+}
+#endif
+
+int main(void)
+{
+	struct ToxExtUser user_a;
+	struct ToxExtUser user_b;
+
+	for (size_t i = 0; i < sizeof(buffer); ++i) {
+		buffer[i] = i * 31;
+	}
+
+	toxext_test_init_tox_ext_user(&user_a);
+	toxext_test_init_tox_ext_user(&user_b);
+
+	struct ToxExtensionMessages *ext_a = tox_extension_messages_register(
+		user_a.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+	struct ToxExtensionMessages *ext_b = tox_extension_messages_register(
+		user_b.toxext, test_cb, test_receipt_cb, test_neg_cb, NULL,
+		TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE);
+
+	/* Make sure credit shows up in the trace too */
+	tox_extension_messages_set_receive_window(ext_a, 2);
+	tox_extension_messages_set_receive_window(ext_b, 2);
+
+	struct ToxExtensionMessagesTrace *trace =
+		tox_extension_messages_trace_start(
+			trace_path,
+			TOX_EXTENSION_MESSAGES_TRACE_DEFAULT_RING_SIZE);
+	assert(trace);
+	tox_extension_messages_trace_attach(trace, ext_a);
+	tox_extension_messages_set_trace_cb(ext_b, test_trace_cb, NULL);
+
+	tox_extension_messages_negotiate(ext_a, user_b.tox_user.id);
+
+	tox_iterate(user_b.tox_user.tox, &user_b.tox_user);
+	tox_iterate(user_a.tox_user.tox, &user_a.tox_user);
+	tox_iterate(user_b.tox_user.tox, &user_b.tox_user);
+	tox_iterate(user_a.tox_user.tox, &user_a.tox_user);
+
+	size_t const sizes[] = { 5, sizeof(buffer) };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		struct ToxExtPacketList *packet_list = toxext_packet_list_create(
+			user_a.toxext, user_b.tox_user.id);
+		enum Tox_Extension_Messages_Error err;
+		tox_extension_messages_append(ext_a, packet_list, buffer,
+					      sizes[i], user_b.tox_user.id,
+					      &err);
+		assert(err == TOX_EXTENSION_MESSAGES_SUCCESS);
+		toxext_send(packet_list);
+
+		for (size_t j = 0; j < 4; ++j) {
+			tox_iterate(user_b.tox_user.tox, &user_b.tox_user);
+			tox_iterate(user_a.tox_user.tox, &user_a.tox_user);
+		}
+	}
+
+	assert(tox_extension_messages_get_pending_segments(
+		       ext_a, user_b.tox_user.id) == 0);
+
+	tox_extension_messages_set_trace_cb(ext_a, NULL, NULL);
+	assert(tox_extension_messages_trace_get_dropped(trace) == 0);
+	tox_extension_messages_trace_stop(trace);
+
+	verify_trace(user_b.tox_user.id);
+
+	test_oversized_segments_are_dropped();
+#ifdef __linux__
+	test_write_errors_are_counted();
+#endif
+
+	tox_extension_messages_free(ext_b);
+	tox_extension_messages_free(ext_a);
+
+	toxext_test_cleanup_tox_ext_user(&user_b);
+	toxext_test_cleanup_tox_ext_user(&user_a);
+
+	return 0;
+}
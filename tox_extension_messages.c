@@ -6,6 +6,88 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC32C
+#endif
+
+/*
+ * Tools like the load simulator define these before including this file to
+ * account for what the extension allocates. Memory still comes from malloc()
+ * so buffers handed to the caller can be released with free()
+ */
+#ifndef TOX_EXTENSION_MESSAGES_ON_ALLOC
+#define TOX_EXTENSION_MESSAGES_ON_ALLOC(ptr)
+#endif
+
+#ifndef TOX_EXTENSION_MESSAGES_ON_FREE
+#define TOX_EXTENSION_MESSAGES_ON_FREE(ptr)
+#endif
+
+static void *ext_malloc(size_t size)
+{
+	void *ptr = malloc(size);
+
+	if (ptr) {
+		TOX_EXTENSION_MESSAGES_ON_ALLOC(ptr);
+	}
+
+	return ptr;
+}
+
+static void *ext_calloc(size_t count, size_t size)
+{
+	void *ptr = calloc(count, size);
+
+	if (ptr) {
+		TOX_EXTENSION_MESSAGES_ON_ALLOC(ptr);
+	}
+
+	return ptr;
+}
+
+static void *ext_realloc(void *ptr, size_t size)
+{
+	if (ptr) {
+		TOX_EXTENSION_MESSAGES_ON_FREE(ptr);
+	}
+
+	void *new_ptr = realloc(ptr, size);
+
+	if (new_ptr) {
+		TOX_EXTENSION_MESSAGES_ON_ALLOC(new_ptr);
+	} else if (ptr) {
+		/* The old allocation is still ours */
+		TOX_EXTENSION_MESSAGES_ON_ALLOC(ptr);
+	}
+
+	return new_ptr;
+}
+
+static void ext_free(void *ptr)
+{
+	if (ptr) {
+		TOX_EXTENSION_MESSAGES_ON_FREE(ptr);
+	}
+
+	free(ptr);
+}
+
+#define SAVEDATA_MAGIC 0x54584d53
+#define SAVEDATA_VERSION 3
+/* magic, version, next receipt id, friend count */
+#define SAVEDATA_HEADER_SIZE (4 + 4 + 8 + 4)
+/*
+ * friend id, negotiated, max sending size, supports credit, send window,
+ * features, receive limit override flag and value, incoming message capacity
+ * and size
+ */
+#define SAVEDATA_FRIEND_SIZE (4 + 1 + 8 + 1 + 4 + 1 + 1 + 8 + 8 + 8)
+/* Version 2 has no negotiated flag or receive limit, version 1 no features */
+#define SAVEDATA_FRIEND_SIZE_V2 (4 + 8 + 1 + 4 + 1 + 8 + 8)
+#define SAVEDATA_FRIEND_SIZE_V1 (4 + 8 + 1 + 4 + 8 + 8)
 
 static uint8_t const uuid[16] = { 0x9e, 0x10, 0x03, 0x16, 0xd2, 0x6f,
 				  0x45, 0x39, 0x8c, 0xdb, 0xae, 0x81,
@@ -17,12 +99,123 @@ enum Messages {
 	MESSAGE_PART,
 	MESSAGE_FINISH,
 	MESSAGE_RECEIVED,
+	MESSAGE_CREDIT,
+	MESSAGE_OFFER,
+	MESSAGE_REQUEST,
+	MESSAGE_FINISH_CHECKSUM,
+};
+
+/* Optional features advertised in MESSAGE_NEGOTIATE */
+enum NegotiateFeatures {
+	NEGOTIATE_FEATURE_DEDUP = 1 << 0,
+	NEGOTIATE_FEATURE_CHECKSUM = 1 << 1,
 };
 
+#define DIGEST_SIZE 32
+/* Messages that fit in a single segment are never worth offering */
+#define DEDUP_SINGLE_SEGMENT_SIZE (TOXEXT_MAX_SEGMENT_SIZE - 9 + 1)
+/* Outstanding requests we remember per friend before forgetting the oldest */
+#define MAX_REQUESTED_DIGESTS 16
+
 struct IncomingMessage {
 	uint8_t *message;
 	size_t size;
 	size_t capacity;
+	/*
+	 * Running CRC32C of the data copied in so far. Only maintained when
+	 * checksum is set, which is decided when the message starts
+	 */
+	bool checksum;
+	uint32_t crc;
+};
+
+struct OutgoingSegment {
+	size_t size;
+	uint8_t data[TOXEXT_MAX_SEGMENT_SIZE];
+};
+
+/*
+ * Segments that we have chunked but are not allowed to send yet because our
+ * friend has not given us enough credit. Used as a queue, segments are sent
+ * from begin and appended at begin + size
+ */
+struct OutgoingSegments {
+	struct OutgoingSegment *segments;
+	size_t begin;
+	size_t size;
+	size_t capacity;
+};
+
+/*
+ * The body of an offered message. Offering the same body to several friends
+ * at once shares a single copy and digest
+ */
+struct OfferedContent {
+	uint8_t digest[DIGEST_SIZE];
+	size_t size;
+	size_t refs;
+	struct OfferedContent *prev;
+	struct OfferedContent *next;
+	uint8_t data[];
+};
+
+/*
+ * A message we offered by digest and are holding on to until our friend
+ * either tells us it has it or asks for it
+ */
+struct PendingOffer {
+	uint64_t receipt_id;
+	struct OfferedContent *content;
+};
+
+/*
+ * A message appended while an offer was outstanding. It waits until the offer
+ * is answered so it can't overtake the offered message
+ */
+struct HeldMessage {
+	uint64_t receipt_id;
+	uint8_t *data;
+	size_t size;
+};
+
+struct HeldMessages {
+	struct HeldMessage *messages;
+	size_t begin;
+	size_t size;
+	size_t capacity;
+	/* Upper bound on the segments the held messages will be sent as */
+	size_t segments;
+};
+
+/* A body we asked for, cached once it arrives and matches its digest */
+struct RequestedDigest {
+	uint64_t receipt_id;
+	uint8_t digest[DIGEST_SIZE];
+};
+
+/*
+ * Refills amount tokens every period ms up to burst. Tokens are kept scaled
+ * by period so refilling never needs a division
+ */
+struct TokenBucket {
+	uint64_t scaled_tokens;
+	uint64_t last_refill;
+};
+
+struct RateLimiter {
+	/* Buckets start out full the first time they are used */
+	bool initialized;
+	struct TokenBucket segments;
+	struct TokenBucket bytes;
+	struct TokenBucket starts;
+};
+
+enum BulkNegotiationState {
+	BULK_NEGOTIATION_NONE = 0,
+	BULK_NEGOTIATION_QUEUED,
+	BULK_NEGOTIATION_IN_FLIGHT,
+	BULK_NEGOTIATION_NEGOTIATED,
+	BULK_NEGOTIATION_FAILED
 };
 
 struct FriendData {
@@ -36,12 +229,197 @@ struct FriendData {
 	bool drop_incoming_message;
 	struct IncomingMessage message;
 	uint64_t max_sending_size;
+	/* Overrides the instance wide max_receiving_message_size when set */
+	bool has_max_receiving_size;
+	uint64_t max_receiving_size;
+	/* Set once our friend has told us its limits */
+	bool peer_negotiated;
+	/*
+	 * Credit based flow control. Our friend tells us how many data segments
+	 * it is willing to have in flight (0 meaning unlimited) and hands credit
+	 * back as it processes them. Friends that predate flow control never
+	 * send a window and are never limited.
+	 */
+	bool peer_supports_credit;
+	uint32_t send_window;
+	int64_t send_credit;
+	struct OutgoingSegments outgoing_segments;
+	/* Data segments processed since we last handed credit back */
+	uint32_t consumed_segments;
+	/*
+	 * The window we last told our friend about. Credit is handed back by it
+	 * until our friend hears about another
+	 */
+	uint32_t receive_window;
+	uint8_t peer_features;
+	/* Set between a fresh connection and our friend's negotiate packet */
+	bool awaiting_negotiate;
+	/*
+	 * Set when a friend we're negotiated with negotiates again, e.g. because
+	 * one of us retried. Its negotiate packet tells whether it's a new
+	 * connection or the one we already have
+	 */
+	bool confirming_negotiate;
+	/*
+	 * Only one offer is outstanding at a time, whatever is appended after it
+	 * is held back until our friend answers it
+	 */
+	bool has_pending_offer;
+	struct PendingOffer pending_offer;
+	struct HeldMessages held_messages;
+	struct RequestedDigest requested_digests[MAX_REQUESTED_DIGESTS];
+	size_t requested_digests_size;
+	/* Overrides the instance wide rate limits when set */
+	bool has_rate_limits;
+	struct Tox_Extension_Messages_Rate_Limits rate_limits;
+	struct RateLimiter rate_limiter;
+	/* Where we are with tox_extension_messages_negotiate_bulk() */
+	enum BulkNegotiationState negotiation_state;
+	uint32_t negotiation_priority;
+	bool negotiation_pending_send;
+	uint32_t negotiation_attempts;
+	/* Bumped on every change so stale queue entries can be skipped */
+	uint32_t negotiation_generation;
+};
+
+/*
+ * A message appended with tox_extension_messages_append_tracked() that we
+ * haven't seen a receipt for yet. Entries live in a hash table keyed on friend
+ * and receipt id and at the same time in a slot of the timer wheel
+ */
+struct PendingReceipt {
+	uint32_t friend_id;
+	uint64_t receipt_id;
+	uint64_t deadline;
+	void *context;
+	struct PendingReceipt *hash_next;
+	size_t wheel_level;
+	struct PendingReceipt *wheel_next;
+	/* Points at whatever points at us so we can unlink in O(1) */
+	struct PendingReceipt **wheel_prev;
+};
+
+#define TIMER_WHEEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+/*
+ * Hierarchical timer wheel with millisecond ticks. Level 0 slots are one tick
+ * wide, every level above is TIMER_WHEEL_SLOTS times coarser. Entries are
+ * moved down a level when the wheel below wraps around, so processing a tick
+ * only touches entries that are due or close to due
+ */
+struct TimerWheel {
+	/* The next tick that hasn't been processed yet */
+	uint64_t next_tick;
+	struct PendingReceipt *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	size_t level_sizes[TIMER_WHEEL_LEVELS];
+};
+
+struct ReceiptTracker {
+	bool enabled;
+	tox_extension_messages_completion_cb completion_cb;
+	struct PendingReceipt **buckets;
+	size_t bucket_count;
+	size_t size;
+	struct TimerWheel wheel;
+};
+
+/*
+ * Friends waiting for a paced negotiation. Entries are never updated in place,
+ * a change pushes a new entry and the old one is skipped once its generation
+ * no longer matches the friend's
+ */
+struct QueuedNegotiation {
+	struct FriendData *friend_data;
+	uint32_t generation;
+	uint32_t priority;
+	bool pending_send;
+	/* Orders friends of equal priority first come first served */
+	uint64_t sequence;
+};
+
+/*
+ * A started negotiation. Every attempt uses the same timeout so deadlines
+ * come in order and a FIFO is enough
+ */
+struct InFlightNegotiation {
+	struct FriendData *friend_data;
+	uint32_t generation;
+	uint64_t deadline;
+};
+
+struct BulkNegotiation {
+	struct Tox_Extension_Messages_Negotiation_Pacing pacing;
+	/* The bucket starts out full the first time it is used */
+	bool tokens_initialized;
+	struct TokenBucket tokens;
+	/* Max heap */
+	struct QueuedNegotiation *queue;
+	size_t queue_size;
+	size_t queue_capacity;
+	uint64_t next_sequence;
+	/* Ring buffer, masked on access */
+	struct InFlightNegotiation *in_flight;
+	size_t in_flight_begin;
+	size_t in_flight_size;
+	size_t in_flight_capacity;
+	struct Tox_Extension_Messages_Negotiation_Progress progress;
+};
+
+struct CachedContent {
+	/* Only offers from the friend that sent the body may use it */
+	uint32_t friend_id;
+	uint8_t digest[DIGEST_SIZE];
+	uint8_t *data;
+	size_t size;
+	struct CachedContent *hash_next;
+	/* Least recently used entries are at the tail */
+	struct CachedContent *lru_prev;
+	struct CachedContent *lru_next;
+};
+
+/*
+ * Bodies of messages received through an offer, keyed by friend and digest.
+ * Keeping friends apart means nobody can probe for or claim content another
+ * friend sent us. Bounded by the total size of the bodies and evicted least
+ * recently used first
+ */
+struct ContentCache {
+	size_t capacity;
+	size_t size;
+	struct CachedContent **buckets;
+	size_t bucket_count;
+	size_t entry_count;
+	struct CachedContent *lru_head;
+	struct CachedContent *lru_tail;
+};
+
+/*
+ * The message currently passed to the received callback, see
+ * tox_extension_messages_take_message()
+ */
+struct Delivery {
+	bool active;
+	bool taken;
+	bool receipt_deferred;
+	uint64_t receipt_id;
+	uint8_t const *message;
+	size_t size;
+	/* The reassembly buffer message points into, if any */
+	struct IncomingMessage *incoming_message;
 };
 
 struct ToxExtensionMessages {
+	struct ToxExt *toxext;
 	struct ToxExtExtension *extension_handle;
 	// Ideally we would use a better data structure for this but C doesn't have a ton available
-	struct FriendData *friend_datas;
+	/*
+	 * Friends are allocated one by one so pointers to them stay valid when a
+	 * user callback adds a friend
+	 */
+	struct FriendData **friend_datas;
 	size_t friend_datas_size;
 	uint64_t next_receipt_id;
 	tox_extension_messages_received_cb cb;
@@ -49,14 +427,32 @@ struct ToxExtensionMessages {
 	tox_extension_messages_negotiate_cb negotiated_cb;
 	void *userdata;
 	uint64_t max_receiving_message_size;
+	uint32_t receive_window;
+	/* 0 for no limit on the segments queued per friend */
+	size_t max_pending_segments;
+	tox_extension_messages_clock_cb clock_cb;
+	void *clock_userdata;
+	struct ReceiptTracker receipts;
+	uint8_t features;
+	size_t dedup_min_message_size;
+	struct ContentCache content_cache;
+	/* Bodies of every outstanding offer */
+	struct OfferedContent *offered_contents;
+	tox_extension_messages_dropped_cb dropped_cb;
+	tox_extension_messages_trace_cb trace_cb;
+	void *trace_userdata;
+	struct Delivery delivery;
+	bool has_rate_limits;
+	struct Tox_Extension_Messages_Rate_Limits rate_limits;
+	struct BulkNegotiation bulk_negotiation;
 };
 
 static struct FriendData *
 get_friend_data(struct ToxExtensionMessages *extension, uint32_t friend_id)
 {
 	for (size_t i = 0; i < extension->friend_datas_size; ++i) {
-		if (extension->friend_datas[i].friend_id == friend_id) {
-			return &extension->friend_datas[i];
+		if (extension->friend_datas[i]->friend_id == friend_id) {
+			return extension->friend_datas[i];
 		}
 	}
 
@@ -73,9 +469,9 @@ get_or_insert_friend_data(struct ToxExtensionMessages *extension,
 		return friend_data;
 	}
 
-	struct FriendData *new_friend_datas = realloc(
+	struct FriendData **new_friend_datas = ext_realloc(
 		extension->friend_datas,
-		(extension->friend_datas_size + 1) * sizeof(struct FriendData));
+		(extension->friend_datas_size + 1) * sizeof(struct FriendData *));
 
 	if (!new_friend_datas) {
 		/* FIXME: We should probably tell the sender that we dropped a message here */
@@ -83,402 +479,3205 @@ get_or_insert_friend_data(struct ToxExtensionMessages *extension,
 	}
 
 	extension->friend_datas = new_friend_datas;
-	extension->friend_datas_size++;
 
-	friend_data =
-		&extension->friend_datas[extension->friend_datas_size - 1];
+	friend_data = ext_malloc(sizeof(struct FriendData));
+
+	if (!friend_data) {
+		return NULL;
+	}
+
+	extension->friend_datas[extension->friend_datas_size++] = friend_data;
 	friend_data->friend_id = friend_id;
 	friend_data->drop_incoming_message = false;
 	friend_data->message.message = NULL;
 	friend_data->message.size = 0;
 	friend_data->message.capacity = 0;
+	friend_data->message.checksum = false;
+	friend_data->message.crc = 0;
 	friend_data->max_sending_size = 0;
+	friend_data->has_max_receiving_size = false;
+	friend_data->max_receiving_size = 0;
+	friend_data->peer_negotiated = false;
+	friend_data->peer_supports_credit = false;
+	friend_data->send_window = 0;
+	friend_data->send_credit = 0;
+	friend_data->outgoing_segments.segments = NULL;
+	friend_data->outgoing_segments.begin = 0;
+	friend_data->outgoing_segments.size = 0;
+	friend_data->outgoing_segments.capacity = 0;
+	friend_data->consumed_segments = 0;
+	friend_data->receive_window = extension->receive_window;
+	friend_data->peer_features = 0;
+	friend_data->awaiting_negotiate = false;
+	friend_data->confirming_negotiate = false;
+	friend_data->has_pending_offer = false;
+	friend_data->held_messages.messages = NULL;
+	friend_data->held_messages.begin = 0;
+	friend_data->held_messages.size = 0;
+	friend_data->held_messages.capacity = 0;
+	friend_data->held_messages.segments = 0;
+	friend_data->requested_digests_size = 0;
+	friend_data->has_rate_limits = false;
+	memset(&friend_data->rate_limits, 0,
+	       sizeof(struct Tox_Extension_Messages_Rate_Limits));
+	friend_data->negotiation_state = BULK_NEGOTIATION_NONE;
+	friend_data->negotiation_priority = 0;
+	friend_data->negotiation_pending_send = false;
+	friend_data->negotiation_attempts = 0;
+	friend_data->negotiation_generation = 0;
+	friend_data->rate_limiter.initialized = false;
 
 	return friend_data;
 }
 
-static void clear_incoming_message(struct IncomingMessage *incoming_message)
+static size_t *
+get_negotiation_counter(struct Tox_Extension_Messages_Negotiation_Progress *progress,
+			enum BulkNegotiationState state)
 {
-	free(incoming_message->message);
-	incoming_message->message = NULL;
-	incoming_message->size = 0;
-	incoming_message->capacity = 0;
-}
+	switch (state) {
+	case BULK_NEGOTIATION_NONE:
+		break;
+	case BULK_NEGOTIATION_QUEUED:
+		return &progress->queued;
+	case BULK_NEGOTIATION_IN_FLIGHT:
+		return &progress->in_flight;
+	case BULK_NEGOTIATION_NEGOTIATED:
+		return &progress->negotiated;
+	case BULK_NEGOTIATION_FAILED:
+		return &progress->failed;
+	}
 
-struct MessagesPacket {
-	enum Messages message_type;
-	/* On start packets we flag how large the entire buffer will be */
-	size_t total_message_size;
-	uint8_t const *message_data;
-	size_t message_size;
-	size_t receipt_id;
-	uint64_t max_sending_message_size;
-};
+	return NULL;
+}
 
-bool parse_messages_packet(uint8_t const *data, size_t size,
-			   struct MessagesPacket *messages_packet)
+static void set_negotiation_state(struct ToxExtensionMessages *extension,
+				  struct FriendData *friend_data,
+				  enum BulkNegotiationState state)
 {
-	uint8_t const *it = data;
-	uint8_t const *end = data + size;
-
-	if (it + 1 > end) {
-		return false;
+	struct Tox_Extension_Messages_Negotiation_Progress *progress =
+		&extension->bulk_negotiation.progress;
+	size_t *old_counter =
+		get_negotiation_counter(progress, friend_data->negotiation_state);
+	size_t *new_counter = get_negotiation_counter(progress, state);
+
+	if (old_counter) {
+		(*old_counter)--;
+	} else {
+		progress->total++;
 	}
-	messages_packet->message_type = *it;
-	it += 1;
+	(*new_counter)++;
 
-	if (messages_packet->message_type == MESSAGE_RECEIVED) {
-		messages_packet->receipt_id =
-			toxext_read_from_buf(uint64_t, it, 8);
-		return true;
+	if (state == BULK_NEGOTIATION_NEGOTIATED) {
+		friend_data->negotiation_pending_send = false;
 	}
-	else if (messages_packet->message_type == MESSAGE_START) {
-		if (it + 8 > end) {
-			return false;
-		}
 
-		messages_packet->total_message_size =
-			toxext_read_from_buf(uint64_t, it, 8);
-		it += 8;
-	}
-	else if (messages_packet->message_type == MESSAGE_FINISH) {
-		messages_packet->receipt_id =
-			toxext_read_from_buf(uint64_t, it, 8);
-		it += 8;
-	}
-	else if (messages_packet->message_type == MESSAGE_NEGOTIATE) {
-		messages_packet->max_sending_message_size =
-			toxext_read_from_buf(uint64_t, it, 8);
-		it += 8;
-	}
+	friend_data->negotiation_state = state;
+	friend_data->negotiation_generation++;
+}
 
-	if (it > end) {
-		return false;
+/*
+ * Called whenever a friend is done negotiating, whether we started it or not.
+ * A friend we gave up on still counts once it negotiates on its own
+ */
+static void finish_bulk_negotiation(struct ToxExtensionMessages *extension,
+				    struct FriendData *friend_data,
+				    bool negotiated)
+{
+	switch (friend_data->negotiation_state) {
+	case BULK_NEGOTIATION_NONE:
+	case BULK_NEGOTIATION_NEGOTIATED:
+		break;
+	case BULK_NEGOTIATION_QUEUED:
+	case BULK_NEGOTIATION_IN_FLIGHT:
+		set_negotiation_state(extension, friend_data,
+				      negotiated ? BULK_NEGOTIATION_NEGOTIATED :
+						   BULK_NEGOTIATION_FAILED);
+		break;
+	case BULK_NEGOTIATION_FAILED:
+		if (negotiated) {
+			set_negotiation_state(extension, friend_data,
+					      BULK_NEGOTIATION_NEGOTIATED);
+		}
+		break;
 	}
+}
 
-	messages_packet->message_data = it;
-	messages_packet->message_size = end - it;
+static uint64_t
+get_friend_max_receiving_size(struct ToxExtensionMessages const *extension,
+			      struct FriendData const *friend_data)
+{
+	if (friend_data && friend_data->has_max_receiving_size) {
+		return friend_data->max_receiving_size;
+	}
 
-	return true;
+	return extension->max_receiving_message_size;
 }
 
-void tox_extension_messages_negotiate_size(
-	struct ToxExtensionMessages *extension,
-	struct ToxExtPacketList *response_packet_list)
+static void clear_incoming_message(struct IncomingMessage *incoming_message)
 {
-	uint8_t data[9];
-	data[0] = MESSAGE_NEGOTIATE;
-	toxext_write_to_buf(extension->max_receiving_message_size, data + 1, 8);
-	toxext_segment_append(response_packet_list, extension->extension_handle,
-			      data, 9);
-	return;
+	ext_free(incoming_message->message);
+	incoming_message->message = NULL;
+	incoming_message->size = 0;
+	incoming_message->capacity = 0;
+	incoming_message->checksum = false;
 }
 
-void tox_extension_copy_in_message_data(struct MessagesPacket *parsed_packet,
-					struct IncomingMessage *incoming_message)
+/*
+ * Passes a complete message to the received callback. If incoming_message is
+ * set the callback may take its buffer. Returns true if the callback deferred
+ * the receipt
+ */
+static bool deliver_message(struct ToxExtensionMessages *extension,
+			    uint32_t friend_id, uint64_t receipt_id,
+			    uint8_t const *message, size_t size,
+			    struct IncomingMessage *incoming_message)
 {
-	if (parsed_packet->message_size + incoming_message->size >
-	    incoming_message->capacity) {
-		/* FIXME: We should probably tell the sender that we dropped a message here */
-		clear_incoming_message(incoming_message);
-		return;
+	if (!extension->cb) {
+		return false;
 	}
 
-	memcpy(incoming_message->message + incoming_message->size,
-	       parsed_packet->message_data, parsed_packet->message_size);
-	incoming_message->size += parsed_packet->message_size;
+	struct Delivery *delivery = &extension->delivery;
+	delivery->active = true;
+	delivery->taken = false;
+	delivery->receipt_deferred = false;
+	delivery->receipt_id = receipt_id;
+	delivery->message = message;
+	delivery->size = size;
+	delivery->incoming_message = incoming_message;
+
+	extension->cb(friend_id, message, size, extension->userdata);
+
+	delivery->active = false;
+	return delivery->receipt_deferred;
 }
 
-void tox_extension_messages_handle_message_start(
-	struct ToxExtensionMessages *extension,
-	struct MessagesPacket *parsed_packet, struct FriendData *friend_data)
+static void report_drop(struct ToxExtensionMessages *extension,
+			uint32_t friend_id,
+			enum Tox_Extension_Messages_Drop_Reason reason)
 {
-	struct IncomingMessage *incoming_message = &friend_data->message;
-
-	if (extension->max_receiving_message_size <
-	    parsed_packet->total_message_size) {
-		friend_data->drop_incoming_message = true;
-		return;
+	if (extension->dropped_cb) {
+		extension->dropped_cb(friend_id, reason, extension->userdata);
 	}
+}
 
-	/*
-		* realloc here instead of malloc because we may have dropped half a message
-		* if a user went offline half way through sending
-		*/
-	uint8_t *resized_message = realloc(incoming_message->message,
-					   parsed_packet->total_message_size);
+#define CRC32C_INIT 0xffffffff
+
+static uint32_t const crc32c_table[256] = {
+	0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+	0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+	0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+	0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+	0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+	0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+	0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+	0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+	0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+	0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+	0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+	0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+	0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+	0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+	0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+	0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+	0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+	0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+	0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+	0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+	0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+	0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+	0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+	0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+	0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+	0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+	0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+	0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+	0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+	0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+	0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+	0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+	0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+	0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+	0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+	0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+	0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+	0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+	0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+	0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+	0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+	0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+	0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
 
-	if (!resized_message) {
-		/* FIXME: We should probably tell the sender that we dropped a message here */
-		clear_incoming_message(incoming_message);
-		return;
+static uint32_t crc32c_copy_portable(uint32_t crc, uint8_t *dst,
+				     uint8_t const *src, size_t size)
+{
+	for (size_t i = 0; i < size; ++i) {
+		crc = crc32c_table[(crc ^ src[i]) & 0xff] ^ (crc >> 8);
 	}
 
-	incoming_message->message = resized_message;
-	incoming_message->size = 0;
-	incoming_message->capacity = parsed_packet->total_message_size;
-
-	/*
-	 * If we never got a finish packet we should still do our best to parse the
-	 * next message. This means we need to reset the drop state as well
-	 */
-	friend_data->drop_incoming_message = false;
+	if (dst) {
+		memcpy(dst, src, size);
+	}
 
-	tox_extension_copy_in_message_data(parsed_packet, incoming_message);
+	return crc;
 }
 
-void tox_extension_messages_handle_message_finish(
-	struct ToxExtensionMessages *extension, uint32_t friend_id,
-	struct MessagesPacket *parsed_packet, struct FriendData *friend_data,
-	struct ToxExtPacketList *response_packet_list)
+#ifdef HAVE_SSE42_CRC32C
+/*
+ * The crc32 instruction consumes 8 bytes per cycle, which is about what the
+ * load/store of the copy costs anyway, so we fold the copy into the same loop
+ */
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_copy_sse42(uint32_t crc, uint8_t *dst, uint8_t const *src, size_t size)
 {
-	struct IncomingMessage *incoming_message = &friend_data->message;
-	uint8_t const* message = NULL;
-	size_t size = 0;
-
-	bool end_of_dropped_message = friend_data->drop_incoming_message;
-	friend_data->drop_incoming_message = false;
-
-	/* We can skip the allocate/memcpy here */
-	if (incoming_message->size == 0) {
-		message = parsed_packet->message_data;
-		size = parsed_packet->message_size;
-	}
-	else {
-		tox_extension_copy_in_message_data(parsed_packet, incoming_message);
-		message = incoming_message->message;
-		size = incoming_message->size;
+	uint64_t crc64 = crc;
+
+	if (dst) {
+		for (; size >= 8; size -= 8, src += 8, dst += 8) {
+			uint64_t value;
+			memcpy(&value, src, 8);
+			memcpy(dst, &value, 8);
+			crc64 = _mm_crc32_u64(crc64, value);
+		}
+	} else {
+		for (; size >= 8; size -= 8, src += 8) {
+			uint64_t value;
+			memcpy(&value, src, 8);
+			crc64 = _mm_crc32_u64(crc64, value);
+		}
 	}
 
-	if (end_of_dropped_message ||
-	    extension->max_receiving_message_size < size) {
-		/* FIXME: We should probably tell the sender that we dropped a message here */
-		clear_incoming_message(incoming_message);
-		return;
+	crc = crc64;
+	for (; size > 0; --size, ++src) {
+		crc = _mm_crc32_u8(crc, *src);
+		if (dst) {
+			*dst++ = *src;
+		}
 	}
 
-
-	if (extension->cb) {
-		extension->cb(friend_id, message, size, extension->userdata);
+	return crc;
+}
+#endif
+
+/*
+ * Continues a CRC32C over src, copying src to dst at the same time unless dst
+ * is NULL. Start from CRC32C_INIT and invert the result when done
+ */
+static uint32_t crc32c_copy(uint32_t crc, uint8_t *dst, uint8_t const *src,
+			    size_t size)
+{
+#ifdef HAVE_SSE42_CRC32C
+	if (__builtin_cpu_supports("sse4.2")) {
+		return crc32c_copy_sse42(crc, dst, src, size);
 	}
+#endif
+	return crc32c_copy_portable(crc, dst, src, size);
+}
 
-	uint8_t data[9];
-	data[0] = MESSAGE_RECEIVED;
-	toxext_write_to_buf(parsed_packet->receipt_id, data + 1, 8);
-	toxext_segment_append(response_packet_list, extension->extension_handle,
-			      data, 9);
+static uint64_t get_current_time(struct ToxExtensionMessages *extension)
+{
+	if (extension->clock_cb) {
+		return extension->clock_cb(extension->clock_userdata);
+	}
 
-	clear_incoming_message(incoming_message);
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000 + time.tv_nsec / 1000000;
 }
 
-void tox_extension_messages_handle_message_part(
-	struct MessagesPacket *parsed_packet, struct FriendData *friend_data)
+static void token_bucket_refill(struct TokenBucket *bucket, uint64_t amount,
+				uint64_t period, uint64_t burst, uint64_t now)
 {
-	struct IncomingMessage *incoming_message = &friend_data->message;
+	uint64_t tokens = burst ? burst : amount;
+	/* Anything this large is as good as unlimited */
+	uint64_t capacity =
+		tokens > UINT64_MAX / period ? UINT64_MAX : tokens * period;
+	uint64_t elapsed = now > bucket->last_refill ? now - bucket->last_refill :
+						       0;
+	bucket->last_refill = now;
+
+	if (bucket->scaled_tokens > capacity) {
+		bucket->scaled_tokens = capacity;
+	}
 
-	if (friend_data->drop_incoming_message) {
-		/* FIXME: We should probably tell the sender that we dropped a message here */
-		clear_incoming_message(incoming_message);
-		return;
+	uint64_t missing = capacity - bucket->scaled_tokens;
+	if (elapsed > missing / amount) {
+		bucket->scaled_tokens = capacity;
+	} else {
+		bucket->scaled_tokens += elapsed * amount;
 	}
-	tox_extension_copy_in_message_data(parsed_packet, incoming_message);
 }
 
-static void
-tox_extension_messages_recv(struct ToxExtExtension *extension,
-			    uint32_t friend_id, void const *data, size_t size,
-			    void *userdata,
-			    struct ToxExtPacketList *response_packet_list)
+/* The message type of a segment we haven't parsed yet */
+static uint8_t get_segment_type(uint8_t const *data, size_t size)
+{
+	return size > 0 ? data[0] : 0xff;
+}
+
+/* Whether our friend paid credit to send a segment of this type */
+static bool is_credited_segment(uint8_t type)
+{
+	switch (type) {
+	case MESSAGE_START:
+	case MESSAGE_PART:
+	case MESSAGE_FINISH:
+	case MESSAGE_FINISH_CHECKSUM:
+	case MESSAGE_OFFER:
+		return true;
+	}
+
+	return false;
+}
+
+/* Friends we don't know yet get the instance wide limits */
+static struct Tox_Extension_Messages_Rate_Limits const *
+get_friend_rate_limits(struct ToxExtensionMessages const *extension,
+		       struct FriendData const *friend_data)
+{
+	if (friend_data && friend_data->has_rate_limits) {
+		return &friend_data->rate_limits;
+	}
+
+	if (extension->has_rate_limits) {
+		return &extension->rate_limits;
+	}
+
+	return NULL;
+}
+
+/*
+ * Checks an incoming segment against limits using nothing but its size and
+ * type. Tokens are only taken from limiter if every limit allows the segment
+ */
+static bool
+check_rate_limits(struct ToxExtensionMessages *extension,
+		  struct Tox_Extension_Messages_Rate_Limits const *limits,
+		  struct RateLimiter *limiter, uint8_t const *data, size_t size,
+		  enum Tox_Extension_Messages_Drop_Reason *reason)
+{
+	if (!limits) {
+		return true;
+	}
+
+	/*
+	 * These are bounded by what we send ourselves and losing them would
+	 * stall our own messages. A request answers one of our offers, which
+	 * holds back everything after it until the answer arrives
+	 */
+	uint8_t type = get_segment_type(data, size);
+	if (type == MESSAGE_NEGOTIATE || type == MESSAGE_CREDIT ||
+	    type == MESSAGE_RECEIVED || type == MESSAGE_REQUEST) {
+		return true;
+	}
+
+	uint64_t now = get_current_time(extension);
+
+	if (!limiter->initialized) {
+		limiter->segments.scaled_tokens = UINT64_MAX;
+		limiter->segments.last_refill = now;
+		limiter->bytes.scaled_tokens = UINT64_MAX;
+		limiter->bytes.last_refill = now;
+		limiter->starts.scaled_tokens = UINT64_MAX;
+		limiter->starts.last_refill = now;
+		limiter->initialized = true;
+	}
+
+	bool limit_segments = limits->segments_per_second != 0;
+	bool limit_bytes = limits->bytes_per_second != 0;
+	bool limit_starts = type == MESSAGE_START &&
+			    limits->starts_per_interval != 0 &&
+			    limits->start_interval_ms != 0;
+
+	if (limit_segments) {
+		token_bucket_refill(&limiter->segments,
+				    limits->segments_per_second, 1000,
+				    limits->segment_burst, now);
+		if (limiter->segments.scaled_tokens < 1000) {
+			*reason = TOX_EXTENSION_MESSAGES_DROP_RATE_LIMITED_SEGMENTS;
+			return false;
+		}
+	}
+
+	if (limit_bytes) {
+		/* A bucket that can't hold a full segment would drop them all */
+		uint64_t byte_burst = limits->byte_burst ?
+					      limits->byte_burst :
+					      limits->bytes_per_second;
+		if (byte_burst < TOXEXT_MAX_SEGMENT_SIZE) {
+			byte_burst = TOXEXT_MAX_SEGMENT_SIZE;
+		}
+
+		token_bucket_refill(&limiter->bytes, limits->bytes_per_second,
+				    1000, byte_burst, now);
+		if (limiter->bytes.scaled_tokens < size * 1000) {
+			*reason = TOX_EXTENSION_MESSAGES_DROP_RATE_LIMITED_BYTES;
+			return false;
+		}
+	}
+
+	if (limit_starts) {
+		token_bucket_refill(&limiter->starts,
+				    limits->starts_per_interval,
+				    limits->start_interval_ms, 0, now);
+		if (limiter->starts.scaled_tokens < limits->start_interval_ms) {
+			*reason = TOX_EXTENSION_MESSAGES_DROP_RATE_LIMITED_STARTS;
+			return false;
+		}
+	}
+
+	if (limit_segments) {
+		limiter->segments.scaled_tokens -= 1000;
+	}
+	if (limit_bytes) {
+		limiter->bytes.scaled_tokens -= size * 1000;
+	}
+	if (limit_starts) {
+		limiter->starts.scaled_tokens -= limits->start_interval_ms;
+	}
+
+	return true;
+}
+
+static bool negotiation_before(struct QueuedNegotiation const *a,
+			       struct QueuedNegotiation const *b)
+{
+	if (a->pending_send != b->pending_send) {
+		return a->pending_send;
+	}
+
+	if (a->priority != b->priority) {
+		return a->priority > b->priority;
+	}
+
+	return a->sequence < b->sequence;
+}
+
+static bool reserve_negotiation_queue(struct BulkNegotiation *bulk,
+				      size_t count)
+{
+	if (bulk->queue_size + count <= bulk->queue_capacity) {
+		return true;
+	}
+
+	size_t new_capacity = bulk->queue_capacity ? bulk->queue_capacity : 64;
+	while (new_capacity < bulk->queue_size + count) {
+		new_capacity *= 2;
+	}
+
+	struct QueuedNegotiation *new_queue = ext_realloc(
+		bulk->queue, new_capacity * sizeof(struct QueuedNegotiation));
+
+	if (!new_queue) {
+		return false;
+	}
+
+	bulk->queue = new_queue;
+	bulk->queue_capacity = new_capacity;
+	return true;
+}
+
+/* Space must have been reserved with reserve_negotiation_queue() */
+static void queue_negotiation(struct ToxExtensionMessages *extension,
+			      struct FriendData *friend_data)
+{
+	struct BulkNegotiation *bulk = &extension->bulk_negotiation;
+	struct QueuedNegotiation entry = {
+		.friend_data = friend_data,
+		.generation = friend_data->negotiation_generation,
+		.priority = friend_data->negotiation_priority,
+		.pending_send = friend_data->negotiation_pending_send,
+		.sequence = bulk->next_sequence++,
+	};
+
+	size_t i = bulk->queue_size++;
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+
+		if (!negotiation_before(&entry, &bulk->queue[parent])) {
+			break;
+		}
+
+		bulk->queue[i] = bulk->queue[parent];
+		i = parent;
+	}
+	bulk->queue[i] = entry;
+}
+
+/*
+ * A bulk negotiated friend is no longer negotiated, e.g. it went offline. It
+ * goes back in the queue with fresh attempts so it is negotiated again once
+ * it's back
+ */
+static void restart_bulk_negotiation(struct ToxExtensionMessages *extension,
+				     struct FriendData *friend_data)
+{
+	if (friend_data->negotiation_state != BULK_NEGOTIATION_NEGOTIATED) {
+		return;
+	}
+
+	friend_data->negotiation_attempts = 0;
+
+	if (!reserve_negotiation_queue(&extension->bulk_negotiation, 1)) {
+		set_negotiation_state(extension, friend_data,
+				      BULK_NEGOTIATION_FAILED);
+		return;
+	}
+
+	set_negotiation_state(extension, friend_data, BULK_NEGOTIATION_QUEUED);
+	queue_negotiation(extension, friend_data);
+}
+
+static void pop_negotiation(struct BulkNegotiation *bulk)
+{
+	struct QueuedNegotiation last = bulk->queue[--bulk->queue_size];
+	size_t i = 0;
+
+	while (true) {
+		size_t child = i * 2 + 1;
+
+		if (child >= bulk->queue_size) {
+			break;
+		}
+
+		if (child + 1 < bulk->queue_size &&
+		    negotiation_before(&bulk->queue[child + 1],
+				       &bulk->queue[child])) {
+			child++;
+		}
+
+		if (!negotiation_before(&bulk->queue[child], &last)) {
+			break;
+		}
+
+		bulk->queue[i] = bulk->queue[child];
+		i = child;
+	}
+
+	if (bulk->queue_size > 0) {
+		bulk->queue[i] = last;
+	}
+}
+
+static bool reserve_in_flight_negotiation(struct BulkNegotiation *bulk)
+{
+	if (bulk->in_flight_size < bulk->in_flight_capacity) {
+		return true;
+	}
+
+	size_t new_capacity =
+		bulk->in_flight_capacity ? bulk->in_flight_capacity * 2 : 64;
+	struct InFlightNegotiation *new_in_flight =
+		ext_malloc(new_capacity * sizeof(struct InFlightNegotiation));
+
+	if (!new_in_flight) {
+		return false;
+	}
+
+	for (size_t i = 0; i < bulk->in_flight_size; ++i) {
+		new_in_flight[i] =
+			bulk->in_flight[(bulk->in_flight_begin + i) &
+					(bulk->in_flight_capacity - 1)];
+	}
+
+	ext_free(bulk->in_flight);
+	bulk->in_flight = new_in_flight;
+	bulk->in_flight_begin = 0;
+	bulk->in_flight_capacity = new_capacity;
+	return true;
+}
+
+static bool take_negotiation_token(struct BulkNegotiation *bulk, uint64_t now)
+{
+	struct Tox_Extension_Messages_Negotiation_Pacing const *pacing =
+		&bulk->pacing;
+
+	if (pacing->negotiations_per_second == 0) {
+		return true;
+	}
+
+	if (!bulk->tokens_initialized) {
+		bulk->tokens.scaled_tokens = UINT64_MAX;
+		bulk->tokens.last_refill = now;
+		bulk->tokens_initialized = true;
+	}
+
+	token_bucket_refill(&bulk->tokens, pacing->negotiations_per_second,
+			    1000, pacing->burst, now);
+
+	if (bulk->tokens.scaled_tokens < 1000) {
+		return false;
+	}
+
+	bulk->tokens.scaled_tokens -= 1000;
+	return true;
+}
+
+/*
+ * Requeues friends that didn't answer in time, then starts as many queued
+ * negotiations as the pacing allows
+ */
+static void process_bulk_negotiation(struct ToxExtensionMessages *extension,
+				     uint64_t now)
+{
+	struct BulkNegotiation *bulk = &extension->bulk_negotiation;
+
+	while (bulk->in_flight_size > 0) {
+		struct InFlightNegotiation attempt =
+			bulk->in_flight[bulk->in_flight_begin];
+
+		if (attempt.deadline > now) {
+			break;
+		}
+
+		bulk->in_flight_begin = (bulk->in_flight_begin + 1) &
+					(bulk->in_flight_capacity - 1);
+		bulk->in_flight_size--;
+
+		struct FriendData *friend_data = attempt.friend_data;
+
+		/* Our friend answered or was queued again in the meantime */
+		if (friend_data->negotiation_generation != attempt.generation) {
+			continue;
+		}
+
+		bool out_of_attempts =
+			bulk->pacing.max_attempts != 0 &&
+			friend_data->negotiation_attempts >=
+				bulk->pacing.max_attempts;
+
+		if (out_of_attempts || !reserve_negotiation_queue(bulk, 1)) {
+			set_negotiation_state(extension, friend_data,
+					      BULK_NEGOTIATION_FAILED);
+			continue;
+		}
+
+		set_negotiation_state(extension, friend_data,
+				      BULK_NEGOTIATION_QUEUED);
+		queue_negotiation(extension, friend_data);
+	}
+
+	while (bulk->queue_size > 0) {
+		struct QueuedNegotiation next = bulk->queue[0];
+		struct FriendData *friend_data = next.friend_data;
+
+		if (friend_data->negotiation_generation != next.generation) {
+			pop_negotiation(bulk);
+			continue;
+		}
+
+		/* Our friend got in first, no need to spend a token on it */
+		if (friend_data->peer_negotiated) {
+			pop_negotiation(bulk);
+			set_negotiation_state(extension, friend_data,
+					      BULK_NEGOTIATION_NEGOTIATED);
+			continue;
+		}
+
+		if (!reserve_in_flight_negotiation(bulk) ||
+		    !take_negotiation_token(bulk, now)) {
+			break;
+		}
+
+		pop_negotiation(bulk);
+		friend_data->negotiation_attempts++;
+		set_negotiation_state(extension, friend_data,
+				      BULK_NEGOTIATION_IN_FLIGHT);
+
+		struct InFlightNegotiation *attempt =
+			&bulk->in_flight[(bulk->in_flight_begin +
+					  bulk->in_flight_size++) &
+					 (bulk->in_flight_capacity - 1)];
+		attempt->friend_data = friend_data;
+		attempt->generation = friend_data->negotiation_generation;
+		attempt->deadline = now + bulk->pacing.retry_ms;
+
+		toxext_negotiate_connection(extension->extension_handle,
+					    friend_data->friend_id);
+	}
+}
+
+/*
+ * A message couldn't be sent because friend_id isn't negotiated yet, so it's
+ * worth negotiating with before anyone else still queued
+ */
+static void prioritize_negotiation(struct ToxExtensionMessages *extension,
+				   uint32_t friend_id)
+{
+	struct FriendData *friend_data = get_friend_data(extension, friend_id);
+
+	if (!friend_data ||
+	    friend_data->negotiation_state != BULK_NEGOTIATION_QUEUED ||
+	    friend_data->negotiation_pending_send ||
+	    !reserve_negotiation_queue(&extension->bulk_negotiation, 1)) {
+		return;
+	}
+
+	friend_data->negotiation_pending_send = true;
+	friend_data->negotiation_generation++;
+	queue_negotiation(extension, friend_data);
+}
+
+static void timer_wheel_insert(struct TimerWheel *wheel,
+			       struct PendingReceipt *pending_receipt)
+{
+	uint64_t expires = pending_receipt->deadline;
+
+	if (expires < wheel->next_tick) {
+		expires = wheel->next_tick;
+	}
+
+	uint64_t delta = expires - wheel->next_tick;
+	size_t level = 0;
+	while (level < TIMER_WHEEL_LEVELS - 1 &&
+	       delta >= (uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))) {
+		level++;
+	}
+
+	/*
+	 * Deadlines past the end of the top level are parked in its furthest
+	 * slot and re-filed when that slot is cascaded
+	 */
+	uint64_t max_delta = (uint64_t)1
+			     << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+	if (delta >= max_delta) {
+		expires = wheel->next_tick + max_delta - 1;
+	}
+
+	size_t slot = (expires >> (TIMER_WHEEL_BITS * level)) &
+		      TIMER_WHEEL_MASK;
+	struct PendingReceipt **head = &wheel->slots[level][slot];
+
+	wheel->level_sizes[level]++;
+	pending_receipt->wheel_level = level;
+	pending_receipt->wheel_next = *head;
+	pending_receipt->wheel_prev = head;
+	if (*head) {
+		(*head)->wheel_prev = &pending_receipt->wheel_next;
+	}
+	*head = pending_receipt;
+}
+
+static void timer_wheel_remove(struct TimerWheel *wheel,
+			       struct PendingReceipt *pending_receipt)
+{
+	wheel->level_sizes[pending_receipt->wheel_level]--;
+	*pending_receipt->wheel_prev = pending_receipt->wheel_next;
+	if (pending_receipt->wheel_next) {
+		pending_receipt->wheel_next->wheel_prev =
+			pending_receipt->wheel_prev;
+	}
+	pending_receipt->wheel_next = NULL;
+	pending_receipt->wheel_prev = NULL;
+}
+
+static size_t receipt_hash(uint32_t friend_id, uint64_t receipt_id)
+{
+	uint64_t hash = (receipt_id ^ ((uint64_t)friend_id << 32)) *
+			UINT64_C(0x9e3779b97f4a7c15);
+	return hash >> 32;
+}
+
+static struct PendingReceipt **
+find_pending_receipt(struct ReceiptTracker *tracker, uint32_t friend_id,
+		     uint64_t receipt_id)
+{
+	if (tracker->bucket_count == 0) {
+		return NULL;
+	}
+
+	size_t bucket = receipt_hash(friend_id, receipt_id) &
+			(tracker->bucket_count - 1);
+	struct PendingReceipt **it = &tracker->buckets[bucket];
+
+	while (*it) {
+		if ((*it)->friend_id == friend_id &&
+		    (*it)->receipt_id == receipt_id) {
+			return it;
+		}
+		it = &(*it)->hash_next;
+	}
+
+	return NULL;
+}
+
+static bool grow_receipt_buckets(struct ReceiptTracker *tracker)
+{
+	size_t new_bucket_count =
+		tracker->bucket_count ? tracker->bucket_count * 2 : 64;
+	struct PendingReceipt **new_buckets =
+		ext_calloc(new_bucket_count, sizeof(struct PendingReceipt *));
+
+	if (!new_buckets) {
+		return false;
+	}
+
+	for (size_t i = 0; i < tracker->bucket_count; ++i) {
+		struct PendingReceipt *it = tracker->buckets[i];
+		while (it) {
+			struct PendingReceipt *next = it->hash_next;
+			size_t bucket = receipt_hash(it->friend_id,
+						     it->receipt_id) &
+					(new_bucket_count - 1);
+			it->hash_next = new_buckets[bucket];
+			new_buckets[bucket] = it;
+			it = next;
+		}
+	}
+
+	ext_free(tracker->buckets);
+	tracker->buckets = new_buckets;
+	tracker->bucket_count = new_bucket_count;
+	return true;
+}
+
+/*
+ * Space in the buckets must have been made with grow_receipt_buckets()
+ */
+static void track_receipt(struct ReceiptTracker *tracker,
+			  struct PendingReceipt *pending_receipt)
+{
+	assert(tracker->size < tracker->bucket_count);
+
+	size_t bucket = receipt_hash(pending_receipt->friend_id,
+				     pending_receipt->receipt_id) &
+			(tracker->bucket_count - 1);
+	pending_receipt->hash_next = tracker->buckets[bucket];
+	tracker->buckets[bucket] = pending_receipt;
+	tracker->size++;
+
+	timer_wheel_insert(&tracker->wheel, pending_receipt);
+}
+
+static void complete_receipt(struct ToxExtensionMessages *extension,
+			     struct PendingReceipt **hash_entry,
+			     enum Tox_Extension_Messages_Receipt_Status status)
+{
+	struct ReceiptTracker *tracker = &extension->receipts;
+	struct PendingReceipt *pending_receipt = *hash_entry;
+
+	*hash_entry = pending_receipt->hash_next;
+	tracker->size--;
+	timer_wheel_remove(&tracker->wheel, pending_receipt);
+
+	tracker->completion_cb(pending_receipt->friend_id,
+			       pending_receipt->receipt_id, status,
+			       pending_receipt->context, extension->userdata);
+	ext_free(pending_receipt);
+}
+
+static void timer_wheel_cascade(struct TimerWheel *wheel, size_t level)
+{
+	size_t slot = (wheel->next_tick >> (TIMER_WHEEL_BITS * level)) &
+		      TIMER_WHEEL_MASK;
+	struct PendingReceipt *it = wheel->slots[level][slot];
+	wheel->slots[level][slot] = NULL;
+
+	while (it) {
+		struct PendingReceipt *next = it->wheel_next;
+		wheel->level_sizes[level]--;
+		timer_wheel_insert(wheel, it);
+		it = next;
+	}
+}
+
+static void process_receipt_timeouts(struct ToxExtensionMessages *extension,
+				     uint64_t now)
+{
+	struct ReceiptTracker *tracker = &extension->receipts;
+	struct TimerWheel *wheel = &tracker->wheel;
+
+	while (wheel->next_tick <= now) {
+		/* Nothing to expire, no point in stepping through every tick */
+		if (tracker->size == 0) {
+			wheel->next_tick = now + 1;
+			return;
+		}
+
+		/*
+		 * If the lower levels are empty nothing can happen until the next
+		 * cascade of the first level that has entries, skip straight there
+		 */
+		size_t empty_levels = 0;
+		while (wheel->level_sizes[empty_levels] == 0) {
+			empty_levels++;
+		}
+
+		if (empty_levels > 0) {
+			uint64_t mask =
+				((uint64_t)1 << (TIMER_WHEEL_BITS * empty_levels)) -
+				1;
+			uint64_t cascade_tick = (wheel->next_tick + mask) & ~mask;
+			if (cascade_tick != wheel->next_tick) {
+				wheel->next_tick = cascade_tick < now + 1 ?
+							   cascade_tick :
+							   now + 1;
+				continue;
+			}
+		}
+
+		size_t slot = wheel->next_tick & TIMER_WHEEL_MASK;
+
+		for (size_t level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+			size_t lower_bits = TIMER_WHEEL_BITS * level;
+			if (wheel->next_tick & (((uint64_t)1 << lower_bits) - 1)) {
+				break;
+			}
+			timer_wheel_cascade(wheel, level);
+		}
+
+		/*
+		 * Completion callbacks may track new messages that land in this
+		 * slot, keep going until it is really empty
+		 */
+		while (wheel->slots[0][slot]) {
+			struct PendingReceipt *pending_receipt =
+				wheel->slots[0][slot];
+			struct PendingReceipt **hash_entry =
+				find_pending_receipt(tracker,
+						     pending_receipt->friend_id,
+						     pending_receipt->receipt_id);
+			assert(hash_entry);
+			complete_receipt(extension, hash_entry,
+					 TOX_EXTENSION_MESSAGES_RECEIPT_TIMED_OUT);
+		}
+
+		wheel->next_tick++;
+	}
+}
+
+/* The time left until deadline on the old clock, on the new one */
+static uint64_t rebase_deadline(uint64_t deadline, uint64_t old_now,
+				uint64_t new_now)
+{
+	return new_now + (deadline > old_now ? deadline - old_now : 0);
+}
+
+static void rebase_receipt_deadlines(struct ReceiptTracker *tracker,
+				     uint64_t old_now, uint64_t new_now)
+{
+	/* Slots are relative to next_tick, so everything is filed again */
+	for (size_t i = 0; i < tracker->bucket_count; ++i) {
+		for (struct PendingReceipt *it = tracker->buckets[i]; it;
+		     it = it->hash_next) {
+			timer_wheel_remove(&tracker->wheel, it);
+			it->deadline = rebase_deadline(it->deadline, old_now,
+						       new_now);
+		}
+	}
+
+	tracker->wheel.next_tick = new_now;
+
+	for (size_t i = 0; i < tracker->bucket_count; ++i) {
+		for (struct PendingReceipt *it = tracker->buckets[i]; it;
+		     it = it->hash_next) {
+			timer_wheel_insert(&tracker->wheel, it);
+		}
+	}
+}
+
+static void free_receipt_tracker(struct ReceiptTracker *tracker)
+{
+	for (size_t i = 0; i < tracker->bucket_count; ++i) {
+		struct PendingReceipt *it = tracker->buckets[i];
+		while (it) {
+			struct PendingReceipt *next = it->hash_next;
+			ext_free(it);
+			it = next;
+		}
+	}
+	ext_free(tracker->buckets);
+	tracker->buckets = NULL;
+	tracker->bucket_count = 0;
+	tracker->size = 0;
+}
+
+static uint32_t const sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t rotr32(uint32_t value, unsigned int bits)
+{
+	return (value >> bits) | (value << (32 - bits));
+}
+
+static void sha256_block(uint32_t state[8], uint8_t const *block)
+{
+	uint32_t w[64];
+
+	for (size_t i = 0; i < 16; ++i) {
+		w[i] = toxext_read_from_buf(uint32_t, block + i * 4, 4);
+	}
+
+	for (size_t i = 16; i < 64; ++i) {
+		uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^
+			      (w[i - 15] >> 3);
+		uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^
+			      (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+	for (size_t i = 0; i < 64; ++i) {
+		uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+		uint32_t ch = (e & f) ^ (~e & g);
+		uint32_t temp1 = h + s1 + ch + sha256_k[i] + w[i];
+		uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+		uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		uint32_t temp2 = s0 + maj;
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + temp1;
+		d = c;
+		c = b;
+		b = a;
+		a = temp1 + temp2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+/*
+ * Digest used to address message bodies. This has to be a cryptographic hash,
+ * otherwise a friend could craft a body that collides with content some other
+ * friend offers us later
+ */
+static void sha256(uint8_t const *data, size_t size,
+		   uint8_t digest[DIGEST_SIZE])
+{
+	uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+			      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	size_t full_blocks_size = size & ~(size_t)63;
+
+	for (size_t i = 0; i < full_blocks_size; i += 64) {
+		sha256_block(state, data + i);
+	}
+
+	uint8_t tail[128] = { 0 };
+	size_t tail_size = size - full_blocks_size;
+	memcpy(tail, data + full_blocks_size, tail_size);
+	tail[tail_size] = 0x80;
+
+	size_t padded_size = tail_size + 9 <= 64 ? 64 : 128;
+	toxext_write_to_buf((uint64_t)size * 8, tail + padded_size - 8, 8);
+
+	for (size_t i = 0; i < padded_size; i += 64) {
+		sha256_block(state, tail + i);
+	}
+
+	for (size_t i = 0; i < 8; ++i) {
+		toxext_write_to_buf(state[i], digest + i * 4, 4);
+	}
+}
+
+static size_t digest_hash(uint32_t friend_id,
+			  uint8_t const digest[DIGEST_SIZE])
+{
+	/* The digest is already uniformly distributed */
+	return toxext_read_from_buf(uint64_t, digest, 8) ^ friend_id;
+}
+
+static struct CachedContent **
+find_cached_content(struct ContentCache *cache, uint32_t friend_id,
+		    uint8_t const digest[DIGEST_SIZE])
+{
+	if (cache->bucket_count == 0) {
+		return NULL;
+	}
+
+	struct CachedContent **it =
+		&cache->buckets[digest_hash(friend_id, digest) &
+				(cache->bucket_count - 1)];
+
+	while (*it) {
+		if ((*it)->friend_id == friend_id &&
+		    memcmp((*it)->digest, digest, DIGEST_SIZE) == 0) {
+			return it;
+		}
+		it = &(*it)->hash_next;
+	}
+
+	return NULL;
+}
+
+static void lru_unlink(struct ContentCache *cache, struct CachedContent *content)
+{
+	if (content->lru_prev) {
+		content->lru_prev->lru_next = content->lru_next;
+	} else {
+		cache->lru_head = content->lru_next;
+	}
+
+	if (content->lru_next) {
+		content->lru_next->lru_prev = content->lru_prev;
+	} else {
+		cache->lru_tail = content->lru_prev;
+	}
+}
+
+static void lru_push_front(struct ContentCache *cache,
+			   struct CachedContent *content)
+{
+	content->lru_prev = NULL;
+	content->lru_next = cache->lru_head;
+	if (cache->lru_head) {
+		cache->lru_head->lru_prev = content;
+	} else {
+		cache->lru_tail = content;
+	}
+	cache->lru_head = content;
+}
+
+static void remove_cached_content(struct ContentCache *cache,
+				  struct CachedContent **hash_entry)
+{
+	struct CachedContent *content = *hash_entry;
+
+	*hash_entry = content->hash_next;
+	lru_unlink(cache, content);
+	cache->size -= content->size;
+	cache->entry_count--;
+	ext_free(content->data);
+	ext_free(content);
+}
+
+static bool grow_content_buckets(struct ContentCache *cache)
+{
+	size_t new_bucket_count =
+		cache->bucket_count ? cache->bucket_count * 2 : 64;
+	struct CachedContent **new_buckets =
+		ext_calloc(new_bucket_count, sizeof(struct CachedContent *));
+
+	if (!new_buckets) {
+		return false;
+	}
+
+	for (size_t i = 0; i < cache->bucket_count; ++i) {
+		struct CachedContent *it = cache->buckets[i];
+		while (it) {
+			struct CachedContent *next = it->hash_next;
+			size_t bucket = digest_hash(it->friend_id, it->digest) &
+					(new_bucket_count - 1);
+			it->hash_next = new_buckets[bucket];
+			new_buckets[bucket] = it;
+			it = next;
+		}
+	}
+
+	ext_free(cache->buckets);
+	cache->buckets = new_buckets;
+	cache->bucket_count = new_bucket_count;
+	return true;
+}
+
+/*
+ * Takes ownership of data, which must have been allocated with malloc. Data is
+ * freed if it can't be cached
+ */
+static void insert_cached_content(struct ContentCache *cache,
+				  uint32_t friend_id,
+				  uint8_t const digest[DIGEST_SIZE],
+				  uint8_t *data, size_t size)
+{
+	if (size > cache->capacity ||
+	    find_cached_content(cache, friend_id, digest) ||
+	    (cache->entry_count >= cache->bucket_count &&
+	     !grow_content_buckets(cache))) {
+		ext_free(data);
+		return;
+	}
+
+	struct CachedContent *content =
+		ext_malloc(sizeof(struct CachedContent));
+
+	if (!content) {
+		ext_free(data);
+		return;
+	}
+
+	while (cache->size + size > cache->capacity) {
+		struct CachedContent **lru_entry = find_cached_content(
+			cache, cache->lru_tail->friend_id,
+			cache->lru_tail->digest);
+		remove_cached_content(cache, lru_entry);
+	}
+
+	content->friend_id = friend_id;
+	memcpy(content->digest, digest, DIGEST_SIZE);
+	content->data = data;
+	content->size = size;
+
+	size_t bucket =
+		digest_hash(friend_id, digest) & (cache->bucket_count - 1);
+	content->hash_next = cache->buckets[bucket];
+	cache->buckets[bucket] = content;
+	lru_push_front(cache, content);
+	cache->size += size;
+	cache->entry_count++;
+}
+
+static void free_content_cache(struct ContentCache *cache)
+{
+	struct CachedContent *it = cache->lru_head;
+	while (it) {
+		struct CachedContent *next = it->lru_next;
+		ext_free(it->data);
+		ext_free(it);
+		it = next;
+	}
+	ext_free(cache->buckets);
+	memset(cache, 0, sizeof(struct ContentCache));
+}
+
+/*
+ * Returns the shared copy of data if it is already on offer to another friend.
+ * Comparing against the few outstanding bodies is much cheaper than hashing
+ */
+static struct OfferedContent *
+get_offered_content(struct ToxExtensionMessages *extension,
+		    uint8_t const *data, size_t size)
+{
+	for (struct OfferedContent *it = extension->offered_contents; it;
+	     it = it->next) {
+		if (it->size == size && memcmp(it->data, data, size) == 0) {
+			it->refs++;
+			return it;
+		}
+	}
+
+	struct OfferedContent *content =
+		ext_malloc(sizeof(struct OfferedContent) + size);
+
+	if (!content) {
+		return NULL;
+	}
+
+	memcpy(content->data, data, size);
+	sha256(data, size, content->digest);
+	content->size = size;
+	content->refs = 1;
+	content->prev = NULL;
+	content->next = extension->offered_contents;
+	if (content->next) {
+		content->next->prev = content;
+	}
+	extension->offered_contents = content;
+	return content;
+}
+
+static void put_offered_content(struct ToxExtensionMessages *extension,
+				struct OfferedContent *content)
+{
+	if (--content->refs > 0) {
+		return;
+	}
+
+	if (content->prev) {
+		content->prev->next = content->next;
+	} else {
+		extension->offered_contents = content->next;
+	}
+
+	if (content->next) {
+		content->next->prev = content->prev;
+	}
+
+	ext_free(content);
+}
+
+static void clear_pending_offer(struct ToxExtensionMessages *extension,
+				struct FriendData *friend_data)
+{
+	if (friend_data->has_pending_offer) {
+		put_offered_content(extension,
+				    friend_data->pending_offer.content);
+		friend_data->has_pending_offer = false;
+	}
+}
+
+static struct PendingOffer *find_pending_offer(struct FriendData *friend_data,
+					       uint64_t receipt_id)
+{
+	if (friend_data->has_pending_offer &&
+	    friend_data->pending_offer.receipt_id == receipt_id) {
+		return &friend_data->pending_offer;
+	}
+
+	return NULL;
+}
+
+/* Upper bound on the segments a message of size bytes is split into */
+static size_t max_segments_for_size(size_t size)
+{
+	return size / (TOXEXT_MAX_SEGMENT_SIZE - 9) + 2;
+}
+
+/* Segments waiting on credit plus the messages held behind an offer */
+static size_t get_pending_segments(struct FriendData const *friend_data)
+{
+	return friend_data->outgoing_segments.size +
+	       friend_data->held_messages.segments;
+}
+
+static bool hold_message(struct FriendData *friend_data, uint8_t const *data,
+			 size_t size, uint64_t receipt_id)
+{
+	struct HeldMessages *held = &friend_data->held_messages;
+
+	if (held->begin + held->size == held->capacity) {
+		if (held->begin > 0) {
+			memmove(held->messages, held->messages + held->begin,
+				held->size * sizeof(struct HeldMessage));
+			held->begin = 0;
+		} else {
+			size_t new_capacity =
+				held->capacity ? held->capacity * 2 : 8;
+			struct HeldMessage *new_messages =
+				ext_realloc(held->messages,
+					new_capacity *
+						sizeof(struct HeldMessage));
+
+			if (!new_messages) {
+				return false;
+			}
+
+			held->messages = new_messages;
+			held->capacity = new_capacity;
+		}
+	}
+
+	uint8_t *data_copy = ext_malloc(size ? size : 1);
+
+	if (!data_copy) {
+		return false;
+	}
+
+	memcpy(data_copy, data, size);
+
+	struct HeldMessage *message =
+		&held->messages[held->begin + held->size++];
+	message->receipt_id = receipt_id;
+	message->data = data_copy;
+	message->size = size;
+	held->segments += max_segments_for_size(size);
+	return true;
+}
+
+static void clear_held_messages(struct HeldMessages *held)
+{
+	for (size_t i = 0; i < held->size; ++i) {
+		ext_free(held->messages[held->begin + i].data);
+	}
+	ext_free(held->messages);
+	held->messages = NULL;
+	held->begin = 0;
+	held->size = 0;
+	held->capacity = 0;
+	held->segments = 0;
+}
+
+struct MessagesPacket {
+	enum Messages message_type;
+	/* On start packets we flag how large the entire buffer will be */
+	size_t total_message_size;
+	uint8_t const *message_data;
+	size_t message_size;
+	size_t receipt_id;
+	uint64_t max_sending_message_size;
+	bool has_receive_window;
+	uint32_t receive_window;
+	uint8_t features;
+	uint32_t credit;
+	uint8_t const *digest;
+	uint32_t crc;
+};
+
+bool parse_messages_packet(uint8_t const *data, size_t size,
+			   struct MessagesPacket *messages_packet)
+{
+	uint8_t const *it = data;
+	uint8_t const *end = data + size;
+
+	if (it + 1 > end) {
+		return false;
+	}
+	messages_packet->message_type = *it;
+	it += 1;
+
+	if (messages_packet->message_type == MESSAGE_RECEIVED) {
+		messages_packet->receipt_id =
+			toxext_read_from_buf(uint64_t, it, 8);
+		return true;
+	}
+	else if (messages_packet->message_type == MESSAGE_START) {
+		if (it + 8 > end) {
+			return false;
+		}
+
+		messages_packet->total_message_size =
+			toxext_read_from_buf(uint64_t, it, 8);
+		it += 8;
+	}
+	else if (messages_packet->message_type == MESSAGE_FINISH) {
+		messages_packet->receipt_id =
+			toxext_read_from_buf(uint64_t, it, 8);
+		it += 8;
+	}
+	else if (messages_packet->message_type == MESSAGE_FINISH_CHECKSUM) {
+		if (it + 12 > end) {
+			return false;
+		}
+
+		messages_packet->receipt_id =
+			toxext_read_from_buf(uint64_t, it, 8);
+		it += 8;
+		messages_packet->crc = toxext_read_from_buf(uint32_t, it, 4);
+		it += 4;
+	}
+	else if (messages_packet->message_type == MESSAGE_NEGOTIATE) {
+		messages_packet->max_sending_message_size =
+			toxext_read_from_buf(uint64_t, it, 8);
+		it += 8;
+
+		/* Friends that predate flow control stop after the max size */
+		messages_packet->has_receive_window = it + 4 <= end;
+		if (messages_packet->has_receive_window) {
+			messages_packet->receive_window =
+				toxext_read_from_buf(uint32_t, it, 4);
+			it += 4;
+		}
+
+		messages_packet->features = 0;
+		if (it + 1 <= end) {
+			messages_packet->features = *it;
+			it += 1;
+		}
+	}
+	else if (messages_packet->message_type == MESSAGE_OFFER) {
+		if (it + 16 + DIGEST_SIZE > end) {
+			return false;
+		}
+
+		messages_packet->receipt_id =
+			toxext_read_from_buf(uint64_t, it, 8);
+		it += 8;
+		messages_packet->total_message_size =
+			toxext_read_from_buf(uint64_t, it, 8);
+		it += 8;
+		messages_packet->digest = it;
+		it += DIGEST_SIZE;
+	}
+	else if (messages_packet->message_type == MESSAGE_REQUEST) {
+		if (it + 8 > end) {
+			return false;
+		}
+
+		messages_packet->receipt_id =
+			toxext_read_from_buf(uint64_t, it, 8);
+		it += 8;
+	}
+	else if (messages_packet->message_type == MESSAGE_CREDIT) {
+		if (it + 4 > end) {
+			return false;
+		}
+
+		messages_packet->credit = toxext_read_from_buf(uint32_t, it, 4);
+		it += 4;
+	}
+
+	if (it > end) {
+		return false;
+	}
+
+	messages_packet->message_data = it;
+	messages_packet->message_size = end - it;
+
+	return true;
+}
+
+/*
+ * Every segment we send goes through here so it can be traced
+ */
+static void append_segment(struct ToxExtensionMessages *extension,
+			   uint32_t friend_id,
+			   struct ToxExtPacketList *packet_list,
+			   uint8_t const *data, size_t size)
+{
+	if (extension->trace_cb) {
+		extension->trace_cb(friend_id,
+				    TOX_EXTENSION_MESSAGES_TRACE_OUTBOUND, data,
+				    size, extension->trace_userdata);
+	}
+
+	toxext_segment_append(packet_list, extension->extension_handle, data,
+			      size);
+}
+
+void tox_extension_messages_negotiate_size(
+	struct ToxExtensionMessages *extension, uint32_t friend_id,
+	struct ToxExtPacketList *response_packet_list)
+{
+	struct FriendData *friend_data = get_friend_data(extension, friend_id);
+	uint64_t max_receiving_size =
+		get_friend_max_receiving_size(extension, friend_data);
+
+	if (friend_data) {
+		friend_data->receive_window = extension->receive_window;
+	}
+
+	uint8_t data[14];
+	data[0] = MESSAGE_NEGOTIATE;
+	toxext_write_to_buf(max_receiving_size, data + 1, 8);
+	toxext_write_to_buf(extension->receive_window, data + 9, 4);
+	data[13] = extension->features;
+	append_segment(extension, friend_id, response_packet_list, data, 14);
+	return;
+}
+
+static bool is_flow_controlled(struct FriendData *friend_data)
+{
+	return friend_data->peer_supports_credit &&
+	       friend_data->send_window != 0;
+}
+
+static bool reserve_outgoing_segments(struct OutgoingSegments *segments,
+				      size_t additional)
+{
+	size_t required = segments->size + additional;
+
+	if (segments->begin + required <= segments->capacity) {
+		return true;
+	}
+
+	/* Move everything back to the front before deciding to grow */
+	if (segments->begin > 0) {
+		memmove(segments->segments,
+			segments->segments + segments->begin,
+			segments->size * sizeof(struct OutgoingSegment));
+		segments->begin = 0;
+	}
+
+	if (required <= segments->capacity) {
+		return true;
+	}
+
+	size_t new_capacity = segments->capacity ? segments->capacity : 16;
+	while (new_capacity < required) {
+		new_capacity *= 2;
+	}
+
+	struct OutgoingSegment *new_segments = ext_realloc(
+		segments->segments,
+		new_capacity * sizeof(struct OutgoingSegment));
+
+	if (!new_segments) {
+		return false;
+	}
+
+	segments->segments = new_segments;
+	segments->capacity = new_capacity;
+	return true;
+}
+
+static void clear_outgoing_segments(struct OutgoingSegments *segments)
+{
+	ext_free(segments->segments);
+	segments->segments = NULL;
+	segments->begin = 0;
+	segments->size = 0;
+	segments->capacity = 0;
+}
+
+/*
+ * Sends as many queued segments as our friend has given us credit for
+ */
+static void flush_outgoing_segments(struct ToxExtensionMessages *extension,
+				    struct FriendData *friend_data,
+				    struct ToxExtPacketList *packet_list)
+{
+	struct OutgoingSegments *segments = &friend_data->outgoing_segments;
+
+	while (segments->size > 0) {
+		if (is_flow_controlled(friend_data)) {
+			if (friend_data->send_credit <= 0) {
+				break;
+			}
+			friend_data->send_credit--;
+		}
+
+		struct OutgoingSegment *segment =
+			&segments->segments[segments->begin];
+		append_segment(extension, friend_data->friend_id, packet_list,
+			       segment->data, segment->size);
+		segments->begin++;
+		segments->size--;
+	}
+
+	if (segments->size == 0) {
+		segments->begin = 0;
+	}
+}
+
+/*
+ * Either sends the segment immediately or queues it until we have credit.
+ * Space for the segment must have been reserved with
+ * reserve_outgoing_segments() beforehand
+ */
+static void send_segment(struct ToxExtensionMessages *extension,
+			 struct FriendData *friend_data,
+			 struct ToxExtPacketList *packet_list,
+			 uint8_t const *data, size_t size)
+{
+	struct OutgoingSegments *segments = &friend_data->outgoing_segments;
+
+	if (!is_flow_controlled(friend_data)) {
+		append_segment(extension, friend_data->friend_id, packet_list,
+			       data, size);
+		return;
+	}
+
+	/* Anything already queued has to go first to keep segments in order */
+	if (segments->size == 0 && friend_data->send_credit > 0) {
+		friend_data->send_credit--;
+		append_segment(extension, friend_data->friend_id, packet_list,
+			       data, size);
+		return;
+	}
+
+	assert(segments->begin + segments->size < segments->capacity);
+	struct OutgoingSegment *segment =
+		&segments->segments[segments->begin + segments->size];
+	memcpy(segment->data, data, size);
+	segment->size = size;
+	segments->size++;
+}
+
+/*
+ * Called for every data segment we process. Once half of the window has been
+ * consumed we hand the credit back to our friend in one go
+ */
+static void consume_credit(struct ToxExtensionMessages *extension,
+			   struct FriendData *friend_data,
+			   struct ToxExtPacketList *response_packet_list)
+{
+	if (friend_data->receive_window == 0 ||
+	    !friend_data->peer_supports_credit) {
+		return;
+	}
+
+	friend_data->consumed_segments++;
+
+	uint32_t threshold = (friend_data->receive_window + 1) / 2;
+	if (friend_data->consumed_segments < threshold) {
+		return;
+	}
+
+	uint8_t data[5];
+	data[0] = MESSAGE_CREDIT;
+	toxext_write_to_buf(friend_data->consumed_segments, data + 1, 4);
+	append_segment(extension, friend_data->friend_id, response_packet_list,
+		       data, 5);
+	friend_data->consumed_segments = 0;
+}
+
+static bool send_message_segments(struct ToxExtensionMessages *extension,
+				  struct FriendData *friend_data,
+				  struct ToxExtPacketList *packet_list,
+				  uint8_t const *data, size_t size,
+				  uint64_t receipt_id);
+
+static void release_held_messages(struct ToxExtensionMessages *extension,
+				  struct FriendData *friend_data,
+				  struct ToxExtPacketList *packet_list);
+
+static bool send_offer(struct ToxExtensionMessages *extension,
+		       struct FriendData *friend_data,
+		       struct ToxExtPacketList *packet_list)
+{
+	/* Offers take their turn in the credit queue like any other segment */
+	if (is_flow_controlled(friend_data) &&
+	    !reserve_outgoing_segments(&friend_data->outgoing_segments, 1)) {
+		return false;
+	}
+
+	struct PendingOffer const *pending_offer = &friend_data->pending_offer;
+	uint8_t data[17 + DIGEST_SIZE];
+	data[0] = MESSAGE_OFFER;
+	toxext_write_to_buf(pending_offer->receipt_id, data + 1, 8);
+	toxext_write_to_buf(pending_offer->content->size, data + 9, 8);
+	memcpy(data + 17, pending_offer->content->digest, DIGEST_SIZE);
+	send_segment(extension, friend_data, packet_list, data, sizeof(data));
+	return true;
+}
+
+/*
+ * Without a receipt the sender treats a message as lost, so a body we fail to
+ * queue is only noticed through tracked receipts timing out
+ */
+static void send_offered_body(struct ToxExtensionMessages *extension,
+			      struct FriendData *friend_data,
+			      struct ToxExtPacketList *packet_list)
+{
+	struct PendingOffer *pending_offer = &friend_data->pending_offer;
+	send_message_segments(extension, friend_data, packet_list,
+			      pending_offer->content->data,
+			      pending_offer->content->size,
+			      pending_offer->receipt_id);
+	clear_pending_offer(extension, friend_data);
+	release_held_messages(extension, friend_data, packet_list);
+}
+
+static void resend_pending_offer(struct ToxExtensionMessages *extension,
+				 struct FriendData *friend_data,
+				 struct ToxExtPacketList *packet_list)
+{
+	if (!friend_data->has_pending_offer) {
+		return;
+	}
+
+	/* If we can't queue it now it is offered again on the next connection */
+	if (friend_data->peer_features & NEGOTIATE_FEATURE_DEDUP) {
+		send_offer(extension, friend_data, packet_list);
+		return;
+	}
+
+	send_offered_body(extension, friend_data, packet_list);
+}
+
+static void send_receipt(struct ToxExtensionMessages *extension,
+			 uint32_t friend_id, uint64_t receipt_id,
+			 struct ToxExtPacketList *response_packet_list)
+{
+	uint8_t data[9];
+	data[0] = MESSAGE_RECEIVED;
+	toxext_write_to_buf(receipt_id, data + 1, 8);
+	append_segment(extension, friend_id, response_packet_list, data, 9);
+}
+
+static void send_request(struct ToxExtensionMessages *extension,
+			 uint32_t friend_id, uint64_t receipt_id,
+			 struct ToxExtPacketList *response_packet_list)
+{
+	uint8_t data[9];
+	data[0] = MESSAGE_REQUEST;
+	toxext_write_to_buf(receipt_id, data + 1, 8);
+	append_segment(extension, friend_id, response_packet_list, data, 9);
+}
+
+static void
+tox_extension_messages_handle_message_offer(
+	struct ToxExtensionMessages *extension, uint32_t friend_id,
+	struct MessagesPacket *parsed_packet, struct FriendData *friend_data,
+	struct ToxExtPacketList *response_packet_list)
+{
+	struct ContentCache *cache = &extension->content_cache;
+	struct CachedContent **hash_entry =
+		find_cached_content(cache, friend_id, parsed_packet->digest);
+
+	if (hash_entry &&
+	    (*hash_entry)->size == parsed_packet->total_message_size) {
+		struct CachedContent *content = *hash_entry;
+		lru_unlink(cache, content);
+		lru_push_front(cache, content);
+
+		if (!deliver_message(extension, friend_id,
+				     parsed_packet->receipt_id, content->data,
+				     content->size, NULL)) {
+			send_receipt(extension, friend_id,
+				     parsed_packet->receipt_id,
+				     response_packet_list);
+		}
+		return;
+	}
+
+	/* Forget the oldest request if our friend never sent the body */
+	if (friend_data->requested_digests_size == MAX_REQUESTED_DIGESTS) {
+		memmove(friend_data->requested_digests,
+			friend_data->requested_digests + 1,
+			(MAX_REQUESTED_DIGESTS - 1) *
+				sizeof(struct RequestedDigest));
+		friend_data->requested_digests_size--;
+	}
+
+	struct RequestedDigest *requested_digest =
+		&friend_data->requested_digests
+			 [friend_data->requested_digests_size++];
+	requested_digest->receipt_id = parsed_packet->receipt_id;
+	memcpy(requested_digest->digest, parsed_packet->digest, DIGEST_SIZE);
+
+	send_request(extension, friend_id, parsed_packet->receipt_id,
+		     response_packet_list);
+}
+
+static void
+tox_extension_messages_handle_message_request(
+	struct ToxExtensionMessages *extension,
+	struct MessagesPacket *parsed_packet, struct FriendData *friend_data,
+	struct ToxExtPacketList *response_packet_list)
+{
+	if (!find_pending_offer(friend_data, parsed_packet->receipt_id)) {
+		return;
+	}
+
+	send_offered_body(extension, friend_data, response_packet_list);
+}
+
+static struct RequestedDigest *
+find_requested_digest(struct FriendData *friend_data, uint64_t receipt_id)
+{
+	for (size_t i = 0; i < friend_data->requested_digests_size; ++i) {
+		if (friend_data->requested_digests[i].receipt_id == receipt_id) {
+			return &friend_data->requested_digests[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Caches a body we requested after an offer if it matches the digest we were
+ * offered. Takes ownership of message
+ */
+static void cache_requested_content(struct ToxExtensionMessages *extension,
+				    struct FriendData *friend_data,
+				    struct RequestedDigest *requested_digest,
+				    uint8_t *message, size_t size)
+{
+	uint8_t digest[DIGEST_SIZE];
+	sha256(message, size, digest);
+
+	if (memcmp(digest, requested_digest->digest, DIGEST_SIZE) == 0) {
+		insert_cached_content(&extension->content_cache,
+				      friend_data->friend_id, digest, message,
+				      size);
+	} else {
+		ext_free(message);
+	}
+
+	*requested_digest =
+		friend_data->requested_digests[--friend_data->requested_digests_size];
+}
+
+/*
+ * Anything our friend owed us credit for was lost with the old connection so
+ * we wait for its window again. The same goes for a message it was halfway
+ * through sending, its next segment starts a new message
+ */
+static void reset_connection(struct FriendData *friend_data)
+{
+	friend_data->peer_supports_credit = false;
+	friend_data->consumed_segments = 0;
+	friend_data->awaiting_negotiate = true;
+	friend_data->confirming_negotiate = false;
+	friend_data->requested_digests_size = 0;
+	clear_incoming_message(&friend_data->message);
+	friend_data->drop_incoming_message = false;
+}
+
+static void
+tox_extension_messages_handle_negotiate(struct ToxExtensionMessages *extension,
+					uint32_t friend_id,
+					struct MessagesPacket *parsed_packet,
+					struct FriendData *friend_data,
+					struct ToxExtPacketList *response_packet_list)
+{
+	/* A friend that comes back with another limit has started over */
+	if (friend_data->confirming_negotiate) {
+		friend_data->confirming_negotiate = false;
+
+		if (parsed_packet->max_sending_message_size !=
+		    friend_data->max_sending_size) {
+			reset_connection(friend_data);
+		}
+	}
+
+	friend_data->max_sending_size = parsed_packet->max_sending_message_size;
+	friend_data->peer_negotiated = true;
+	finish_bulk_negotiation(extension, friend_data, true);
+
+	if (parsed_packet->has_receive_window) {
+		/*
+		 * A friend may re-send its window while segments are in flight.
+		 * Only apply the difference so we don't hand ourselves credit for
+		 * segments that haven't been processed yet. Nothing was counted
+		 * while we weren't limited
+		 */
+		if (is_flow_controlled(friend_data)) {
+			friend_data->send_credit +=
+				(int64_t)parsed_packet->receive_window -
+				friend_data->send_window;
+		} else {
+			friend_data->send_credit =
+				parsed_packet->receive_window;
+		}
+		friend_data->send_window = parsed_packet->receive_window;
+	}
+	friend_data->peer_supports_credit = parsed_packet->has_receive_window;
+	friend_data->peer_features = parsed_packet->features;
+
+	flush_outgoing_segments(extension, friend_data, response_packet_list);
+
+	/*
+	 * Offers made over an old connection may never have arrived. Offer them
+	 * again, or send them in full if our friend lost interest in dedup
+	 */
+	if (friend_data->awaiting_negotiate) {
+		friend_data->awaiting_negotiate = false;
+		resend_pending_offer(extension, friend_data,
+				     response_packet_list);
+	}
+
+	extension->negotiated_cb(friend_id, true, friend_data->max_sending_size,
+				 extension->userdata);
+}
+
+bool tox_extension_copy_in_message_data(struct MessagesPacket *parsed_packet,
+					struct IncomingMessage *incoming_message)
+{
+	if (parsed_packet->message_size + incoming_message->size >
+	    incoming_message->capacity) {
+		/* FIXME: We should probably tell the sender that we dropped a message here */
+		clear_incoming_message(incoming_message);
+		return false;
+	}
+
+	uint8_t *dst = incoming_message->message + incoming_message->size;
+	if (incoming_message->checksum) {
+		incoming_message->crc = crc32c_copy(incoming_message->crc, dst,
+						    parsed_packet->message_data,
+						    parsed_packet->message_size);
+	} else {
+		memcpy(dst, parsed_packet->message_data,
+		       parsed_packet->message_size);
+	}
+	incoming_message->size += parsed_packet->message_size;
+	return true;
+}
+
+void tox_extension_messages_handle_message_start(
+	struct ToxExtensionMessages *extension,
+	struct MessagesPacket *parsed_packet, struct FriendData *friend_data)
+{
+	struct IncomingMessage *incoming_message = &friend_data->message;
+
+	if (get_friend_max_receiving_size(extension, friend_data) <
+	    parsed_packet->total_message_size) {
+		friend_data->drop_incoming_message = true;
+		report_drop(extension, friend_data->friend_id,
+			    TOX_EXTENSION_MESSAGES_DROP_TOO_LARGE);
+		return;
+	}
+
+	/*
+		* realloc here instead of malloc because we may have dropped half a message
+		* if a user went offline half way through sending
+		*/
+	uint8_t *resized_message = ext_realloc(incoming_message->message,
+					   parsed_packet->total_message_size);
+
+	if (!resized_message) {
+		/* FIXME: We should probably tell the sender that we dropped a message here */
+		clear_incoming_message(incoming_message);
+		friend_data->drop_incoming_message = true;
+		report_drop(extension, friend_data->friend_id,
+			    TOX_EXTENSION_MESSAGES_DROP_ALLOCATION_FAILED);
+		return;
+	}
+
+	incoming_message->message = resized_message;
+	incoming_message->size = 0;
+	incoming_message->capacity = parsed_packet->total_message_size;
+	incoming_message->checksum =
+		(extension->features & NEGOTIATE_FEATURE_CHECKSUM) &&
+		(friend_data->peer_features & NEGOTIATE_FEATURE_CHECKSUM);
+	incoming_message->crc = CRC32C_INIT;
+
+	/*
+	 * If we never got a finish packet we should still do our best to parse the
+	 * next message. This means we need to reset the drop state as well
+	 */
+	friend_data->drop_incoming_message = false;
+
+	if (!tox_extension_copy_in_message_data(parsed_packet,
+						incoming_message)) {
+		friend_data->drop_incoming_message = true;
+		report_drop(extension, friend_data->friend_id,
+			    TOX_EXTENSION_MESSAGES_DROP_MALFORMED);
+	}
+}
+
+void tox_extension_messages_handle_message_finish(
+	struct ToxExtensionMessages *extension, uint32_t friend_id,
+	struct MessagesPacket *parsed_packet, struct FriendData *friend_data,
+	struct ToxExtPacketList *response_packet_list)
+{
+	struct IncomingMessage *incoming_message = &friend_data->message;
+	uint8_t const* message = NULL;
+	size_t size = 0;
+	uint32_t crc = CRC32C_INIT;
+
+	bool end_of_dropped_message = friend_data->drop_incoming_message;
+	friend_data->drop_incoming_message = false;
+
+	if (end_of_dropped_message) {
+		/* Already reported when we started dropping */
+		clear_incoming_message(incoming_message);
+		return;
+	}
+
+	/* We can skip the allocate/memcpy here */
+	if (incoming_message->size == 0) {
+		message = parsed_packet->message_data;
+		size = parsed_packet->message_size;
+		if (parsed_packet->message_type == MESSAGE_FINISH_CHECKSUM) {
+			crc = crc32c_copy(CRC32C_INIT, NULL, message, size);
+		}
+	}
+	else {
+		if (!tox_extension_copy_in_message_data(parsed_packet,
+							incoming_message)) {
+			report_drop(extension, friend_id,
+				    TOX_EXTENSION_MESSAGES_DROP_MALFORMED);
+			return;
+		}
+		message = incoming_message->message;
+		size = incoming_message->size;
+
+		/*
+		 * We didn't expect a checksum when the message started, e.g.
+		 * because it was restored from savedata. Fall back to a full pass
+		 */
+		if (parsed_packet->message_type == MESSAGE_FINISH_CHECKSUM) {
+			crc = incoming_message->checksum ?
+				      incoming_message->crc :
+				      crc32c_copy(CRC32C_INIT, NULL, message,
+						  size);
+		}
+	}
+
+	if (get_friend_max_receiving_size(extension, friend_data) < size) {
+		/* FIXME: We should probably tell the sender that we dropped a message here */
+		clear_incoming_message(incoming_message);
+		report_drop(extension, friend_id,
+			    TOX_EXTENSION_MESSAGES_DROP_TOO_LARGE);
+		return;
+	}
+
+	if (parsed_packet->message_type == MESSAGE_FINISH_CHECKSUM &&
+	    (crc ^ CRC32C_INIT) != parsed_packet->crc) {
+		/* No receipt, as far as the sender is concerned it never arrived */
+		clear_incoming_message(incoming_message);
+		report_drop(extension, friend_id,
+			    TOX_EXTENSION_MESSAGES_DROP_CHECKSUM_MISMATCH);
+		return;
+	}
+
+	struct RequestedDigest *requested_digest =
+		find_requested_digest(friend_data, parsed_packet->receipt_id);
+
+	/* The content cache gets the reassembly buffer if we asked for this */
+	bool receipt_deferred = deliver_message(
+		extension, friend_id, parsed_packet->receipt_id, message, size,
+		requested_digest ? NULL : incoming_message);
+
+	if (!receipt_deferred) {
+		send_receipt(extension, friend_id, parsed_packet->receipt_id,
+			     response_packet_list);
+	}
+
+	if (requested_digest) {
+		/* Hand the reassembly buffer over rather than copying it */
+		uint8_t *owned_message = NULL;
+		if (incoming_message->size == 0) {
+			owned_message = ext_malloc(size ? size : 1);
+			if (owned_message) {
+				memcpy(owned_message, message, size);
+			}
+		} else {
+			owned_message = incoming_message->message;
+			incoming_message->message = NULL;
+		}
+
+		if (owned_message) {
+			cache_requested_content(extension, friend_data,
+						requested_digest, owned_message,
+						size);
+		}
+	}
+
+	clear_incoming_message(incoming_message);
+}
+
+void tox_extension_messages_handle_message_part(
+	struct ToxExtensionMessages *extension,
+	struct MessagesPacket *parsed_packet, struct FriendData *friend_data)
+{
+	struct IncomingMessage *incoming_message = &friend_data->message;
+
+	if (friend_data->drop_incoming_message) {
+		/* FIXME: We should probably tell the sender that we dropped a message here */
+		clear_incoming_message(incoming_message);
+		return;
+	}
+
+	/*
+	 * Make sure the rest of the message is dropped as well, otherwise the
+	 * finish packet would be mistaken for a complete message
+	 */
+	if (!tox_extension_copy_in_message_data(parsed_packet,
+						incoming_message)) {
+		friend_data->drop_incoming_message = true;
+		report_drop(extension, friend_data->friend_id,
+			    TOX_EXTENSION_MESSAGES_DROP_MALFORMED);
+	}
+}
+
+/*
+ * Drops a segment that went over the rate limits. The message it belongs to
+ * can't be completed any more so it goes as well
+ */
+static void
+drop_rate_limited_segment(struct ToxExtensionMessages *extension,
+			  struct FriendData *friend_data, uint8_t const *data,
+			  size_t size,
+			  enum Tox_Extension_Messages_Drop_Reason reason,
+			  struct ToxExtPacketList *response_packet_list)
+{
+	struct MessagesPacket parsed_packet;
+
+	switch (get_segment_type(data, size)) {
+	case MESSAGE_START:
+	case MESSAGE_PART:
+		clear_incoming_message(&friend_data->message);
+		friend_data->drop_incoming_message = true;
+		consume_credit(extension, friend_data, response_packet_list);
+		break;
+	case MESSAGE_FINISH:
+	case MESSAGE_FINISH_CHECKSUM:
+		clear_incoming_message(&friend_data->message);
+		friend_data->drop_incoming_message = false;
+		/* Our friend still paid credit for these */
+		consume_credit(extension, friend_data, response_packet_list);
+		break;
+	case MESSAGE_OFFER:
+		/*
+		 * Our friend holds everything after an offer back until we
+		 * answer it. Ask for the body, which is limited like any other
+		 * message, rather than stalling it
+		 */
+		consume_credit(extension, friend_data, response_packet_list);
+		if (parse_messages_packet(data, size, &parsed_packet)) {
+			send_request(extension, friend_data->friend_id,
+				     parsed_packet.receipt_id,
+				     response_packet_list);
+		}
+		return;
+	}
+
+	report_drop(extension, friend_data->friend_id, reason);
+}
+
+static void
+tox_extension_messages_recv(struct ToxExtExtension *extension,
+			    uint32_t friend_id, void const *data, size_t size,
+			    void *userdata,
+			    struct ToxExtPacketList *response_packet_list)
 {
 	(void)extension;
 	struct ToxExtensionMessages *ext_messages = userdata;
+
+	if (ext_messages->trace_cb) {
+		ext_messages->trace_cb(friend_id,
+				       TOX_EXTENSION_MESSAGES_TRACE_INBOUND,
+				       data, size, ext_messages->trace_userdata);
+	}
+
+	struct FriendData *friend_data = get_friend_data(ext_messages, friend_id);
+	struct RateLimiter new_limiter = { .initialized = false };
+	struct RateLimiter *limiter =
+		friend_data ? &friend_data->rate_limiter : &new_limiter;
+
+	enum Tox_Extension_Messages_Drop_Reason rate_limit_reason;
+	if (!check_rate_limits(ext_messages,
+			       get_friend_rate_limits(ext_messages, friend_data),
+			       limiter, data, size, &rate_limit_reason)) {
+		if (friend_data) {
+			drop_rate_limited_segment(ext_messages, friend_data,
+						  data, size, rate_limit_reason,
+						  response_packet_list);
+		} else {
+			/* Nothing to clean up, it has no state with us yet */
+			report_drop(ext_messages, friend_id, rate_limit_reason);
+		}
+		return;
+	}
+
+	/*
+	 * A friend that restored its state from savedata may send to us before
+	 * we have negotiated with it. It only gets a slot once its segment got
+	 * past the limits
+	 */
+	if (!friend_data) {
+		friend_data = get_or_insert_friend_data(ext_messages, friend_id);
+
+		if (!friend_data) {
+			return;
+		}
+
+		friend_data->rate_limiter = new_limiter;
+	}
+
+	struct MessagesPacket parsed_packet;
+	if (!parse_messages_packet(data, size, &parsed_packet)) {
+		/* FIXME: We should probably tell the sender that they gave us invalid data here */
+		clear_incoming_message(&friend_data->message);
+		report_drop(ext_messages, friend_id,
+			    TOX_EXTENSION_MESSAGES_DROP_MALFORMED);
+		/* It's gone either way, our friend shouldn't stall over it */
+		if (is_credited_segment(get_segment_type(data, size))) {
+			consume_credit(ext_messages, friend_data,
+				       response_packet_list);
+		}
+		return;
+	}
+
+	switch (parsed_packet.message_type) {
+	case MESSAGE_NEGOTIATE:
+		tox_extension_messages_handle_negotiate(
+			ext_messages, friend_id, &parsed_packet, friend_data,
+			response_packet_list);
+		return;
+	case MESSAGE_START:
+		tox_extension_messages_handle_message_start(
+			ext_messages, &parsed_packet, friend_data);
+		consume_credit(ext_messages, friend_data, response_packet_list);
+		return;
+	case MESSAGE_PART: {
+		tox_extension_messages_handle_message_part(
+			ext_messages, &parsed_packet, friend_data);
+		consume_credit(ext_messages, friend_data, response_packet_list);
+		return;
+	}
+	case MESSAGE_FINISH:
+	case MESSAGE_FINISH_CHECKSUM:
+		tox_extension_messages_handle_message_finish(
+			ext_messages, friend_id, &parsed_packet, friend_data,
+			response_packet_list);
+		consume_credit(ext_messages, friend_data, response_packet_list);
+		return;
+	case MESSAGE_RECEIVED: {
+		/* Our friend had the offered message already */
+		if (find_pending_offer(friend_data, parsed_packet.receipt_id)) {
+			clear_pending_offer(ext_messages, friend_data);
+			release_held_messages(ext_messages, friend_data,
+					      response_packet_list);
+		}
+
+		ext_messages->receipt_cb(friend_id, parsed_packet.receipt_id,
+					 ext_messages->userdata);
+
+		struct PendingReceipt **pending_receipt = find_pending_receipt(
+			&ext_messages->receipts, friend_id,
+			parsed_packet.receipt_id);
+		if (pending_receipt) {
+			complete_receipt(
+				ext_messages, pending_receipt,
+				TOX_EXTENSION_MESSAGES_RECEIPT_DELIVERED);
+		}
+		return;
+	}
+	case MESSAGE_CREDIT:
+		friend_data->send_credit += parsed_packet.credit;
+		flush_outgoing_segments(ext_messages, friend_data,
+					response_packet_list);
+		return;
+	case MESSAGE_OFFER:
+		tox_extension_messages_handle_message_offer(
+			ext_messages, friend_id, &parsed_packet, friend_data,
+			response_packet_list);
+		consume_credit(ext_messages, friend_data, response_packet_list);
+		return;
+	case MESSAGE_REQUEST:
+		tox_extension_messages_handle_message_request(
+			ext_messages, &parsed_packet, friend_data,
+			response_packet_list);
+		return;
+	}
+}
+
+static void
+tox_extension_messages_neg(struct ToxExtExtension *extension,
+			   uint32_t friend_id, bool compatible, void *userdata,
+			   struct ToxExtPacketList *response_packet_list)
+{
+	(void)extension;
+	struct ToxExtensionMessages *ext_messages = userdata;
+
+	struct FriendData *friend_data =
+		get_or_insert_friend_data(ext_messages, friend_id);
+
+	/*
+	 * Negotiating again with a friend we're already negotiated with doesn't
+	 * mean the connection changed, retries do the same. Dropping its
+	 * messages and credit then would stall it, so we wait for its negotiate
+	 * packet to tell
+	 */
+	if (friend_data) {
+		if (compatible && friend_data->peer_negotiated) {
+			friend_data->confirming_negotiate = true;
+		} else {
+			reset_connection(friend_data);
+		}
+	}
+
+	if (!compatible) {
+		if (friend_data) {
+			friend_data->peer_negotiated = false;
+			finish_bulk_negotiation(ext_messages, friend_data,
+						false);
+			/* A friend that negotiated before has gone away */
+			restart_bulk_negotiation(ext_messages, friend_data);
+		}
+		ext_messages->negotiated_cb(friend_id, compatible, 0,
+					    ext_messages->userdata);
+	} else {
+		/*
+		 * Do not call the negotiation callback yet. We need to continue with
+		 * our own internal negotiation of max message size. We consider
+		 * ourselves negotiated when our peer has told us what their max packet
+		 * size is
+		 */
+		tox_extension_messages_negotiate_size(ext_messages, friend_id,
+						      response_packet_list);
+	}
+}
+
+struct ToxExtensionMessages *
+tox_extension_messages_register(struct ToxExt *toxext,
+				tox_extension_messages_received_cb cb,
+				tox_extension_messages_receipt_cb receipt_cb,
+				tox_extension_messages_negotiate_cb neg_cb,
+				void *userdata, uint64_t max_receive_size)
+{
+	assert(cb);
+
+	struct ToxExtensionMessages *extension =
+		ext_malloc(sizeof(struct ToxExtensionMessages));
+
+	if (!extension) {
+		return NULL;
+	}
+
+	extension->toxext = toxext;
+	extension->extension_handle =
+		toxext_register(toxext, uuid, extension,
+				tox_extension_messages_recv,
+				tox_extension_messages_neg);
+	extension->friend_datas = NULL;
+	extension->friend_datas_size = 0;
+	extension->next_receipt_id = 0;
+	extension->cb = cb;
+	extension->receipt_cb = receipt_cb;
+	extension->negotiated_cb = neg_cb;
+	extension->userdata = userdata;
+	extension->max_receiving_message_size = max_receive_size;
+	extension->receive_window = 0;
+	extension->max_pending_segments = 0;
+	extension->clock_cb = NULL;
+	extension->clock_userdata = NULL;
+	memset(&extension->receipts, 0, sizeof(struct ReceiptTracker));
+	extension->features = 0;
+	extension->dedup_min_message_size = 0;
+	memset(&extension->content_cache, 0, sizeof(struct ContentCache));
+	extension->offered_contents = NULL;
+	extension->dropped_cb = NULL;
+	extension->trace_cb = NULL;
+	extension->trace_userdata = NULL;
+	memset(&extension->delivery, 0, sizeof(struct Delivery));
+	extension->has_rate_limits = false;
+	memset(&extension->rate_limits, 0,
+	       sizeof(struct Tox_Extension_Messages_Rate_Limits));
+	memset(&extension->bulk_negotiation, 0, sizeof(struct BulkNegotiation));
+	extension->bulk_negotiation.pacing.negotiations_per_second =
+		TOX_EXTENSION_MESSAGES_DEFAULT_NEGOTIATIONS_PER_SECOND;
+	extension->bulk_negotiation.pacing.retry_ms =
+		TOX_EXTENSION_MESSAGES_DEFAULT_NEGOTIATION_RETRY_MS;
+	extension->bulk_negotiation.pacing.max_attempts =
+		TOX_EXTENSION_MESSAGES_DEFAULT_NEGOTIATION_ATTEMPTS;
+
+	if (!extension->extension_handle) {
+		ext_free(extension);
+		return NULL;
+	}
+
+	return extension;
+}
+
+void tox_extension_messages_free(struct ToxExtensionMessages *extension)
+{
+	for (size_t i = 0; i < extension->friend_datas_size; ++i) {
+		struct FriendData *friend_data = extension->friend_datas[i];
+		ext_free(friend_data->message.message);
+		clear_outgoing_segments(&friend_data->outgoing_segments);
+		clear_pending_offer(extension, friend_data);
+		clear_held_messages(&friend_data->held_messages);
+		ext_free(friend_data);
+	}
+	ext_free(extension->friend_datas);
+	free_receipt_tracker(&extension->receipts);
+	free_content_cache(&extension->content_cache);
+	ext_free(extension->bulk_negotiation.queue);
+	ext_free(extension->bulk_negotiation.in_flight);
+	ext_free(extension);
+}
+
+void tox_extension_messages_negotiate(struct ToxExtensionMessages *extension,
+				      uint32_t friend_id)
+{
+	toxext_negotiate_connection(extension->extension_handle, friend_id);
+}
+
+/*
+ * Writes the next segment of a message to extension_data. If crc is set the
+ * message is finished with a MESSAGE_FINISH_CHECKSUM and crc is updated with
+ * every chunk, it must start out as CRC32C_INIT
+ */
+static uint8_t const *
+tox_extension_messages_chunk(bool first_chunk, uint8_t const *data, size_t size,
+			     uint64_t receipt_id, uint32_t *crc,
+			     uint8_t *extension_data, size_t *output_size)
+{
+	uint8_t const *ret;
+	size_t finish_header_size = crc ? 13 : 9;
+	bool last_chunk = size <= TOXEXT_MAX_SEGMENT_SIZE - finish_header_size;
+	size_t header_size;
+	size_t advance_size;
+
+	if (last_chunk) {
+		header_size = finish_header_size;
+		advance_size = size;
+	} else if (first_chunk) {
+		extension_data[0] = MESSAGE_START;
+		toxext_write_to_buf(size, extension_data + 1, 8);
+		header_size = 9;
+		advance_size = TOXEXT_MAX_SEGMENT_SIZE - 9;
+	} else {
+		extension_data[0] = MESSAGE_PART;
+		header_size = 1;
+		advance_size = TOXEXT_MAX_SEGMENT_SIZE - 1;
+	}
+
+	if (crc) {
+		*crc = crc32c_copy(*crc, extension_data + header_size, data,
+				   advance_size);
+	} else {
+		memcpy(extension_data + header_size, data, advance_size);
+	}
+
+	/* The finish header can only be written once the crc covers everything */
+	if (last_chunk) {
+		extension_data[0] = crc ? MESSAGE_FINISH_CHECKSUM : MESSAGE_FINISH;
+		toxext_write_to_buf(receipt_id, extension_data + 1, 8);
+		if (crc) {
+			toxext_write_to_buf(*crc ^ CRC32C_INIT,
+					    extension_data + 9, 4);
+		}
+	}
+
+	*output_size = header_size + advance_size;
+	ret = data + advance_size;
+
+	return ret;
+}
+
+static bool send_message_segments(struct ToxExtensionMessages *extension,
+				  struct FriendData *friend_data,
+				  struct ToxExtPacketList *packet_list,
+				  uint8_t const *data, size_t size,
+				  uint64_t receipt_id)
+{
+	/*
+	 * Reserve queue space for the whole message up front so we never have to
+	 * give up half way through chunking it
+	 */
+	if (is_flow_controlled(friend_data) &&
+	    !reserve_outgoing_segments(
+		    &friend_data->outgoing_segments,
+		    max_segments_for_size(size))) {
+		return false;
+	}
+
+	bool checksum = (extension->features & NEGOTIATE_FEATURE_CHECKSUM) &&
+			(friend_data->peer_features & NEGOTIATE_FEATURE_CHECKSUM);
+	uint32_t crc = CRC32C_INIT;
+
+	uint8_t const *end = data + size;
+	uint8_t const *next_chunk = data;
+	bool first_chunk = true;
+	do {
+		uint8_t extension_data[TOXEXT_MAX_SEGMENT_SIZE];
+		size_t size_for_chunk;
+		next_chunk = tox_extension_messages_chunk(
+			first_chunk, next_chunk, end - next_chunk, receipt_id,
+			checksum ? &crc : NULL, extension_data,
+			&size_for_chunk);
+		first_chunk = false;
+
+		send_segment(extension, friend_data, packet_list,
+			     extension_data, size_for_chunk);
+	} while (end > next_chunk);
+
+	return true;
+}
+
+static bool should_offer(struct ToxExtensionMessages *extension,
+			 struct FriendData *friend_data, size_t size)
+{
+	return (extension->features & NEGOTIATE_FEATURE_DEDUP) &&
+	       (friend_data->peer_features & NEGOTIATE_FEATURE_DEDUP) &&
+	       size >= extension->dedup_min_message_size;
+}
+
+/*
+ * Sends the digest of the message instead of the message. We hold on to the
+ * body until our friend tells us whether it needs it
+ */
+static bool offer_message(struct ToxExtensionMessages *extension,
+			  struct FriendData *friend_data,
+			  struct ToxExtPacketList *packet_list,
+			  uint8_t const *data, size_t size, uint64_t receipt_id)
+{
+	struct OfferedContent *content =
+		get_offered_content(extension, data, size);
+
+	if (!content) {
+		return false;
+	}
+
+	friend_data->pending_offer.receipt_id = receipt_id;
+	friend_data->pending_offer.content = content;
+
+	if (!send_offer(extension, friend_data, packet_list)) {
+		put_offered_content(extension, content);
+		return false;
+	}
+
+	friend_data->has_pending_offer = true;
+	return true;
+}
+
+/*
+ * Sends what was held back behind an offer, up to the next message that is
+ * offered itself. Anything we fail to queue stays held for the next attempt
+ */
+static void release_held_messages(struct ToxExtensionMessages *extension,
+				  struct FriendData *friend_data,
+				  struct ToxExtPacketList *packet_list)
+{
+	struct HeldMessages *held = &friend_data->held_messages;
+
+	while (held->size > 0 && !friend_data->has_pending_offer) {
+		struct HeldMessage *message = &held->messages[held->begin];
+
+		bool sent;
+		if (should_offer(extension, friend_data, message->size)) {
+			sent = offer_message(extension, friend_data,
+					     packet_list, message->data,
+					     message->size,
+					     message->receipt_id);
+		} else {
+			sent = send_message_segments(extension, friend_data,
+						     packet_list, message->data,
+						     message->size,
+						     message->receipt_id);
+		}
+
+		if (!sent) {
+			break;
+		}
+
+		ext_free(message->data);
+
+		held->segments -= max_segments_for_size(message->size);
+		held->begin++;
+		held->size--;
+	}
+
+	if (held->size == 0) {
+		held->begin = 0;
+	}
+}
+
+uint64_t tox_extension_messages_append(struct ToxExtensionMessages *extension,
+				       struct ToxExtPacketList *packet_list,
+				       uint8_t const *data, size_t size,
+				       uint32_t friend_id,
+				       enum Tox_Extension_Messages_Error *err)
+{
+	enum Tox_Extension_Messages_Error get_max_err;
+	uint64_t max_sending_size = tox_extension_messages_get_max_sending_size(
+		extension, friend_id, &get_max_err);
+	if (get_max_err != TOX_EXTENSION_MESSAGES_SUCCESS ||
+	    size > max_sending_size) {
+		prioritize_negotiation(extension, friend_id);
+		if (err) {
+			*err = TOX_EXTENSION_MESSAGES_INVALID_ARG;
+		}
+		return -1;
+	}
+
+	struct FriendData *friend_data = get_friend_data(extension, friend_id);
+
+	/* Let the caller back off instead of queueing without bound */
+	if (extension->max_pending_segments != 0 &&
+	    get_pending_segments(friend_data) >=
+		    extension->max_pending_segments) {
+		if (err) {
+			*err = TOX_EXTENSION_MESSAGES_WOULD_BLOCK;
+		}
+		return -1;
+	}
+
+	uint64_t receipt_id = extension->next_receipt_id;
+
+	bool sent;
+	if (friend_data->has_pending_offer ||
+	    friend_data->held_messages.size > 0) {
+		/* Anything sent now would overtake the offered message */
+		sent = hold_message(friend_data, data, size, receipt_id);
+		release_held_messages(extension, friend_data, packet_list);
+	} else if (should_offer(extension, friend_data, size)) {
+		sent = offer_message(extension, friend_data, packet_list, data,
+				     size, receipt_id);
+	} else {
+		sent = send_message_segments(extension, friend_data,
+					     packet_list, data, size,
+					     receipt_id);
+	}
+
+	if (!sent) {
+		if (err) {
+			*err = TOX_EXTENSION_MESSAGES_INVALID_ARG;
+		}
+		return -1;
+	}
+
+	extension->next_receipt_id++;
+
+	if (err) {
+		*err = TOX_EXTENSION_MESSAGES_SUCCESS;
+	}
+	return receipt_id;
+}
+
+uint64_t tox_extension_messages_append_tracked(
+	struct ToxExtensionMessages *extension,
+	struct ToxExtPacketList *packet_list, uint8_t const *data, size_t size,
+	uint32_t friend_id, uint64_t timeout, void *context,
+	enum Tox_Extension_Messages_Error *err)
+{
+	if (!extension->receipts.enabled) {
+		if (err) {
+			*err = TOX_EXTENSION_MESSAGES_INVALID_ARG;
+		}
+		return -1;
+	}
+
+	/*
+	 * Make sure the receipt can be tracked before anything is sent, otherwise
+	 * the caller would never hear about a message that did go out
+	 */
+	struct ReceiptTracker *tracker = &extension->receipts;
+	struct PendingReceipt *pending_receipt =
+		ext_malloc(sizeof(struct PendingReceipt));
+
+	if (!pending_receipt || (tracker->size >= tracker->bucket_count &&
+				 !grow_receipt_buckets(tracker))) {
+		ext_free(pending_receipt);
+		if (err) {
+			*err = TOX_EXTENSION_MESSAGES_INVALID_ARG;
+		}
+		return -1;
+	}
+
+	enum Tox_Extension_Messages_Error append_err;
+	uint64_t receipt_id = tox_extension_messages_append(
+		extension, packet_list, data, size, friend_id, &append_err);
+
+	if (append_err != TOX_EXTENSION_MESSAGES_SUCCESS) {
+		ext_free(pending_receipt);
+		if (err) {
+			*err = append_err;
+		}
+		return -1;
+	}
+
+	pending_receipt->friend_id = friend_id;
+	pending_receipt->receipt_id = receipt_id;
+	pending_receipt->deadline = get_current_time(extension) + timeout;
+	pending_receipt->context = context;
+	track_receipt(tracker, pending_receipt);
+
+	if (err) {
+		*err = TOX_EXTENSION_MESSAGES_SUCCESS;
+	}
+	return receipt_id;
+}
+
+void tox_extension_messages_enable_receipt_tracking(
+	struct ToxExtensionMessages *extension,
+	tox_extension_messages_completion_cb completion_cb)
+{
+	assert(completion_cb);
+
+	struct ReceiptTracker *tracker = &extension->receipts;
+	tracker->enabled = true;
+	tracker->completion_cb = completion_cb;
+	tracker->wheel.next_tick = get_current_time(extension);
+}
+
+void tox_extension_messages_set_clock(struct ToxExtensionMessages *extension,
+				      tox_extension_messages_clock_cb clock_cb,
+				      void *clock_userdata)
+{
+	uint64_t old_now = get_current_time(extension);
+	extension->clock_cb = clock_cb;
+	extension->clock_userdata = clock_userdata;
+	uint64_t new_now = get_current_time(extension);
+
+	/*
+	 * The old clock may be on a completely different timeline. Whatever is
+	 * waiting keeps the time it had left and token buckets refill from now
+	 */
+	rebase_receipt_deadlines(&extension->receipts, old_now, new_now);
+
+	struct BulkNegotiation *bulk = &extension->bulk_negotiation;
+	for (size_t i = 0; i < bulk->in_flight_size; ++i) {
+		struct InFlightNegotiation *attempt =
+			&bulk->in_flight[(bulk->in_flight_begin + i) &
+					 (bulk->in_flight_capacity - 1)];
+		attempt->deadline =
+			rebase_deadline(attempt->deadline, old_now, new_now);
+	}
+	bulk->tokens.last_refill = new_now;
+
+	for (size_t i = 0; i < extension->friend_datas_size; ++i) {
+		struct RateLimiter *limiter =
+			&extension->friend_datas[i]->rate_limiter;
+		limiter->segments.last_refill = new_now;
+		limiter->bytes.last_refill = new_now;
+		limiter->starts.last_refill = new_now;
+	}
+}
+
+void tox_extension_messages_iterate(struct ToxExtensionMessages *extension)
+{
+	if (extension->receipts.enabled) {
+		process_receipt_timeouts(extension,
+					 get_current_time(extension));
+	}
+
+	struct BulkNegotiation *bulk = &extension->bulk_negotiation;
+	if (bulk->queue_size > 0 || bulk->in_flight_size > 0) {
+		process_bulk_negotiation(extension, get_current_time(extension));
+	}
+}
+
+void tox_extension_messages_set_negotiation_pacing(
+	struct ToxExtensionMessages *extension,
+	struct Tox_Extension_Messages_Negotiation_Pacing const *pacing)
+{
+	extension->bulk_negotiation.pacing = *pacing;
+}
+
+void tox_extension_messages_negotiate_bulk(
+	struct ToxExtensionMessages *extension,
+	struct Tox_Extension_Messages_Negotiation_Request const *requests,
+	size_t count, enum Tox_Extension_Messages_Error *err)
+{
+	if (!reserve_negotiation_queue(&extension->bulk_negotiation, count)) {
+		if (err) {
+			*err = TOX_EXTENSION_MESSAGES_INVALID_ARG;
+		}
+		return;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		struct FriendData *friend_data = get_or_insert_friend_data(
+			extension, requests[i].friend_id);
+
+		if (!friend_data) {
+			if (err) {
+				*err = TOX_EXTENSION_MESSAGES_INVALID_ARG;
+			}
+			return;
+		}
+
+		friend_data->negotiation_priority = requests[i].priority;
+
+		switch (friend_data->negotiation_state) {
+		case BULK_NEGOTIATION_IN_FLIGHT:
+			/* A retry is queued with the new priority */
+			continue;
+		case BULK_NEGOTIATION_NEGOTIATED:
+			/* As is a friend that went away and has to renegotiate */
+			continue;
+		case BULK_NEGOTIATION_NONE:
+		case BULK_NEGOTIATION_FAILED:
+			friend_data->negotiation_attempts = 0;
+			break;
+		case BULK_NEGOTIATION_QUEUED:
+			break;
+		}
+
+		if (friend_data->peer_negotiated) {
+			set_negotiation_state(extension, friend_data,
+					      BULK_NEGOTIATION_NEGOTIATED);
+			continue;
+		}
+
+		set_negotiation_state(extension, friend_data,
+				      BULK_NEGOTIATION_QUEUED);
+		queue_negotiation(extension, friend_data);
+	}
+
+	/* The first burst doesn't have to wait for the next iterate */
+	process_bulk_negotiation(extension, get_current_time(extension));
+
+	if (err) {
+		*err = TOX_EXTENSION_MESSAGES_SUCCESS;
+	}
+}
+
+void tox_extension_messages_get_negotiation_progress(
+	struct ToxExtensionMessages const *extension,
+	struct Tox_Extension_Messages_Negotiation_Progress *progress)
+{
+	*progress = extension->bulk_negotiation.progress;
+}
+
+void tox_extension_messages_enable_dedup(
+	struct ToxExtensionMessages *extension, size_t cache_size,
+	size_t min_message_size)
+{
+	if (min_message_size == 0) {
+		min_message_size =
+			TOX_EXTENSION_MESSAGES_DEFAULT_DEDUP_MIN_MESSAGE_SIZE;
+	}
+
+	extension->features |= NEGOTIATE_FEATURE_DEDUP;
+	extension->content_cache.capacity = cache_size;
+	extension->dedup_min_message_size =
+		min_message_size > DEDUP_SINGLE_SEGMENT_SIZE ?
+			min_message_size :
+			DEDUP_SINGLE_SEGMENT_SIZE;
+}
+
+void tox_extension_messages_enable_checksums(
+	struct ToxExtensionMessages *extension)
+{
+	extension->features |= NEGOTIATE_FEATURE_CHECKSUM;
+}
+
+void tox_extension_messages_set_dropped_cb(
+	struct ToxExtensionMessages *extension,
+	tox_extension_messages_dropped_cb dropped_cb)
+{
+	extension->dropped_cb = dropped_cb;
+}
+
+void tox_extension_messages_set_trace_cb(
+	struct ToxExtensionMessages *extension,
+	tox_extension_messages_trace_cb trace_cb, void *trace_user_data)
+{
+	extension->trace_cb = trace_cb;
+	extension->trace_userdata = trace_user_data;
+}
+
+/*
+ * Applies a changed receive limit to friend_data and tells our friend about
+ * it. A message in progress that no longer fits is dropped straight away
+ * rather than when it finishes so its buffer is freed now
+ */
+/*
+ * Tells a friend about changes to what we negotiated with it. Friends we haven't
+ * negotiated with yet hear about them when we do
+ */
+static void renegotiate(struct ToxExtensionMessages *extension,
+			struct FriendData *friend_data)
+{
+	if (!friend_data->peer_negotiated) {
+		return;
+	}
+
+	struct ToxExtPacketList *packet_list = toxext_packet_list_create(
+		extension->toxext, friend_data->friend_id);
+
+	if (!packet_list) {
+		return;
+	}
+
+	tox_extension_messages_negotiate_size(
+		extension, friend_data->friend_id, packet_list);
+	toxext_send(packet_list);
+}
+
+static void apply_max_receiving_size(struct ToxExtensionMessages *extension,
+				     struct FriendData *friend_data)
+{
+	struct IncomingMessage *incoming_message = &friend_data->message;
+	bool delivering = extension->delivery.active &&
+			  extension->delivery.incoming_message ==
+				  incoming_message;
+
+	if (!delivering &&
+	    incoming_message->capacity >
+		    get_friend_max_receiving_size(extension, friend_data)) {
+		clear_incoming_message(incoming_message);
+		friend_data->drop_incoming_message = true;
+		report_drop(extension, friend_data->friend_id,
+			    TOX_EXTENSION_MESSAGES_DROP_TOO_LARGE);
+	}
+
+	renegotiate(extension, friend_data);
+}
+
+void tox_extension_messages_set_max_receiving_size(
+	struct ToxExtensionMessages *extension, uint64_t max_receive_size)
+{
+	extension->max_receiving_message_size = max_receive_size;
+
+	for (size_t i = 0; i < extension->friend_datas_size; ++i) {
+		struct FriendData *friend_data = extension->friend_datas[i];
+
+		if (!friend_data->has_max_receiving_size) {
+			apply_max_receiving_size(extension, friend_data);
+		}
+	}
+}
+
+void tox_extension_messages_set_friend_max_receiving_size(
+	struct ToxExtensionMessages *extension, uint32_t friend_id,
+	uint64_t max_receive_size, enum Tox_Extension_Messages_Error *err)
+{
 	struct FriendData *friend_data =
-		get_friend_data(ext_messages, friend_id);
+		get_or_insert_friend_data(extension, friend_id);
 
-	struct MessagesPacket parsed_packet;
-	if (!parse_messages_packet(data, size, &parsed_packet)) {
-		/* FIXME: We should probably tell the sender that they gave us invalid data here */
-		clear_incoming_message(&friend_data->message);
+	if (!friend_data) {
+		if (err) {
+			*err = TOX_EXTENSION_MESSAGES_INVALID_ARG;
+		}
 		return;
 	}
 
-	switch (parsed_packet.message_type) {
-	case MESSAGE_NEGOTIATE:
-		friend_data->max_sending_size =
-			parsed_packet.max_sending_message_size;
-		ext_messages->negotiated_cb(friend_id, true,
-					    friend_data->max_sending_size,
-					    ext_messages->userdata);
-		return;
-	case MESSAGE_START:
-		tox_extension_messages_handle_message_start(
-			ext_messages, &parsed_packet, friend_data);
-		return;
-	case MESSAGE_PART: {
-		tox_extension_messages_handle_message_part(&parsed_packet,
-							   friend_data);
-		return;
+	friend_data->has_max_receiving_size = true;
+	friend_data->max_receiving_size = max_receive_size;
+	apply_max_receiving_size(extension, friend_data);
+
+	if (err) {
+		*err = TOX_EXTENSION_MESSAGES_SUCCESS;
 	}
-	case MESSAGE_FINISH:
-		tox_extension_messages_handle_message_finish(
-			ext_messages, friend_id, &parsed_packet, friend_data,
-			response_packet_list);
-		return;
-	case MESSAGE_RECEIVED:
-		ext_messages->receipt_cb(friend_id, parsed_packet.receipt_id,
-					 ext_messages->userdata);
+}
+
+void tox_extension_messages_clear_friend_max_receiving_size(
+	struct ToxExtensionMessages *extension, uint32_t friend_id)
+{
+	struct FriendData *friend_data = get_friend_data(extension, friend_id);
+
+	if (!friend_data || !friend_data->has_max_receiving_size) {
 		return;
 	}
+
+	friend_data->has_max_receiving_size = false;
+	apply_max_receiving_size(extension, friend_data);
 }
 
-static void
-tox_extension_messages_neg(struct ToxExtExtension *extension,
-			   uint32_t friend_id, bool compatible, void *userdata,
-			   struct ToxExtPacketList *response_packet_list)
+uint64_t tox_extension_messages_get_friend_max_receiving_size(
+	struct ToxExtensionMessages *extension, uint32_t friend_id)
 {
-	(void)extension;
-	struct ToxExtensionMessages *ext_messages = userdata;
+	return get_friend_max_receiving_size(
+		extension, get_friend_data(extension, friend_id));
+}
 
-	get_or_insert_friend_data(ext_messages, friend_id);
+void tox_extension_messages_set_rate_limits(
+	struct ToxExtensionMessages *extension,
+	struct Tox_Extension_Messages_Rate_Limits const *limits)
+{
+	extension->has_rate_limits = limits != NULL;
+	if (limits) {
+		extension->rate_limits = *limits;
+	}
 
-	if (!compatible) {
-		ext_messages->negotiated_cb(friend_id, compatible, 0,
-					    ext_messages->userdata);
-	} else {
-		/*
-		 * Do not call the negotiation callback yet. We need to continue with
-		 * our own internal negotiation of max message size. We consider
-		 * ourselves negotiated when our peer has told us what their max packet
-		 * size is
-		 */
-		tox_extension_messages_negotiate_size(ext_messages,
-						      response_packet_list);
+	for (size_t i = 0; i < extension->friend_datas_size; ++i) {
+		struct FriendData *friend_data = extension->friend_datas[i];
+
+		if (!friend_data->has_rate_limits) {
+			friend_data->rate_limiter.initialized = false;
+		}
 	}
 }
 
-struct ToxExtensionMessages *
-tox_extension_messages_register(struct ToxExt *toxext,
-				tox_extension_messages_received_cb cb,
-				tox_extension_messages_receipt_cb receipt_cb,
-				tox_extension_messages_negotiate_cb neg_cb,
-				void *userdata, uint64_t max_receive_size)
+void tox_extension_messages_set_friend_rate_limits(
+	struct ToxExtensionMessages *extension, uint32_t friend_id,
+	struct Tox_Extension_Messages_Rate_Limits const *limits,
+	enum Tox_Extension_Messages_Error *err)
 {
-	assert(cb);
+	struct FriendData *friend_data =
+		get_or_insert_friend_data(extension, friend_id);
 
-	struct ToxExtensionMessages *extension =
-		malloc(sizeof(struct ToxExtensionMessages));
+	if (!friend_data || !limits) {
+		if (err) {
+			*err = TOX_EXTENSION_MESSAGES_INVALID_ARG;
+		}
+		return;
+	}
 
-	if (!extension) {
-		return NULL;
+	friend_data->has_rate_limits = true;
+	friend_data->rate_limits = *limits;
+	friend_data->rate_limiter.initialized = false;
+
+	if (err) {
+		*err = TOX_EXTENSION_MESSAGES_SUCCESS;
 	}
+}
 
-	extension->extension_handle =
-		toxext_register(toxext, uuid, extension,
-				tox_extension_messages_recv,
-				tox_extension_messages_neg);
-	extension->friend_datas = NULL;
-	extension->friend_datas_size = 0;
-	extension->next_receipt_id = 0;
-	extension->cb = cb;
-	extension->receipt_cb = receipt_cb;
-	extension->negotiated_cb = neg_cb;
-	extension->userdata = userdata;
-	extension->max_receiving_message_size = max_receive_size;
+void tox_extension_messages_clear_friend_rate_limits(
+	struct ToxExtensionMessages *extension, uint32_t friend_id)
+{
+	struct FriendData *friend_data = get_friend_data(extension, friend_id);
 
-	if (!extension->extension_handle) {
-		free(extension);
-		return NULL;
+	if (!friend_data) {
+		return;
 	}
 
-	return extension;
+	friend_data->has_rate_limits = false;
+	friend_data->rate_limiter.initialized = false;
 }
 
-void tox_extension_messages_free(struct ToxExtensionMessages *extension)
+void tox_extension_messages_set_receive_window(
+	struct ToxExtensionMessages *extension, uint32_t segments)
 {
+	extension->receive_window = segments;
+
 	for (size_t i = 0; i < extension->friend_datas_size; ++i) {
-		free(extension->friend_datas[i].message.message);
+		renegotiate(extension, extension->friend_datas[i]);
 	}
-	free(extension->friend_datas);
-	free(extension);
 }
 
-void tox_extension_messages_negotiate(struct ToxExtensionMessages *extension,
-				      uint32_t friend_id)
+void tox_extension_messages_set_max_pending_segments(
+	struct ToxExtensionMessages *extension, size_t segments)
 {
-	toxext_negotiate_connection(extension->extension_handle, friend_id);
+	extension->max_pending_segments = segments;
 }
 
-static uint8_t const *
-tox_extension_messages_chunk(bool first_chunk, uint8_t const *data, size_t size,
-			     uint64_t receipt_id, uint8_t *extension_data,
-			     size_t *output_size)
+size_t tox_extension_messages_get_pending_segments(
+	struct ToxExtensionMessages *extension, uint32_t friend_id)
 {
-	uint8_t const *ret;
-	bool last_chunk = size <= TOXEXT_MAX_SEGMENT_SIZE - 9;
+	struct FriendData *friend_data = get_friend_data(extension, friend_id);
 
-	if (last_chunk) {
-		extension_data[0] = MESSAGE_FINISH;
-		toxext_write_to_buf(receipt_id, extension_data + 1, 8);
+	if (!friend_data) {
+		return 0;
+	}
 
-		size_t advance_size = size;
-		*output_size = size + 9;
-		ret = data + advance_size;
-		memcpy(extension_data + 9, data, advance_size);
-	} else if (first_chunk) {
-		extension_data[0] = MESSAGE_START;
-		toxext_write_to_buf(size, extension_data + 1, 8);
-		size_t advance_size = TOXEXT_MAX_SEGMENT_SIZE - 9;
-		memcpy(extension_data + 9, data, advance_size);
-		*output_size = TOXEXT_MAX_SEGMENT_SIZE;
-		ret = data + advance_size;
+	return get_pending_segments(friend_data);
+}
+
+uint8_t *
+tox_extension_messages_take_message(struct ToxExtensionMessages *extension,
+				    size_t *size)
+{
+	struct Delivery *delivery = &extension->delivery;
+
+	if (!delivery->active || delivery->taken) {
+		return NULL;
+	}
+
+	uint8_t *message;
+	struct IncomingMessage *incoming_message = delivery->incoming_message;
+
+	if (incoming_message && incoming_message->message == delivery->message) {
+		/* Finishing the message frees the buffer anyway, just detach it */
+		message = incoming_message->message;
+		incoming_message->message = NULL;
+		incoming_message->capacity = 0;
+		/* The caller owns it from here on */
+		TOX_EXTENSION_MESSAGES_ON_FREE(message);
 	} else {
-		extension_data[0] = MESSAGE_PART;
-		size_t advance_size = TOXEXT_MAX_SEGMENT_SIZE - 1;
-		memcpy(extension_data + 1, data, advance_size);
-		*output_size = TOXEXT_MAX_SEGMENT_SIZE;
-		ret = data + advance_size;
+		message = malloc(delivery->size ? delivery->size : 1);
+
+		if (!message) {
+			return NULL;
+		}
+
+		memcpy(message, delivery->message, delivery->size);
 	}
 
-	return ret;
+	delivery->taken = true;
+	*size = delivery->size;
+	return message;
 }
 
-uint64_t tox_extension_messages_append(struct ToxExtensionMessages *extension,
-				       struct ToxExtPacketList *packet_list,
-				       uint8_t const *data, size_t size,
-				       uint32_t friend_id,
-				       enum Tox_Extension_Messages_Error *err)
+uint64_t
+tox_extension_messages_defer_receipt(struct ToxExtensionMessages *extension,
+				     enum Tox_Extension_Messages_Error *err)
 {
-	enum Tox_Extension_Messages_Error get_max_err;
-	uint64_t max_sending_size = tox_extension_messages_get_max_sending_size(
-		extension, friend_id, &get_max_err);
-	if (get_max_err != TOX_EXTENSION_MESSAGES_SUCCESS ||
-	    size > max_sending_size) {
+	struct Delivery *delivery = &extension->delivery;
+
+	if (!delivery->active) {
 		if (err) {
 			*err = TOX_EXTENSION_MESSAGES_INVALID_ARG;
 		}
 		return -1;
 	}
 
-	uint8_t const *end = data + size;
-	uint8_t const *next_chunk = data;
-	bool first_chunk = true;
-	uint64_t receipt_id = extension->next_receipt_id++;
-	do {
-		uint8_t extension_data[TOXEXT_MAX_SEGMENT_SIZE];
-		size_t size_for_chunk;
-		next_chunk = tox_extension_messages_chunk(
-			first_chunk, next_chunk, end - next_chunk, receipt_id,
-			extension_data, &size_for_chunk);
-		first_chunk = false;
+	delivery->receipt_deferred = true;
 
-		toxext_segment_append(packet_list, extension->extension_handle,
-				      extension_data, size_for_chunk);
-	} while (end > next_chunk);
+	if (err) {
+		*err = TOX_EXTENSION_MESSAGES_SUCCESS;
+	}
+	return delivery->receipt_id;
+}
+
+void tox_extension_messages_send_receipt(struct ToxExtensionMessages *extension,
+					 uint32_t friend_id, uint64_t receipt_id,
+					 enum Tox_Extension_Messages_Error *err)
+{
+	struct ToxExtPacketList *packet_list =
+		toxext_packet_list_create(extension->toxext, friend_id);
+
+	if (!packet_list) {
+		if (err) {
+			*err = TOX_EXTENSION_MESSAGES_INVALID_ARG;
+		}
+		return;
+	}
+
+	send_receipt(extension, friend_id, receipt_id, packet_list);
+	toxext_send(packet_list);
 
 	if (err) {
 		*err = TOX_EXTENSION_MESSAGES_SUCCESS;
 	}
-	return receipt_id;
 }
 
 uint64_t tox_extension_messages_get_max_receiving_size(
@@ -493,7 +3692,8 @@ uint64_t tox_extension_messages_get_max_sending_size(
 {
 	struct FriendData *friend_datas = get_friend_data(extension, friend_id);
 
-	if (!friend_datas) {
+	/* Friends get a slot for other reasons long before they negotiate */
+	if (!friend_datas || !friend_datas->peer_negotiated) {
 		*err = TOX_EXTENSION_MESSAGES_INVALID_ARG;
 		return 0;
 	}
@@ -501,3 +3701,335 @@ uint64_t tox_extension_messages_get_max_sending_size(
 	*err = TOX_EXTENSION_MESSAGES_SUCCESS;
 	return friend_datas->max_sending_size;
 }
+
+static bool should_save_incoming(struct FriendData const *friend_data,
+				 bool include_incoming)
+{
+	return include_incoming && !friend_data->drop_incoming_message &&
+	       friend_data->message.size > 0;
+}
+
+size_t tox_extension_messages_get_savedata_size(
+	struct ToxExtensionMessages const *extension, bool include_incoming)
+{
+	size_t size = SAVEDATA_HEADER_SIZE;
+
+	for (size_t i = 0; i < extension->friend_datas_size; ++i) {
+		struct FriendData const *friend_data =
+			extension->friend_datas[i];
+
+		size += SAVEDATA_FRIEND_SIZE;
+		if (should_save_incoming(friend_data, include_incoming)) {
+			size += friend_data->message.size;
+		}
+	}
+
+	return size;
+}
+
+void tox_extension_messages_get_savedata(
+	struct ToxExtensionMessages const *extension, uint8_t *savedata,
+	bool include_incoming)
+{
+	uint8_t *it = savedata;
+
+	toxext_write_to_buf(SAVEDATA_MAGIC, it, 4);
+	it += 4;
+	toxext_write_to_buf(SAVEDATA_VERSION, it, 4);
+	it += 4;
+	toxext_write_to_buf(extension->next_receipt_id, it, 8);
+	it += 8;
+	toxext_write_to_buf(extension->friend_datas_size, it, 4);
+	it += 4;
+
+	for (size_t i = 0; i < extension->friend_datas_size; ++i) {
+		struct FriendData const *friend_data =
+			extension->friend_datas[i];
+		struct IncomingMessage const *incoming_message =
+			&friend_data->message;
+		bool save_incoming =
+			should_save_incoming(friend_data, include_incoming);
+
+		toxext_write_to_buf(friend_data->friend_id, it, 4);
+		it += 4;
+		*it = friend_data->peer_negotiated;
+		it += 1;
+		toxext_write_to_buf(friend_data->max_sending_size, it, 8);
+		it += 8;
+		*it = friend_data->peer_supports_credit;
+		it += 1;
+		toxext_write_to_buf(friend_data->send_window, it, 4);
+		it += 4;
+		*it = friend_data->peer_features;
+		it += 1;
+		*it = friend_data->has_max_receiving_size;
+		it += 1;
+		toxext_write_to_buf(friend_data->max_receiving_size, it, 8);
+		it += 8;
+		toxext_write_to_buf(save_incoming ? incoming_message->capacity : 0,
+				    it, 8);
+		it += 8;
+		toxext_write_to_buf(save_incoming ? incoming_message->size : 0,
+				    it, 8);
+		it += 8;
+
+		if (save_incoming) {
+			memcpy(it, incoming_message->message,
+			       incoming_message->size);
+			it += incoming_message->size;
+		}
+	}
+}
+
+static size_t get_savedata_friend_size(uint32_t version)
+{
+	switch (version) {
+	case 1:
+		return SAVEDATA_FRIEND_SIZE_V1;
+	case 2:
+		return SAVEDATA_FRIEND_SIZE_V2;
+	default:
+		return SAVEDATA_FRIEND_SIZE;
+	}
+}
+
+/* A friend read from savedata, only applied once all of it has been read */
+struct SavedFriend {
+	uint32_t friend_id;
+	bool peer_negotiated;
+	uint64_t max_sending_size;
+	bool peer_supports_credit;
+	uint32_t send_window;
+	uint8_t peer_features;
+	bool has_max_receiving_size;
+	uint64_t max_receiving_size;
+	uint64_t incoming_capacity;
+	uint64_t incoming_size;
+	/* Points into the savedata until it's copied into incoming_message */
+	uint8_t const *incoming;
+	uint8_t *incoming_message;
+	struct FriendData *friend_data;
+};
+
+/*
+ * Older versions are read into the current layout. They only had a max
+ * sending size for friends that negotiated, and never saved a receive limit
+ * override so any set since registering is kept
+ */
+static bool parse_friend_savedata(uint32_t version, uint8_t const **it,
+				  uint8_t const *end,
+				  struct SavedFriend *saved_friend)
+{
+	uint8_t const *friend_it = *it;
+
+	if (friend_it + get_savedata_friend_size(version) > end) {
+		return false;
+	}
+
+	saved_friend->friend_id = toxext_read_from_buf(uint32_t, friend_it, 4);
+	friend_it += 4;
+	saved_friend->peer_negotiated = false;
+	if (version >= 3) {
+		saved_friend->peer_negotiated = *friend_it != 0;
+		friend_it += 1;
+	}
+	saved_friend->max_sending_size =
+		toxext_read_from_buf(uint64_t, friend_it, 8);
+	friend_it += 8;
+	if (version < 3) {
+		saved_friend->peer_negotiated =
+			saved_friend->max_sending_size > 0;
+	}
+	saved_friend->peer_supports_credit = *friend_it != 0;
+	friend_it += 1;
+	saved_friend->send_window = toxext_read_from_buf(uint32_t, friend_it, 4);
+	friend_it += 4;
+	saved_friend->peer_features = 0;
+	if (version >= 2) {
+		saved_friend->peer_features = *friend_it;
+		friend_it += 1;
+	}
+	saved_friend->has_max_receiving_size = false;
+	saved_friend->max_receiving_size = 0;
+	if (version >= 3) {
+		saved_friend->has_max_receiving_size = *friend_it != 0;
+		friend_it += 1;
+		saved_friend->max_receiving_size =
+			toxext_read_from_buf(uint64_t, friend_it, 8);
+		friend_it += 8;
+	}
+	saved_friend->incoming_capacity =
+		toxext_read_from_buf(uint64_t, friend_it, 8);
+	friend_it += 8;
+	saved_friend->incoming_size =
+		toxext_read_from_buf(uint64_t, friend_it, 8);
+	friend_it += 8;
+
+	if (saved_friend->incoming_size > saved_friend->incoming_capacity ||
+	    saved_friend->incoming_size > (uint64_t)(end - friend_it)) {
+		return false;
+	}
+
+	saved_friend->incoming = friend_it;
+	saved_friend->incoming_message = NULL;
+	saved_friend->friend_data = NULL;
+	friend_it += saved_friend->incoming_size;
+
+	*it = friend_it;
+	return true;
+}
+
+/*
+ * Allocates everything applying a saved friend needs. A friend that is only
+ * given a slot here is left as if we never heard from it when loading fails
+ */
+static bool prepare_friend_savedata(struct ToxExtensionMessages *extension,
+				    uint32_t version,
+				    struct SavedFriend *saved_friend)
+{
+	struct FriendData *friend_data =
+		get_friend_data(extension, saved_friend->friend_id);
+
+	uint64_t max_receiving_size =
+		get_friend_max_receiving_size(extension, friend_data);
+	if (version >= 3) {
+		max_receiving_size = saved_friend->has_max_receiving_size ?
+					     saved_friend->max_receiving_size :
+					     extension->max_receiving_message_size;
+	}
+
+	/*
+	 * A partial message that no longer fits our limit will be dropped by the
+	 * usual checks, but there's no need to allocate for it
+	 */
+	if (saved_friend->incoming_size > 0 &&
+	    saved_friend->incoming_capacity <= max_receiving_size) {
+		saved_friend->incoming_message =
+			ext_malloc(saved_friend->incoming_capacity);
+
+		if (!saved_friend->incoming_message) {
+			return false;
+		}
+
+		memcpy(saved_friend->incoming_message, saved_friend->incoming,
+		       saved_friend->incoming_size);
+	}
+
+	saved_friend->friend_data =
+		get_or_insert_friend_data(extension, saved_friend->friend_id);
+
+	return saved_friend->friend_data != NULL;
+}
+
+static void apply_friend_savedata(struct ToxExtensionMessages *extension,
+				  uint32_t version,
+				  struct SavedFriend *saved_friend)
+{
+	struct FriendData *friend_data = saved_friend->friend_data;
+
+	friend_data->max_sending_size = saved_friend->max_sending_size;
+	friend_data->peer_supports_credit = saved_friend->peer_supports_credit;
+	friend_data->send_window = saved_friend->send_window;
+	friend_data->peer_features = saved_friend->peer_features;
+	if (version >= 3) {
+		friend_data->has_max_receiving_size =
+			saved_friend->has_max_receiving_size;
+		friend_data->max_receiving_size =
+			saved_friend->max_receiving_size;
+	}
+	friend_data->peer_negotiated = saved_friend->peer_negotiated;
+	if (saved_friend->peer_negotiated) {
+		finish_bulk_negotiation(extension, friend_data, true);
+	} else {
+		restart_bulk_negotiation(extension, friend_data);
+	}
+	/* Whatever was in flight before the restart is gone */
+	friend_data->send_credit = saved_friend->send_window;
+	friend_data->consumed_segments = 0;
+	friend_data->drop_incoming_message = false;
+	clear_incoming_message(&friend_data->message);
+
+	if (saved_friend->incoming_message) {
+		struct IncomingMessage *incoming_message =
+			&friend_data->message;
+		incoming_message->message = saved_friend->incoming_message;
+		incoming_message->size = saved_friend->incoming_size;
+		incoming_message->capacity = saved_friend->incoming_capacity;
+		saved_friend->incoming_message = NULL;
+	}
+}
+
+enum Tox_Extension_Messages_Error
+tox_extension_messages_load_savedata(struct ToxExtensionMessages *extension,
+				     uint8_t const *savedata, size_t size)
+{
+	uint8_t const *it = savedata;
+	uint8_t const *end = savedata + size;
+
+	if (size < SAVEDATA_HEADER_SIZE) {
+		return TOX_EXTENSION_MESSAGES_INVALID_ARG;
+	}
+
+	uint32_t magic = toxext_read_from_buf(uint32_t, it, 4);
+	it += 4;
+	uint32_t version = toxext_read_from_buf(uint32_t, it, 4);
+	it += 4;
+
+	if (magic != SAVEDATA_MAGIC) {
+		return TOX_EXTENSION_MESSAGES_INVALID_ARG;
+	}
+
+	if (version == 0 || version > SAVEDATA_VERSION) {
+		return TOX_EXTENSION_MESSAGES_NOT_SUPPORTED;
+	}
+
+	uint64_t next_receipt_id = toxext_read_from_buf(uint64_t, it, 8);
+	it += 8;
+	uint32_t friend_count = toxext_read_from_buf(uint32_t, it, 4);
+	it += 4;
+
+	if (friend_count >
+	    (size_t)(end - it) / get_savedata_friend_size(version)) {
+		return TOX_EXTENSION_MESSAGES_INVALID_ARG;
+	}
+
+	struct SavedFriend *saved_friends = NULL;
+	if (friend_count > 0) {
+		saved_friends =
+			ext_calloc(friend_count, sizeof(struct SavedFriend));
+
+		if (!saved_friends) {
+			return TOX_EXTENSION_MESSAGES_INVALID_ARG;
+		}
+	}
+
+	/* Nothing is touched until all of it has been read and allocated */
+	bool ok = true;
+	for (uint32_t i = 0; ok && i < friend_count; ++i) {
+		ok = parse_friend_savedata(version, &it, end,
+					   &saved_friends[i]);
+	}
+	for (uint32_t i = 0; ok && i < friend_count; ++i) {
+		ok = prepare_friend_savedata(extension, version,
+					     &saved_friends[i]);
+	}
+	for (uint32_t i = 0; ok && i < friend_count; ++i) {
+		apply_friend_savedata(extension, version, &saved_friends[i]);
+	}
+
+	for (uint32_t i = 0; i < friend_count; ++i) {
+		ext_free(saved_friends[i].incoming_message);
+	}
+	ext_free(saved_friends);
+
+	if (!ok) {
+		return TOX_EXTENSION_MESSAGES_INVALID_ARG;
+	}
+
+	/* Never hand out an id that may still be in use by this instance */
+	if (next_receipt_id > extension->next_receipt_id) {
+		extension->next_receipt_id = next_receipt_id;
+	}
+
+	return TOX_EXTENSION_MESSAGES_SUCCESS;
+}
@@ -2,15 +2,23 @@
 
 #include <toxext/toxext.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct ToxExtensionMessages;
 
 #define TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE              \
 	10 * 1024 * 1024
+#define TOX_EXTENSION_MESSAGES_DEFAULT_DEDUP_MIN_MESSAGE_SIZE                  \
+	(TOXEXT_MAX_SEGMENT_SIZE * 8)
 
 enum Tox_Extension_Messages_Error {
 	TOX_EXTENSION_MESSAGES_SUCCESS = 0,
 	TOX_EXTENSION_MESSAGES_INVALID_ARG,
-	TOX_EXTENSION_MESSAGES_NOT_SUPPORTED
+	TOX_EXTENSION_MESSAGES_NOT_SUPPORTED,
+	/* Too much is already queued for the friend, try again later */
+	TOX_EXTENSION_MESSAGES_WOULD_BLOCK
 };
 
 /**
@@ -36,6 +44,115 @@ typedef void (*tox_extension_messages_negotiate_cb)(uint32_t friend_number,
 						    uint64_t max_sending_size,
 						    void *user_data);
 
+enum Tox_Extension_Messages_Receipt_Status {
+	TOX_EXTENSION_MESSAGES_RECEIPT_DELIVERED = 0,
+	TOX_EXTENSION_MESSAGES_RECEIPT_TIMED_OUT
+};
+
+/**
+ * Callback when a message appended with
+ * tox_extension_messages_append_tracked() is either received by the friend or
+ * not received before its timeout
+ */
+typedef void (*tox_extension_messages_completion_cb)(
+	uint32_t friend_number, uint64_t receipt_id,
+	enum Tox_Extension_Messages_Receipt_Status status, void *context,
+	void *user_data);
+
+enum Tox_Extension_Messages_Drop_Reason {
+	TOX_EXTENSION_MESSAGES_DROP_TOO_LARGE = 0,
+	TOX_EXTENSION_MESSAGES_DROP_ALLOCATION_FAILED,
+	TOX_EXTENSION_MESSAGES_DROP_MALFORMED,
+	TOX_EXTENSION_MESSAGES_DROP_CHECKSUM_MISMATCH,
+	TOX_EXTENSION_MESSAGES_DROP_RATE_LIMITED_SEGMENTS,
+	TOX_EXTENSION_MESSAGES_DROP_RATE_LIMITED_BYTES,
+	TOX_EXTENSION_MESSAGES_DROP_RATE_LIMITED_STARTS
+};
+
+/**
+ * Callback when an incoming message from friend_number is dropped. No receipt
+ * is sent for dropped messages. Rate limit violations are reported for every
+ * segment dropped
+ */
+typedef void (*tox_extension_messages_dropped_cb)(
+	uint32_t friend_number, enum Tox_Extension_Messages_Drop_Reason reason,
+	void *user_data);
+
+/**
+ * Receive rate limits applied to each friend. Segments over a limit are
+ * dropped before they are parsed, together with the rest of the message they
+ * belong to. Negotiation, credit, receipt and request segments are never
+ * limited. A rate of 0 disables that limit, a burst of 0 allows one second
+ * (one interval for starts) worth of traffic. The byte burst is raised to
+ * TOXEXT_MAX_SEGMENT_SIZE if it's smaller, a full segment could never get
+ * through otherwise
+ */
+struct Tox_Extension_Messages_Rate_Limits {
+	uint32_t segments_per_second;
+	uint32_t segment_burst;
+	uint64_t bytes_per_second;
+	uint64_t byte_burst;
+	/* Messages started per start_interval_ms */
+	uint32_t starts_per_interval;
+	uint32_t start_interval_ms;
+};
+
+#define TOX_EXTENSION_MESSAGES_DEFAULT_NEGOTIATIONS_PER_SECOND 20
+#define TOX_EXTENSION_MESSAGES_DEFAULT_NEGOTIATION_RETRY_MS 10000
+#define TOX_EXTENSION_MESSAGES_DEFAULT_NEGOTIATION_ATTEMPTS 3
+
+/**
+ * How tox_extension_messages_negotiate_bulk() spreads negotiations out. A
+ * rate of 0 starts every queued negotiation at once, a burst of 0 allows one
+ * second worth. Friends that don't answer within retry_ms are retried until
+ * they have had max_attempts attempts, 0 retries for ever
+ */
+struct Tox_Extension_Messages_Negotiation_Pacing {
+	uint32_t negotiations_per_second;
+	uint32_t burst;
+	uint32_t retry_ms;
+	uint32_t max_attempts;
+};
+
+struct Tox_Extension_Messages_Negotiation_Request {
+	uint32_t friend_id;
+	/* Higher priorities are negotiated first */
+	uint32_t priority;
+};
+
+/**
+ * Friends passed to tox_extension_messages_negotiate_bulk() by state. Friends
+ * that answered in time or negotiated on their own count as negotiated,
+ * incompatible friends and friends out of attempts as failed
+ */
+struct Tox_Extension_Messages_Negotiation_Progress {
+	size_t total;
+	size_t queued;
+	size_t in_flight;
+	size_t negotiated;
+	size_t failed;
+};
+
+/**
+ * Returns the current time in milliseconds. Only differences between values
+ * matter
+ */
+typedef uint64_t (*tox_extension_messages_clock_cb)(void *clock_user_data);
+
+enum Tox_Extension_Messages_Trace_Direction {
+	TOX_EXTENSION_MESSAGES_TRACE_INBOUND = 0,
+	TOX_EXTENSION_MESSAGES_TRACE_OUTBOUND
+};
+
+/**
+ * Callback for every raw extension segment received from or appended for
+ * friend_id. Called on the hot path, so it should return quickly
+ */
+typedef void (*tox_extension_messages_trace_cb)(
+	uint32_t friend_id,
+	enum Tox_Extension_Messages_Trace_Direction direction,
+	uint8_t const *data, size_t size, void *trace_user_data);
+
 /**
  * Register a new extension instance with toxext
  */
@@ -52,7 +169,10 @@ tox_extension_messages_register(struct ToxExt *toxext,
 void tox_extension_messages_free(struct ToxExtensionMessages *extension);
 
 /**
- * Initiate negotiation with friend_id
+ * Initiate negotiation with friend_id. Negotiating again with a friend we're
+ * already negotiated with keeps any message and credit in flight, unless the
+ * friend answers with another max message size. Friends that went away start
+ * over.
  */
 void tox_extension_messages_negotiate(struct ToxExtensionMessages *extension,
 				      uint32_t friend_id);
@@ -69,6 +189,71 @@ uint64_t tox_extension_messages_append(struct ToxExtensionMessages *extension,
 				       uint32_t friend_id,
 				       enum Tox_Extension_Messages_Error *err);
 
+/**
+ * Same as tox_extension_messages_append() but additionally tracks the receipt.
+ * The completion callback is called with context once the friend receives the
+ * message, or with a timed out status if timeout milliseconds pass first.
+ *
+ * Requires tox_extension_messages_enable_receipt_tracking()
+ */
+uint64_t tox_extension_messages_append_tracked(
+	struct ToxExtensionMessages *extension,
+	struct ToxExtPacketList *packet_list, uint8_t const *data, size_t size,
+	uint32_t friend_id, uint64_t timeout, void *context,
+	enum Tox_Extension_Messages_Error *err);
+
+/**
+ * Enable the built in receipt table used by
+ * tox_extension_messages_append_tracked()
+ */
+void tox_extension_messages_enable_receipt_tracking(
+	struct ToxExtensionMessages *extension,
+	tox_extension_messages_completion_cb completion_cb);
+
+/**
+ * Override the monotonic clock used for receipt timeouts, rate limits and
+ * negotiation pacing. Passing NULL restores the default clock. Receipts and
+ * negotiations already waiting keep the time they had left on the old clock
+ */
+void tox_extension_messages_set_clock(struct ToxExtensionMessages *extension,
+				      tox_extension_messages_clock_cb clock_cb,
+				      void *clock_user_data);
+
+/**
+ * Process timeouts and start paced negotiations. Should be called regularly,
+ * e.g. alongside tox_iterate()
+ */
+void tox_extension_messages_iterate(struct ToxExtensionMessages *extension);
+
+/**
+ * Take ownership of the message currently passed to the received callback.
+ * Only valid inside the callback, and only once per message. A message
+ * reassembled from several segments is handed over without a copy, others
+ * are copied. The returned buffer must be released with free(), but not
+ * before the callback returns. Returns NULL outside of the callback or if
+ * allocating the copy failed
+ */
+uint8_t *
+tox_extension_messages_take_message(struct ToxExtensionMessages *extension,
+				    size_t *size);
+
+/**
+ * Hold back the receipt for the message currently passed to the received
+ * callback, e.g. until another process has dealt with it. Only valid inside
+ * the callback. Returns the receipt id to pass to
+ * tox_extension_messages_send_receipt() later
+ */
+uint64_t
+tox_extension_messages_defer_receipt(struct ToxExtensionMessages *extension,
+				     enum Tox_Extension_Messages_Error *err);
+
+/**
+ * Send a receipt held back with tox_extension_messages_defer_receipt()
+ */
+void tox_extension_messages_send_receipt(struct ToxExtensionMessages *extension,
+					 uint32_t friend_id, uint64_t receipt_id,
+					 enum Tox_Extension_Messages_Error *err);
+
 /**
  * The current max message size that will be accepted.
  */
@@ -76,8 +261,196 @@ uint64_t tox_extension_messages_get_max_receiving_size(
 	struct ToxExtensionMessages *extension);
 
 /**
- * The max message size that friend_id will accept from us.
+ * Change the max message size accepted from friends without their own limit.
+ * Friends we have negotiated with are told straight away and messages in
+ * progress that no longer fit are dropped
+ */
+void tox_extension_messages_set_max_receiving_size(
+	struct ToxExtensionMessages *extension, uint64_t max_receive_size);
+
+/**
+ * Set the max message size accepted from friend_id, overriding the instance
+ * wide limit. Can be called before negotiating with the friend
+ */
+void tox_extension_messages_set_friend_max_receiving_size(
+	struct ToxExtensionMessages *extension, uint32_t friend_id,
+	uint64_t max_receive_size, enum Tox_Extension_Messages_Error *err);
+
+/**
+ * Go back to the instance wide limit for friend_id
+ */
+void tox_extension_messages_clear_friend_max_receiving_size(
+	struct ToxExtensionMessages *extension, uint32_t friend_id);
+
+/**
+ * The max message size that will be accepted from friend_id
+ */
+uint64_t tox_extension_messages_get_friend_max_receiving_size(
+	struct ToxExtensionMessages *extension, uint32_t friend_id);
+
+/**
+ * The max message size that friend_id will accept from us. Fails with
+ * TOX_EXTENSION_MESSAGES_INVALID_ARG until we have negotiated with friend_id.
  */
 uint64_t tox_extension_messages_get_max_sending_size(
 	struct ToxExtensionMessages *extension, uint32_t friend_id,
 	enum Tox_Extension_Messages_Error *err);
+
+/**
+ * Limit how many data segments a friend may have in flight towards us. Credit
+ * is handed back to the friend as we process its segments. 0 (the default)
+ * disables flow control. The window is part of our negotiate packet and is
+ * sent again to friends we've already negotiated with.
+ */
+void tox_extension_messages_set_receive_window(
+	struct ToxExtensionMessages *extension, uint32_t segments);
+
+/**
+ * Stop accepting messages for a friend once this many segments are queued
+ * for it, see tox_extension_messages_get_pending_segments(). Appending then
+ * fails with TOX_EXTENSION_MESSAGES_WOULD_BLOCK until the friend catches up.
+ * A message is accepted as long as the queue is below the limit, however many
+ * segments it adds. 0 (the default) never refuses a message.
+ */
+void tox_extension_messages_set_max_pending_segments(
+	struct ToxExtensionMessages *extension, size_t segments);
+
+/**
+ * Send large messages by digest first and skip the body when the friend
+ * already has it. Bodies received this way are kept in a cache of up to
+ * cache_size bytes, evicting the least recently used, and only answer offers
+ * from the friend that sent them. Both sides have to enable it before they
+ * negotiate, as it's announced in the negotiate packet. Offered messages are
+ * copied until the friend responds, once for all friends the same message is
+ * offered to.
+ * Messages stay in order, so anything appended to a friend after an offer is
+ * held back until the friend has answered it. When the body isn't cached that
+ * costs everything behind the offer a round trip, so only messages of at least
+ * min_message_size bytes are offered. 0 picks
+ * TOX_EXTENSION_MESSAGES_DEFAULT_DEDUP_MIN_MESSAGE_SIZE, and messages that fit
+ * in a single segment are never offered whatever the minimum.
+ */
+void tox_extension_messages_enable_dedup(
+	struct ToxExtensionMessages *extension, size_t cache_size,
+	size_t min_message_size);
+
+/**
+ * Verify every message with a CRC32C sent along with its last segment. The
+ * checksum is computed while the segments are copied so it costs little more
+ * than the copy. Used both ways with friends that announced checksums when
+ * they last negotiated with us.
+ */
+void tox_extension_messages_enable_checksums(
+	struct ToxExtensionMessages *extension);
+
+/**
+ * Set the callback for dropped incoming messages
+ */
+void tox_extension_messages_set_dropped_cb(
+	struct ToxExtensionMessages *extension,
+	tox_extension_messages_dropped_cb dropped_cb);
+
+/**
+ * Set a callback that sees every segment we send and receive, see
+ * tox_extension_messages_trace.h for a recorder. Passing NULL disables tracing
+ */
+void tox_extension_messages_set_trace_cb(
+	struct ToxExtensionMessages *extension,
+	tox_extension_messages_trace_cb trace_cb, void *trace_user_data);
+
+/**
+ * Set the rate limits for friends without their own. Passing NULL disables
+ * rate limiting. Friends without limits of their own start over with a full
+ * burst
+ */
+void tox_extension_messages_set_rate_limits(
+	struct ToxExtensionMessages *extension,
+	struct Tox_Extension_Messages_Rate_Limits const *limits);
+
+/**
+ * Set the rate limits for friend_id, overriding the instance wide ones. Pass
+ * limits of all 0 to exempt a trusted friend
+ */
+void tox_extension_messages_set_friend_rate_limits(
+	struct ToxExtensionMessages *extension, uint32_t friend_id,
+	struct Tox_Extension_Messages_Rate_Limits const *limits,
+	enum Tox_Extension_Messages_Error *err);
+
+/**
+ * Go back to the instance wide rate limits for friend_id
+ */
+void tox_extension_messages_clear_friend_rate_limits(
+	struct ToxExtensionMessages *extension, uint32_t friend_id);
+
+/**
+ * Set how bulk negotiations are paced, see
+ * struct Tox_Extension_Messages_Negotiation_Pacing. Negotiations that are
+ * already queued start at the new rate, ones in flight keep their deadline
+ */
+void tox_extension_messages_set_negotiation_pacing(
+	struct ToxExtensionMessages *extension,
+	struct Tox_Extension_Messages_Negotiation_Pacing const *pacing);
+
+/**
+ * Queue negotiations with many friends at once, e.g. on startup. They are
+ * started by priority at the paced rate from
+ * tox_extension_messages_iterate(). A queued friend that a message couldn't be
+ * appended for because it isn't negotiated yet jumps the queue. Friends
+ * already negotiated are only counted. Queueing a friend again updates its
+ * priority, or starts over if it failed
+ */
+void tox_extension_messages_negotiate_bulk(
+	struct ToxExtensionMessages *extension,
+	struct Tox_Extension_Messages_Negotiation_Request const *requests,
+	size_t count, enum Tox_Extension_Messages_Error *err);
+
+/**
+ * Count the friends passed to tox_extension_messages_negotiate_bulk() by
+ * state. A negotiated friend that goes away, or that savedata loaded with
+ * tox_extension_messages_load_savedata() says isn't negotiated, is queued
+ * again, so the negotiated count can go down as well as up
+ */
+void tox_extension_messages_get_negotiation_progress(
+	struct ToxExtensionMessages const *extension,
+	struct Tox_Extension_Messages_Negotiation_Progress *progress);
+
+/**
+ * Number of segments queued for friend_id waiting on credit from the friend,
+ * or on an answer to a dedup offer. Messages held behind an offer are counted
+ * by the most segments they can take. Callers streaming large amounts of data
+ * should hold off appending while this is non-zero.
+ */
+size_t tox_extension_messages_get_pending_segments(
+	struct ToxExtensionMessages *extension, uint32_t friend_id);
+
+/**
+ * Size of the buffer required by tox_extension_messages_get_savedata(). If
+ * include_incoming is set partially received messages are saved as well
+ */
+size_t tox_extension_messages_get_savedata_size(
+	struct ToxExtensionMessages const *extension, bool include_incoming);
+
+/**
+ * Serialize the negotiated state of every friend and the receipt counter so a
+ * restarted instance can send without negotiating again and without reusing
+ * receipt ids. Messages waiting on flow control credit and tracked receipts
+ * are not saved.
+ */
+void tox_extension_messages_get_savedata(
+	struct ToxExtensionMessages const *extension, uint8_t *savedata,
+	bool include_incoming);
+
+/**
+ * Restore state saved with tox_extension_messages_get_savedata(). Should be
+ * called right after registering the extension. Savedata from older versions
+ * of this library is accepted, anything newer is refused with
+ * TOX_EXTENSION_MESSAGES_NOT_SUPPORTED. Nothing is restored unless all of it
+ * loads
+ */
+enum Tox_Extension_Messages_Error
+tox_extension_messages_load_savedata(struct ToxExtensionMessages *extension,
+				     uint8_t const *savedata, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,440 @@
+#pragma once
+
+#include "tox_extension_messages.h"
+
+#include <concepts>
+#include <coroutine>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+/*
+ * Header only C++20 layer over tox_extension_messages.h. Callbacks are
+ * stored as the invocables they were given and called from static
+ * trampolines, so there is no std::function or virtual call per message.
+ * The trampolines are called from C, so callbacks have to be noexcept and
+ * coroutines awaiting receipts must not let exceptions escape when resumed.
+ *
+ *   tox_extension_messages::Messages messages(
+ *           toxext,
+ *           [&](uint32_t friend_id, tox_extension_messages::ReceivedMessage message) noexcept {
+ *                   store(friend_id, message.take());
+ *           });
+ *
+ *   auto receipt = messages.append_tracked(packet_list, friend_id, data, 5000);
+ *   toxext_send(packet_list);
+ *   if (co_await receipt == TOX_EXTENSION_MESSAGES_RECEIPT_DELIVERED) ...
+ */
+
+namespace tox_extension_messages
+{
+using Error = Tox_Extension_Messages_Error;
+using ReceiptStatus = Tox_Extension_Messages_Receipt_Status;
+
+struct FreeDeleter {
+	void operator()(uint8_t *data) const noexcept
+	{
+		std::free(data);
+	}
+};
+
+/**
+ * A received message owned by the caller
+ */
+class OwnedMessage {
+    public:
+	OwnedMessage() noexcept = default;
+
+	/**
+	 * Adopt a buffer allocated with malloc()
+	 */
+	OwnedMessage(uint8_t *data, size_t size) noexcept
+		: data_(data)
+		, size_(size)
+	{
+	}
+
+	OwnedMessage(OwnedMessage &&other) noexcept
+		: data_(std::move(other.data_))
+		, size_(std::exchange(other.size_, 0))
+	{
+	}
+
+	OwnedMessage &operator=(OwnedMessage &&other) noexcept
+	{
+		data_ = std::move(other.data_);
+		size_ = std::exchange(other.size_, 0);
+		return *this;
+	}
+
+	/**
+	 * False if nothing could be taken, see ReceivedMessage::take()
+	 */
+	explicit operator bool() const noexcept
+	{
+		return data_ != nullptr;
+	}
+
+	uint8_t const *data() const noexcept
+	{
+		return data_.get();
+	}
+
+	size_t size() const noexcept
+	{
+		return size_;
+	}
+
+	uint8_t const *begin() const noexcept
+	{
+		return data_.get();
+	}
+
+	uint8_t const *end() const noexcept
+	{
+		return data_.get() + size_;
+	}
+
+	std::span<uint8_t const> span() const noexcept
+	{
+		return { data_.get(), size_ };
+	}
+
+	/**
+	 * Give up ownership, the buffer must be released with free()
+	 */
+	uint8_t *release() noexcept
+	{
+		size_ = 0;
+		return data_.release();
+	}
+
+    private:
+	std::unique_ptr<uint8_t, FreeDeleter> data_;
+	size_t size_ = 0;
+};
+
+/**
+ * The message passed to the received callback. The data is only valid until
+ * the callback returns unless it is taken
+ */
+class ReceivedMessage {
+    public:
+	ReceivedMessage(ToxExtensionMessages *extension,
+			std::span<uint8_t const> data) noexcept
+		: extension_(extension)
+		, data_(data)
+	{
+	}
+
+	std::span<uint8_t const> data() const noexcept
+	{
+		return data_;
+	}
+
+	/**
+	 * Take ownership of the message. Messages reassembled from several
+	 * segments are handed over without a copy. Returns an empty message if
+	 * the message was already taken or the copy couldn't be allocated
+	 */
+	OwnedMessage take() const noexcept
+	{
+		size_t size = 0;
+		uint8_t *message =
+			tox_extension_messages_take_message(extension_, &size);
+
+		if (!message) {
+			return OwnedMessage();
+		}
+
+		return OwnedMessage(message, size);
+	}
+
+    private:
+	ToxExtensionMessages *extension_;
+	std::span<uint8_t const> data_;
+};
+
+namespace detail
+{
+struct ReceiptState {
+	bool done = false;
+	ReceiptStatus status = TOX_EXTENSION_MESSAGES_RECEIPT_TIMED_OUT;
+	std::coroutine_handle<> waiter;
+};
+} // namespace detail
+
+/**
+ * Result of Messages::append_tracked(). co_await it for the receipt status.
+ * Check that the append succeeded before awaiting. Only one coroutine may
+ * await a receipt at a time, so receipts can be moved but not copied
+ */
+class Receipt {
+    public:
+	/*
+	 * Lives in the awaiting coroutine's frame for as long as it is
+	 * suspended. A coroutine destroyed while suspended takes its awaiter
+	 * with it, which makes sure the completion never resumes it
+	 */
+	class Awaiter {
+	    public:
+		explicit Awaiter(
+			std::shared_ptr<detail::ReceiptState> state) noexcept
+			: state_(std::move(state))
+		{
+		}
+
+		Awaiter(Awaiter const &) = delete;
+		Awaiter &operator=(Awaiter const &) = delete;
+
+		~Awaiter()
+		{
+			if (waiter_ && state_->waiter == waiter_) {
+				state_->waiter = nullptr;
+			}
+		}
+
+		bool await_ready() const noexcept
+		{
+			return state_->done;
+		}
+
+		void await_suspend(std::coroutine_handle<> waiter) noexcept
+		{
+			waiter_ = waiter;
+			state_->waiter = waiter;
+		}
+
+		ReceiptStatus await_resume() const noexcept
+		{
+			return state_->status;
+		}
+
+	    private:
+		std::shared_ptr<detail::ReceiptState> state_;
+		std::coroutine_handle<> waiter_;
+	};
+
+	Receipt() noexcept = default;
+
+	Receipt(uint64_t id, std::shared_ptr<detail::ReceiptState> state) noexcept
+		: id_(id)
+		, state_(std::move(state))
+	{
+	}
+
+	Receipt(Receipt &&) noexcept = default;
+	Receipt &operator=(Receipt &&) noexcept = default;
+	Receipt(Receipt const &) = delete;
+	Receipt &operator=(Receipt const &) = delete;
+
+	explicit operator bool() const noexcept
+	{
+		return state_ != nullptr;
+	}
+
+	uint64_t id() const noexcept
+	{
+		return id_;
+	}
+
+	Awaiter operator co_await() const noexcept
+	{
+		return Awaiter(state_);
+	}
+
+    private:
+	uint64_t id_ = -1;
+	std::shared_ptr<detail::ReceiptState> state_;
+};
+
+struct IgnoreCallback {
+	void operator()(auto &&...) const noexcept
+	{
+	}
+};
+
+/**
+ * Owns a registered ToxExtensionMessages instance. The instance keeps a
+ * pointer to this object so it can neither be copied nor moved. Coroutines
+ * still waiting on a Receipt when this is destroyed are never resumed
+ */
+template <typename OnMessage, typename OnReceipt = IgnoreCallback,
+	  typename OnNegotiated = IgnoreCallback>
+	requires std::is_nothrow_invocable_v<OnMessage &, uint32_t,
+					     ReceivedMessage> &&
+		 std::is_nothrow_invocable_v<OnReceipt &, uint32_t, uint64_t> &&
+		 std::is_nothrow_invocable_v<OnNegotiated &, uint32_t, bool,
+					     uint64_t>
+class Messages {
+    public:
+	explicit Messages(
+		ToxExt *toxext, OnMessage on_message,
+		OnReceipt on_receipt = {}, OnNegotiated on_negotiated = {},
+		uint64_t max_receive_size =
+			TOX_EXTENSION_MESSAGES_DEFAULT_MAX_RECEIVING_MESSAGE_SIZE)
+		: on_message_(std::move(on_message))
+		, on_receipt_(std::move(on_receipt))
+		, on_negotiated_(std::move(on_negotiated))
+		, extension_(tox_extension_messages_register(
+			  toxext, received_trampoline, receipt_trampoline,
+			  negotiated_trampoline, this, max_receive_size))
+	{
+		if (!extension_) {
+			throw std::runtime_error(
+				"failed to register tox_extension_messages");
+		}
+
+		tox_extension_messages_enable_receipt_tracking(
+			extension_, completion_trampoline);
+	}
+
+	~Messages()
+	{
+		tox_extension_messages_free(extension_);
+	}
+
+	Messages(Messages const &) = delete;
+	Messages &operator=(Messages const &) = delete;
+
+	/**
+	 * The underlying instance, for everything not wrapped here
+	 */
+	ToxExtensionMessages *get() const noexcept
+	{
+		return extension_;
+	}
+
+	void negotiate(uint32_t friend_id)
+	{
+		tox_extension_messages_negotiate(extension_, friend_id);
+	}
+
+	/**
+	 * See tox_extension_messages_append()
+	 */
+	uint64_t append(ToxExtPacketList *packet_list, uint32_t friend_id,
+			std::span<uint8_t const> data, Error *err = nullptr)
+	{
+		return tox_extension_messages_append(extension_, packet_list,
+						     data.data(), data.size(),
+						     friend_id, err);
+	}
+
+	/**
+	 * Append a message whose receipt can be awaited. The receipt resolves
+	 * as timed out if the friend doesn't confirm it within timeout ms
+	 */
+	Receipt append_tracked(ToxExtPacketList *packet_list, uint32_t friend_id,
+			       std::span<uint8_t const> data, uint64_t timeout,
+			       Error *err = nullptr)
+	{
+		auto state = std::make_shared<detail::ReceiptState>();
+
+		Error append_err;
+		uint64_t receipt_id = tox_extension_messages_append_tracked(
+			extension_, packet_list, data.data(), data.size(),
+			friend_id, timeout, state.get(), &append_err);
+
+		if (err) {
+			*err = append_err;
+		}
+
+		if (append_err != TOX_EXTENSION_MESSAGES_SUCCESS) {
+			return Receipt();
+		}
+
+		receipts_.emplace(state.get(), state);
+		return Receipt(receipt_id, std::move(state));
+	}
+
+	/**
+	 * See tox_extension_messages_iterate()
+	 */
+	void iterate()
+	{
+		tox_extension_messages_iterate(extension_);
+	}
+
+	uint64_t max_sending_size(uint32_t friend_id,
+				  Error *err = nullptr) const
+	{
+		return tox_extension_messages_get_max_sending_size(
+			extension_, friend_id, err);
+	}
+
+	uint64_t max_receiving_size() const
+	{
+		return tox_extension_messages_get_max_receiving_size(extension_);
+	}
+
+    private:
+	static void received_trampoline(uint32_t friend_id,
+					uint8_t const *message, size_t size,
+					void *user_data) noexcept
+	{
+		auto *self = static_cast<Messages *>(user_data);
+		self->on_message_(friend_id,
+				  ReceivedMessage(self->extension_,
+						  { message, size }));
+	}
+
+	static void receipt_trampoline(uint32_t friend_id, uint64_t receipt_id,
+				       void *user_data) noexcept
+	{
+		auto *self = static_cast<Messages *>(user_data);
+		self->on_receipt_(friend_id, receipt_id);
+	}
+
+	static void negotiated_trampoline(uint32_t friend_id, bool compatible,
+					  uint64_t max_sending_size,
+					  void *user_data) noexcept
+	{
+		auto *self = static_cast<Messages *>(user_data);
+		self->on_negotiated_(friend_id, compatible, max_sending_size);
+	}
+
+	static void completion_trampoline(uint32_t friend_id,
+					  uint64_t receipt_id,
+					  ReceiptStatus status, void *context,
+					  void *user_data) noexcept
+	{
+		(void)friend_id;
+		(void)receipt_id;
+		auto *self = static_cast<Messages *>(user_data);
+		auto it = self->receipts_.find(
+			static_cast<detail::ReceiptState *>(context));
+
+		if (it == self->receipts_.end()) {
+			return;
+		}
+
+		/* Keep the state alive while the waiter runs */
+		std::shared_ptr<detail::ReceiptState> state =
+			std::move(it->second);
+		self->receipts_.erase(it);
+
+		state->done = true;
+		state->status = status;
+		/* An exception escaping the coroutine ends up in std::terminate */
+		if (state->waiter) {
+			std::exchange(state->waiter, nullptr).resume();
+		}
+	}
+
+	OnMessage on_message_;
+	OnReceipt on_receipt_;
+	OnNegotiated on_negotiated_;
+	ToxExtensionMessages *extension_;
+	/* Receipts still waiting on the instance, owned until they complete */
+	std::unordered_map<detail::ReceiptState *,
+			   std::shared_ptr<detail::ReceiptState>>
+		receipts_;
+};
+
+} // namespace tox_extension_messages
@@ -0,0 +1,625 @@
+#define _GNU_SOURCE
+
+#include "tox_extension_messages_shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_MIN_SIZE 4096
+#define SHM_CACHE_LINE 64
+#define SHM_RECORD_ALIGN 8
+
+#define SHM_RECORD_PADDING 1
+
+/*
+ * Start of the shared mapping, the ring follows at SHM_CONTROL_SIZE. Producer
+ * and consumer state live on separate cache lines so they don't bounce
+ * between the two processes
+ */
+struct ShmControl {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t capacity;
+	/* Written by the producer */
+	_Alignas(SHM_CACHE_LINE) _Atomic uint64_t head;
+	_Atomic uint32_t producer_waiting;
+	/* Written by the consumer */
+	_Alignas(SHM_CACHE_LINE) _Atomic uint64_t tail;
+	_Atomic uint32_t consumer_waiting;
+};
+
+#define SHM_CONTROL_SIZE                                                       \
+	((sizeof(struct ShmControl) + SHM_CACHE_LINE - 1) &                    \
+	 ~(size_t)(SHM_CACHE_LINE - 1))
+
+/*
+ * Both sides are on the same machine so records are in host byte order. A
+ * record never wraps, the producer pads to the end of the ring instead. Gaps
+ * too small for a header are skipped without one
+ */
+struct ShmRecord {
+	uint32_t friend_id;
+	uint32_t flags;
+	uint64_t receipt_id;
+	uint64_t size;
+};
+
+/*
+ * A delivered message waiting for its receipt. Entries still holding data
+ * haven't made it into the ring yet
+ */
+struct ShmEntry {
+	uint32_t friend_id;
+	uint64_t receipt_id;
+	/* Ring position after the record once written */
+	uint64_t end;
+	uint8_t *data;
+	size_t size;
+};
+
+struct ToxExtensionMessagesShmProducer {
+	struct ToxExtensionMessages *extension;
+	struct Tox_Extension_Messages_Shm_Fds fds;
+	struct ShmControl *control;
+	uint8_t *ring;
+	size_t capacity;
+	uint64_t head;
+	/* entries[begin, end) in delivery order, [begin, unwritten) are in the ring */
+	struct ShmEntry *entries;
+	size_t entries_capacity;
+	size_t begin;
+	size_t unwritten;
+	size_t end;
+};
+
+struct ToxExtensionMessagesShmConsumer {
+	struct Tox_Extension_Messages_Shm_Fds fds;
+	struct ShmControl *control;
+	uint8_t *ring;
+	size_t capacity;
+	/* Position of the next record to read, tail trails it until release */
+	uint64_t read_pos;
+	/* Set once the producer published a record we can't trust */
+	bool broken;
+};
+
+static size_t record_size(size_t size)
+{
+	return (sizeof(struct ShmRecord) + size + SHM_RECORD_ALIGN - 1) &
+	       ~(size_t)(SHM_RECORD_ALIGN - 1);
+}
+
+static size_t mapping_size(size_t capacity)
+{
+	return SHM_CONTROL_SIZE + capacity;
+}
+
+static void ring_doorbell(int fd)
+{
+	uint64_t one = 1;
+	/* A full counter already wakes the other side, nothing to handle */
+	ssize_t ret = write(fd, &one, sizeof(one));
+	(void)ret;
+}
+
+static void drain_doorbell(int fd)
+{
+	uint64_t count;
+	ssize_t ret = read(fd, &count, sizeof(count));
+	(void)ret;
+}
+
+static void close_fds(struct Tox_Extension_Messages_Shm_Fds *fds)
+{
+	if (fds->memory_fd >= 0) {
+		close(fds->memory_fd);
+	}
+	if (fds->data_fd >= 0) {
+		close(fds->data_fd);
+	}
+	if (fds->ack_fd >= 0) {
+		close(fds->ack_fd);
+	}
+}
+
+/*
+ * Bytes needed to write a record of size at head, including padding to the
+ * end of the ring if it doesn't fit before it
+ */
+static size_t space_needed(struct ToxExtensionMessagesShmProducer const *producer,
+			   size_t size)
+{
+	size_t offset = producer->head & (producer->capacity - 1);
+	size_t needed = record_size(size);
+
+	if (offset + needed > producer->capacity) {
+		needed += producer->capacity - offset;
+	}
+
+	return needed;
+}
+
+static bool ring_fits(struct ToxExtensionMessagesShmProducer const *producer,
+		      size_t size)
+{
+	uint64_t tail = atomic_load_explicit(&producer->control->tail,
+					     memory_order_acquire);
+	return space_needed(producer, size) <=
+	       producer->capacity - (producer->head - tail);
+}
+
+/*
+ * Copy a message into the ring and publish it. Returns false if there isn't
+ * space for it right now
+ */
+static bool ring_push(struct ToxExtensionMessagesShmProducer *producer,
+		      uint32_t friend_id, uint64_t receipt_id,
+		      uint8_t const *data, size_t size, uint64_t *end)
+{
+	if (!ring_fits(producer, size)) {
+		return false;
+	}
+
+	struct ShmControl *control = producer->control;
+	uint64_t head = producer->head;
+	size_t offset = head & (producer->capacity - 1);
+	size_t needed = record_size(size);
+	size_t padding = space_needed(producer, size) - needed;
+
+	if (padding >= sizeof(struct ShmRecord)) {
+		struct ShmRecord pad = {
+			.flags = SHM_RECORD_PADDING,
+			.size = padding - sizeof(struct ShmRecord),
+		};
+		memcpy(producer->ring + offset, &pad, sizeof(pad));
+	}
+
+	head += padding;
+	offset = head & (producer->capacity - 1);
+
+	struct ShmRecord record = {
+		.friend_id = friend_id,
+		.receipt_id = receipt_id,
+		.size = size,
+	};
+	memcpy(producer->ring + offset, &record, sizeof(record));
+	memcpy(producer->ring + offset + sizeof(record), data, size);
+
+	head += needed;
+	producer->head = head;
+	*end = head;
+
+	atomic_store_explicit(&control->head, head, memory_order_release);
+
+	/*
+	 * Pairs with the fence in consumer_wait. Either the consumer sees the
+	 * new head or we see it waiting
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&control->consumer_waiting,
+				 memory_order_relaxed)) {
+		ring_doorbell(producer->fds.data_fd);
+	}
+
+	return true;
+}
+
+static struct ShmEntry *
+reserve_entry(struct ToxExtensionMessagesShmProducer *producer)
+{
+	if (producer->end == producer->entries_capacity) {
+		if (producer->begin > 0) {
+			memmove(producer->entries,
+				producer->entries + producer->begin,
+				(producer->end - producer->begin) *
+					sizeof(struct ShmEntry));
+			producer->unwritten -= producer->begin;
+			producer->end -= producer->begin;
+			producer->begin = 0;
+		} else {
+			size_t new_capacity = producer->entries_capacity ?
+						      producer->entries_capacity * 2 :
+						      64;
+			struct ShmEntry *entries =
+				realloc(producer->entries,
+					new_capacity * sizeof(struct ShmEntry));
+
+			if (!entries) {
+				return NULL;
+			}
+
+			producer->entries = entries;
+			producer->entries_capacity = new_capacity;
+		}
+	}
+
+	return &producer->entries[producer->end];
+}
+
+struct ToxExtensionMessagesShmProducer *
+tox_extension_messages_shm_producer_create(
+	struct ToxExtensionMessages *extension, size_t size)
+{
+	size_t capacity = SHM_MIN_SIZE;
+	while (capacity < size) {
+		capacity *= 2;
+	}
+
+	struct ToxExtensionMessagesShmProducer *producer =
+		calloc(1, sizeof(struct ToxExtensionMessagesShmProducer));
+
+	if (!producer) {
+		return NULL;
+	}
+
+	producer->extension = extension;
+	producer->capacity = capacity;
+	producer->fds.memory_fd = memfd_create("tox_extension_messages",
+					       MFD_CLOEXEC);
+	producer->fds.data_fd = eventfd(0, EFD_CLOEXEC);
+	producer->fds.ack_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if (producer->fds.memory_fd < 0 || producer->fds.data_fd < 0 ||
+	    producer->fds.ack_fd < 0) {
+		goto err;
+	}
+
+	if (ftruncate(producer->fds.memory_fd, mapping_size(capacity)) != 0) {
+		goto err;
+	}
+
+	void *mapping = mmap(NULL, mapping_size(capacity),
+			     PROT_READ | PROT_WRITE, MAP_SHARED,
+			     producer->fds.memory_fd, 0);
+
+	if (mapping == MAP_FAILED) {
+		goto err;
+	}
+
+	producer->control = mapping;
+	producer->ring = (uint8_t *)mapping + SHM_CONTROL_SIZE;
+
+	/* The memfd starts out zeroed, which is an empty ring */
+	producer->control->magic = TOX_EXTENSION_MESSAGES_SHM_MAGIC;
+	producer->control->version = TOX_EXTENSION_MESSAGES_SHM_VERSION;
+	producer->control->capacity = capacity;
+
+	return producer;
+
+err:
+	close_fds(&producer->fds);
+	free(producer);
+	return NULL;
+}
+
+void tox_extension_messages_shm_producer_get_fds(
+	struct ToxExtensionMessagesShmProducer const *producer,
+	struct Tox_Extension_Messages_Shm_Fds *fds)
+{
+	*fds = producer->fds;
+}
+
+bool tox_extension_messages_shm_producer_deliver(
+	struct ToxExtensionMessagesShmProducer *producer, uint32_t friend_id,
+	uint8_t const *message, size_t size)
+{
+	/*
+	 * Padding is always smaller than the record it makes room for, so
+	 * records up to half the ring fit once the consumer catches up
+	 */
+	if (record_size(size) > producer->capacity / 2) {
+		return false;
+	}
+
+	struct ShmEntry *entry = reserve_entry(producer);
+
+	if (!entry) {
+		return false;
+	}
+
+	entry->friend_id = friend_id;
+	entry->data = NULL;
+	entry->size = size;
+
+	enum Tox_Extension_Messages_Error err;
+
+	/*
+	 * Messages already queued have to reach the consumer first. Only the
+	 * consumer frees up space so a fit checked here can't go away
+	 */
+	if (producer->unwritten == producer->end && ring_fits(producer, size)) {
+		entry->receipt_id = tox_extension_messages_defer_receipt(
+			producer->extension, &err);
+
+		if (err != TOX_EXTENSION_MESSAGES_SUCCESS) {
+			return false;
+		}
+
+		ring_push(producer, friend_id, entry->receipt_id, message, size,
+			  &entry->end);
+		producer->unwritten++;
+		producer->end++;
+		return true;
+	}
+
+	/*
+	 * No space, hold on to the message until the consumer catches up.
+	 * Taking it saves a copy for messages that came in several segments
+	 */
+	size_t taken_size;
+	entry->data = tox_extension_messages_take_message(producer->extension,
+							  &taken_size);
+
+	if (!entry->data) {
+		return false;
+	}
+
+	entry->receipt_id =
+		tox_extension_messages_defer_receipt(producer->extension, &err);
+
+	if (err != TOX_EXTENSION_MESSAGES_SUCCESS) {
+		free(entry->data);
+		return false;
+	}
+
+	producer->end++;
+
+	/* Ask the consumer to tell us when it frees up space */
+	atomic_store_explicit(&producer->control->producer_waiting, 1,
+			      memory_order_seq_cst);
+	return true;
+}
+
+void tox_extension_messages_shm_producer_poll(
+	struct ToxExtensionMessagesShmProducer *producer)
+{
+	struct ShmControl *control = producer->control;
+
+	drain_doorbell(producer->fds.ack_fd);
+
+	uint64_t tail = atomic_load_explicit(&control->tail, memory_order_acquire);
+
+	while (producer->begin < producer->unwritten &&
+	       producer->entries[producer->begin].end <= tail) {
+		struct ShmEntry *entry = &producer->entries[producer->begin];
+		tox_extension_messages_send_receipt(producer->extension,
+						    entry->friend_id,
+						    entry->receipt_id, NULL);
+		producer->begin++;
+	}
+
+	while (producer->unwritten < producer->end) {
+		struct ShmEntry *entry = &producer->entries[producer->unwritten];
+
+		if (!ring_push(producer, entry->friend_id, entry->receipt_id,
+			       entry->data, entry->size, &entry->end)) {
+			break;
+		}
+
+		free(entry->data);
+		entry->data = NULL;
+		producer->unwritten++;
+	}
+
+	atomic_store_explicit(&control->producer_waiting,
+			      producer->unwritten < producer->end,
+			      memory_order_seq_cst);
+
+	if (producer->begin == producer->end) {
+		producer->begin = 0;
+		producer->unwritten = 0;
+		producer->end = 0;
+	}
+}
+
+size_t tox_extension_messages_shm_producer_get_pending(
+	struct ToxExtensionMessagesShmProducer const *producer)
+{
+	return producer->end - producer->begin;
+}
+
+void tox_extension_messages_shm_producer_free(
+	struct ToxExtensionMessagesShmProducer *producer)
+{
+	if (!producer) {
+		return;
+	}
+
+	for (size_t i = producer->unwritten; i < producer->end; ++i) {
+		free(producer->entries[i].data);
+	}
+
+	munmap(producer->control, mapping_size(producer->capacity));
+	close_fds(&producer->fds);
+	free(producer->entries);
+	free(producer);
+}
+
+struct ToxExtensionMessagesShmConsumer *tox_extension_messages_shm_consumer_open(
+	struct Tox_Extension_Messages_Shm_Fds const *fds)
+{
+	struct ToxExtensionMessagesShmConsumer *consumer =
+		malloc(sizeof(struct ToxExtensionMessagesShmConsumer));
+
+	if (!consumer) {
+		return NULL;
+	}
+
+	consumer->broken = false;
+	consumer->control = NULL;
+	consumer->fds.memory_fd = fcntl(fds->memory_fd, F_DUPFD_CLOEXEC, 0);
+	consumer->fds.data_fd = fcntl(fds->data_fd, F_DUPFD_CLOEXEC, 0);
+	consumer->fds.ack_fd = fcntl(fds->ack_fd, F_DUPFD_CLOEXEC, 0);
+
+	if (consumer->fds.memory_fd < 0 || consumer->fds.data_fd < 0 ||
+	    consumer->fds.ack_fd < 0) {
+		goto err;
+	}
+
+	struct stat memory_stat;
+	if (fstat(consumer->fds.memory_fd, &memory_stat) != 0 ||
+	    (size_t)memory_stat.st_size < mapping_size(SHM_MIN_SIZE)) {
+		goto err;
+	}
+
+	void *mapping = mmap(NULL, memory_stat.st_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED, consumer->fds.memory_fd, 0);
+
+	if (mapping == MAP_FAILED) {
+		goto err;
+	}
+
+	consumer->control = mapping;
+	consumer->ring = (uint8_t *)mapping + SHM_CONTROL_SIZE;
+	consumer->capacity = consumer->control->capacity;
+
+	if (consumer->control->magic != TOX_EXTENSION_MESSAGES_SHM_MAGIC ||
+	    consumer->control->version != TOX_EXTENSION_MESSAGES_SHM_VERSION ||
+	    (consumer->capacity & (consumer->capacity - 1)) != 0 ||
+	    mapping_size(consumer->capacity) != (size_t)memory_stat.st_size) {
+		munmap(mapping, memory_stat.st_size);
+		consumer->control = NULL;
+		goto err;
+	}
+
+	consumer->read_pos = atomic_load_explicit(&consumer->control->tail,
+						  memory_order_acquire);
+
+	return consumer;
+
+err:
+	close_fds(&consumer->fds);
+	free(consumer);
+	return NULL;
+}
+
+bool tox_extension_messages_shm_consumer_next(
+	struct ToxExtensionMessagesShmConsumer *consumer,
+	struct Tox_Extension_Messages_Shm_Message *message)
+{
+	if (consumer->broken) {
+		return false;
+	}
+
+	uint64_t head = atomic_load_explicit(&consumer->control->head,
+					     memory_order_acquire);
+
+	while (consumer->read_pos != head) {
+		size_t offset = consumer->read_pos & (consumer->capacity - 1);
+
+		if (consumer->capacity - offset < sizeof(struct ShmRecord)) {
+			consumer->read_pos += consumer->capacity - offset;
+			continue;
+		}
+
+		/*
+		 * The producer lives in another process, so nothing it wrote is
+		 * trusted. A record has to lie within what was published and
+		 * must not run past the end of the ring
+		 */
+		uint64_t available = head - consumer->read_pos;
+		if (available > consumer->capacity - offset) {
+			available = consumer->capacity - offset;
+		}
+
+		struct ShmRecord record;
+		if (available < sizeof(record)) {
+			consumer->broken = true;
+			return false;
+		}
+		memcpy(&record, consumer->ring + offset, sizeof(record));
+
+		if (record.size > available - sizeof(record) ||
+		    record_size(record.size) > available) {
+			consumer->broken = true;
+			return false;
+		}
+
+		consumer->read_pos += record_size(record.size);
+
+		if (record.flags & SHM_RECORD_PADDING) {
+			continue;
+		}
+
+		message->friend_id = record.friend_id;
+		message->receipt_id = record.receipt_id;
+		message->data = consumer->ring + offset + sizeof(record);
+		message->size = record.size;
+		message->end = consumer->read_pos;
+		return true;
+	}
+
+	return false;
+}
+
+void tox_extension_messages_shm_consumer_release(
+	struct ToxExtensionMessagesShmConsumer *consumer,
+	struct Tox_Extension_Messages_Shm_Message const *message)
+{
+	struct ShmControl *control = consumer->control;
+
+	atomic_store_explicit(&control->tail, message->end,
+			      memory_order_release);
+
+	/* Pairs with the seq_cst store of producer_waiting */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&control->producer_waiting,
+				 memory_order_relaxed)) {
+		ring_doorbell(consumer->fds.ack_fd);
+	}
+}
+
+bool tox_extension_messages_shm_consumer_wait(
+	struct ToxExtensionMessagesShmConsumer *consumer, int timeout)
+{
+	struct ShmControl *control = consumer->control;
+
+	atomic_store_explicit(&control->consumer_waiting, 1,
+			      memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	bool ready = atomic_load_explicit(&control->head,
+					  memory_order_acquire) !=
+		     consumer->read_pos;
+
+	if (!ready) {
+		struct pollfd pollfd = { .fd = consumer->fds.data_fd,
+					 .events = POLLIN };
+		int ret;
+		do {
+			ret = poll(&pollfd, 1, timeout);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret > 0) {
+			drain_doorbell(consumer->fds.data_fd);
+		}
+
+		ready = atomic_load_explicit(&control->head,
+					     memory_order_acquire) !=
+			consumer->read_pos;
+	}
+
+	atomic_store_explicit(&control->consumer_waiting, 0,
+			      memory_order_relaxed);
+	return ready;
+}
+
+void tox_extension_messages_shm_consumer_close(
+	struct ToxExtensionMessagesShmConsumer *consumer)
+{
+	if (!consumer) {
+		return;
+	}
+
+	munmap(consumer->control, mapping_size(consumer->capacity));
+	close_fds(&consumer->fds);
+	free(consumer);
+}
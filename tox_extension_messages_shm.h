@@ -0,0 +1,164 @@
+#pragma once
+
+#include "tox_extension_messages.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Hands completed messages to a consumer in another process through a single
+ * producer single consumer ring in shared memory (Linux only, memfd backed).
+ * The tox thread copies each message into the ring once, the consumer reads
+ * it in place and releases it when done. Receipts are held back until the
+ * consumer has released the message, so the sender only sees a message as
+ * delivered once the consumer has actually dealt with it.
+ *
+ * Doorbells are eventfds that are only signalled while the other side is
+ * waiting, so a busy ring costs no syscalls.
+ *
+ * Producer side, on the tox thread:
+ *
+ *   producer = tox_extension_messages_shm_producer_create(extension, size);
+ *   tox_extension_messages_shm_producer_get_fds(producer, &fds);
+ *   ... pass fds to the consumer (fork or SCM_RIGHTS) ...
+ *
+ *   received_cb:
+ *     if (!tox_extension_messages_shm_producer_deliver(producer, friend_id,
+ *                                                      message, size))
+ *             handle_in_process(message, size);
+ *
+ *   main loop:
+ *     tox_iterate(tox, ...);
+ *     tox_extension_messages_shm_producer_poll(producer);
+ *
+ * Consumer side:
+ *
+ *   consumer = tox_extension_messages_shm_consumer_open(&fds);
+ *   while (tox_extension_messages_shm_consumer_wait(consumer, -1))
+ *           while (tox_extension_messages_shm_consumer_next(consumer, &message)) {
+ *                   handle(message.data, message.size);
+ *                   tox_extension_messages_shm_consumer_release(consumer, &message);
+ *           }
+ */
+
+#define TOX_EXTENSION_MESSAGES_SHM_MAGIC 0x54584d52
+#define TOX_EXTENSION_MESSAGES_SHM_VERSION 1
+#define TOX_EXTENSION_MESSAGES_SHM_DEFAULT_SIZE (16 * 1024 * 1024)
+
+struct ToxExtensionMessagesShmProducer;
+struct ToxExtensionMessagesShmConsumer;
+
+/**
+ * Everything a consumer needs to attach to a ring. Owned by the producer
+ */
+struct Tox_Extension_Messages_Shm_Fds {
+	int memory_fd;
+	/* Readable when the producer has published messages */
+	int data_fd;
+	/* Readable when the consumer has released space the producer waits on */
+	int ack_fd;
+};
+
+/**
+ * A message read from the ring. data points into shared memory and stays
+ * valid until the message is released
+ */
+struct Tox_Extension_Messages_Shm_Message {
+	uint32_t friend_id;
+	uint64_t receipt_id;
+	uint8_t const *data;
+	size_t size;
+	/* Ring position after this message, used by release */
+	uint64_t end;
+};
+
+/**
+ * Create a ring of at least size bytes for messages received by extension.
+ * size is rounded up to a power of two. Returns NULL on failure
+ */
+struct ToxExtensionMessagesShmProducer *
+tox_extension_messages_shm_producer_create(
+	struct ToxExtensionMessages *extension, size_t size);
+
+void tox_extension_messages_shm_producer_get_fds(
+	struct ToxExtensionMessagesShmProducer const *producer,
+	struct Tox_Extension_Messages_Shm_Fds *fds);
+
+/**
+ * Hand the message currently passed to the received callback to the consumer.
+ * Must be called from the received callback. The receipt is sent by
+ * tox_extension_messages_shm_producer_poll() once the consumer releases the
+ * message. If the ring is full the message is kept until there is space.
+ *
+ * Returns false if the message is larger than half the ring or couldn't be
+ * queued. The receipt is then sent as usual and the caller has to deal with
+ * the message itself
+ */
+bool tox_extension_messages_shm_producer_deliver(
+	struct ToxExtensionMessagesShmProducer *producer, uint32_t friend_id,
+	uint8_t const *message, size_t size);
+
+/**
+ * Send receipts for messages the consumer released and move queued messages
+ * into the ring. Call from the tox thread after tox_iterate() or when ack_fd
+ * is readable
+ */
+void tox_extension_messages_shm_producer_poll(
+	struct ToxExtensionMessagesShmProducer *producer);
+
+/**
+ * Number of delivered messages not yet released by the consumer, including
+ * the ones waiting for space in the ring
+ */
+size_t tox_extension_messages_shm_producer_get_pending(
+	struct ToxExtensionMessagesShmProducer const *producer);
+
+/**
+ * Unmap the ring and close the fds. Receipts for messages the consumer has not
+ * released yet are never sent
+ */
+void tox_extension_messages_shm_producer_free(
+	struct ToxExtensionMessagesShmProducer *producer);
+
+/**
+ * Attach to a ring. The fds are duplicated so the caller keeps ownership of
+ * the ones passed in. Returns NULL if the fds don't describe a ring
+ */
+struct ToxExtensionMessagesShmConsumer *tox_extension_messages_shm_consumer_open(
+	struct Tox_Extension_Messages_Shm_Fds const *fds);
+
+/**
+ * Read the next message without releasing it. Returns false if the ring is
+ * empty, or for good once the producer published a record that doesn't fit in
+ * the ring
+ */
+bool tox_extension_messages_shm_consumer_next(
+	struct ToxExtensionMessagesShmConsumer *consumer,
+	struct Tox_Extension_Messages_Shm_Message *message);
+
+/**
+ * Release message and every message read before it. Their receipts are sent
+ * on the producer's next poll
+ */
+void tox_extension_messages_shm_consumer_release(
+	struct ToxExtensionMessagesShmConsumer *consumer,
+	struct Tox_Extension_Messages_Shm_Message const *message);
+
+/**
+ * Wait up to timeout ms (-1 for ever) for a message to read. Returns true if
+ * one is available
+ */
+bool tox_extension_messages_shm_consumer_wait(
+	struct ToxExtensionMessagesShmConsumer *consumer, int timeout);
+
+void tox_extension_messages_shm_consumer_close(
+	struct ToxExtensionMessagesShmConsumer *consumer);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,223 @@
+#include "tox_extension_messages_trace.h"
+
+#include <toxext/toxext_util.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* How long the writer sleeps when there is nothing to write */
+#define TRACE_WRITER_IDLE_NS (1000 * 1000)
+
+struct ToxExtensionMessagesTrace {
+	FILE *file;
+	pthread_t writer;
+	uint8_t *ring;
+	size_t ring_mask;
+	/*
+	 * head is only written by the tox thread and tail only by the writer.
+	 * Both count bytes since the start and are masked on access
+	 */
+	_Atomic size_t head;
+	_Atomic size_t tail;
+	_Atomic bool stopping;
+	_Atomic uint64_t dropped;
+	_Atomic uint64_t write_errors;
+};
+
+static uint64_t get_time_ns(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static void ring_write(struct ToxExtensionMessagesTrace *trace, size_t pos,
+		       uint8_t const *data, size_t size)
+{
+	size_t offset = pos & trace->ring_mask;
+	size_t first = trace->ring_mask + 1 - offset;
+
+	if (first > size) {
+		first = size;
+	}
+
+	memcpy(trace->ring + offset, data, first);
+	memcpy(trace->ring, data + first, size - first);
+}
+
+static bool write_ring(struct ToxExtensionMessagesTrace *trace, size_t begin,
+		       size_t end)
+{
+	size_t offset = begin & trace->ring_mask;
+	size_t size = end - begin;
+	size_t first = trace->ring_mask + 1 - offset;
+
+	if (first > size) {
+		first = size;
+	}
+
+	return fwrite(trace->ring + offset, 1, first, trace->file) == first &&
+	       fwrite(trace->ring, 1, size - first, trace->file) == size - first;
+}
+
+static void *trace_writer(void *userdata)
+{
+	struct ToxExtensionMessagesTrace *trace = userdata;
+	struct timespec idle = { 0, TRACE_WRITER_IDLE_NS };
+	bool unflushed = false;
+
+	while (true) {
+		/* Read stopping first so nothing recorded before stop is missed */
+		bool stopping =
+			atomic_load_explicit(&trace->stopping, memory_order_acquire);
+		size_t head =
+			atomic_load_explicit(&trace->head, memory_order_acquire);
+		size_t tail =
+			atomic_load_explicit(&trace->tail, memory_order_relaxed);
+
+		if (head == tail) {
+			/* Flush once caught up so errors show up while running */
+			if (unflushed && fflush(trace->file) != 0) {
+				atomic_fetch_add_explicit(&trace->write_errors,
+							  1,
+							  memory_order_relaxed);
+			}
+			unflushed = false;
+
+			if (stopping) {
+				break;
+			}
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		if (!write_ring(trace, tail, head)) {
+			atomic_fetch_add_explicit(&trace->write_errors, 1,
+						  memory_order_relaxed);
+		}
+		unflushed = true;
+		atomic_store_explicit(&trace->tail, head, memory_order_release);
+	}
+
+	return NULL;
+}
+
+struct ToxExtensionMessagesTrace *
+tox_extension_messages_trace_start(char const *path, size_t ring_size)
+{
+	size_t capacity = 1024;
+	while (capacity < ring_size) {
+		capacity *= 2;
+	}
+
+	struct ToxExtensionMessagesTrace *trace =
+		malloc(sizeof(struct ToxExtensionMessagesTrace));
+
+	if (!trace) {
+		return NULL;
+	}
+
+	trace->ring = malloc(capacity);
+	trace->file = fopen(path, "wb");
+
+	if (!trace->ring || !trace->file) {
+		goto err;
+	}
+
+	trace->ring_mask = capacity - 1;
+	atomic_init(&trace->head, 0);
+	atomic_init(&trace->tail, 0);
+	atomic_init(&trace->stopping, false);
+	atomic_init(&trace->dropped, 0);
+	atomic_init(&trace->write_errors, 0);
+
+	uint8_t header[TOX_EXTENSION_MESSAGES_TRACE_HEADER_SIZE];
+	memcpy(header, TOX_EXTENSION_MESSAGES_TRACE_MAGIC, 4);
+	toxext_write_to_buf(TOX_EXTENSION_MESSAGES_TRACE_VERSION, header + 4,
+			    4);
+
+	if (fwrite(header, 1, sizeof(header), trace->file) != sizeof(header)) {
+		goto err;
+	}
+
+	if (pthread_create(&trace->writer, NULL, trace_writer, trace) != 0) {
+		goto err;
+	}
+
+	return trace;
+
+err:
+	if (trace->file) {
+		fclose(trace->file);
+	}
+	free(trace->ring);
+	free(trace);
+	return NULL;
+}
+
+void tox_extension_messages_trace_attach(
+	struct ToxExtensionMessagesTrace *trace,
+	struct ToxExtensionMessages *extension)
+{
+	tox_extension_messages_set_trace_cb(
+		extension, tox_extension_messages_trace_record, trace);
+}
+
+void tox_extension_messages_trace_record(
+	uint32_t friend_id,
+	enum Tox_Extension_Messages_Trace_Direction direction,
+	uint8_t const *data, size_t size, void *trace_user_data)
+{
+	struct ToxExtensionMessagesTrace *trace = trace_user_data;
+	size_t record_size =
+		TOX_EXTENSION_MESSAGES_TRACE_RECORD_HEADER_SIZE + size;
+
+	size_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&trace->tail, memory_order_acquire);
+
+	if (size > UINT16_MAX ||
+	    record_size > trace->ring_mask + 1 - (head - tail)) {
+		atomic_fetch_add_explicit(&trace->dropped, 1,
+					  memory_order_relaxed);
+		return;
+	}
+
+	uint8_t header[TOX_EXTENSION_MESSAGES_TRACE_RECORD_HEADER_SIZE];
+	toxext_write_to_buf(get_time_ns(), header, 8);
+	toxext_write_to_buf(friend_id, header + 8, 4);
+	header[12] = direction;
+	toxext_write_to_buf(size, header + 13, 2);
+
+	ring_write(trace, head, header, sizeof(header));
+	ring_write(trace, head + sizeof(header), data, size);
+
+	atomic_store_explicit(&trace->head, head + record_size,
+			      memory_order_release);
+}
+
+uint64_t tox_extension_messages_trace_get_dropped(
+	struct ToxExtensionMessagesTrace const *trace)
+{
+	return atomic_load_explicit(&trace->dropped, memory_order_relaxed);
+}
+
+uint64_t tox_extension_messages_trace_get_write_errors(
+	struct ToxExtensionMessagesTrace const *trace)
+{
+	return atomic_load_explicit(&trace->write_errors, memory_order_relaxed);
+}
+
+void tox_extension_messages_trace_stop(struct ToxExtensionMessagesTrace *trace)
+{
+	atomic_store_explicit(&trace->stopping, true, memory_order_release);
+	pthread_join(trace->writer, NULL);
+
+	fclose(trace->file);
+	free(trace->ring);
+	free(trace);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "tox_extension_messages.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Records every segment seen by a ToxExtensionMessages instance to a file.
+ * Segments are copied into a lock-free single producer ring from the tox
+ * thread and written out by a background thread, so tracing only costs a
+ * memcpy on the hot path. When the writer falls behind segments are dropped
+ * rather than blocking the tox thread.
+ *
+ * The file starts with TOX_EXTENSION_MESSAGES_TRACE_MAGIC followed by a
+ * big endian u32 version, followed by records of
+ *
+ *   u64 timestamp (ns, monotonic)
+ *   u32 friend id
+ *   u8  direction (enum Tox_Extension_Messages_Trace_Direction)
+ *   u16 segment size
+ *   segment bytes
+ *
+ * all big endian.
+ */
+
+#define TOX_EXTENSION_MESSAGES_TRACE_MAGIC "TXMT"
+#define TOX_EXTENSION_MESSAGES_TRACE_VERSION 1
+#define TOX_EXTENSION_MESSAGES_TRACE_HEADER_SIZE (4 + 4)
+#define TOX_EXTENSION_MESSAGES_TRACE_RECORD_HEADER_SIZE (8 + 4 + 1 + 2)
+#define TOX_EXTENSION_MESSAGES_TRACE_DEFAULT_RING_SIZE (4 * 1024 * 1024)
+
+struct ToxExtensionMessagesTrace;
+
+/**
+ * Open path for writing and start the writer thread. ring_size is rounded up
+ * to a power of two. Returns NULL on failure
+ */
+struct ToxExtensionMessagesTrace *
+tox_extension_messages_trace_start(char const *path, size_t ring_size);
+
+/**
+ * Start tracing extension into trace
+ */
+void tox_extension_messages_trace_attach(
+	struct ToxExtensionMessagesTrace *trace,
+	struct ToxExtensionMessages *extension);
+
+/**
+ * Trace callback writing into the trace passed as trace_user_data. Only for
+ * users that need to wrap the callback, otherwise use
+ * tox_extension_messages_trace_attach()
+ */
+void tox_extension_messages_trace_record(
+	uint32_t friend_id,
+	enum Tox_Extension_Messages_Trace_Direction direction,
+	uint8_t const *data, size_t size, void *trace_user_data);
+
+/**
+ * Number of segments dropped because the ring was full
+ */
+uint64_t tox_extension_messages_trace_get_dropped(
+	struct ToxExtensionMessagesTrace const *trace);
+
+/**
+ * Number of writes to the file that failed, e.g. because the disk is full.
+ * The segments in a failed write are lost so the file is incomplete once this
+ * is non zero
+ */
+uint64_t tox_extension_messages_trace_get_write_errors(
+	struct ToxExtensionMessagesTrace const *trace);
+
+/**
+ * Flush everything recorded so far, stop the writer thread and close the
+ * file. Detach the trace from every extension before calling this
+ */
+void tox_extension_messages_trace_stop(struct ToxExtensionMessagesTrace *trace);
+
+#ifdef __cplusplus
+}
+#endif